@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+/*
+    Bump allocator over chunks of anonymous memory, for structures built
+    from many small pieces which are all freed together.  Pieces are never
+    freed one at a time: the chunks are unmapped at once when the arena is
+    destroyed.  Chunks double in size up to a limit, so small structures
+    stay small and large ones take few chunks.
+
+    Allocation is safe from several threads at once.  Each takes its piece
+    of the current chunk with an atomic add, and only a thread finding the
+    chunk full takes the lock to map the next one.
+*/
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+class Arena {
+
+public:
+
+    Arena()
+        : current(0)
+        , chunk_count(0)
+        , mapped(0)
+    {
+        pthread_mutex_init(&lock, 0);
+    }
+
+    virtual ~Arena()
+    {
+        Chunk *chunk = current;
+        while (chunk) {
+            Chunk *prev = chunk->prev;
+            munmap(chunk, chunk->size);
+            chunk = prev;
+        }
+
+        pthread_mutex_destroy(&lock);
+    }
+
+    /** Allocates size bytes aligned to a multiple of 16.
+
+        \return The memory, or null if no more could be mapped.
+    */
+    void *allocate(size_t size)
+    {
+        size = (size + alignment - 1) & ~(alignment - 1);
+
+        for (;;) {
+            Chunk *chunk = current;
+            if (chunk) {
+                size_t offset = __sync_fetch_and_add(&chunk->used, size);
+                if (offset + size <= chunk->size) return (char *)chunk + offset;
+            }
+
+            pthread_mutex_lock(&lock);
+            bool ok = current != chunk || grow(size);
+            pthread_mutex_unlock(&lock);
+
+            if (!ok) return 0;
+        }
+    }
+
+    //bytes of memory mapped
+    size_t size() const
+    {
+        return mapped;
+    }
+
+private:
+
+    static const size_t alignment = 16;
+    static const size_t first_chunk_size = 1 << 16;
+    static const size_t max_chunk_size = 1 << 24;
+
+    //header at the start of each chunk, followed by the pieces allocated from it
+    struct Chunk {
+        Chunk *prev;
+        size_t size;
+        volatile size_t used;
+    };
+
+    Chunk * volatile current;
+    size_t chunk_count;
+    size_t mapped;
+    pthread_mutex_t lock;
+
+    //maps a chunk with room for size bytes, called with the lock held
+    bool grow(size_t size)
+    {
+        size_t header = (sizeof(Chunk) + alignment - 1) & ~(alignment - 1);
+        size_t chunk_size = first_chunk_size << std::min<size_t>(chunk_count, 8);
+        if (chunk_size > max_chunk_size) chunk_size = max_chunk_size;
+        if (chunk_size < header + size) chunk_size = header + size;
+
+        void *memory = mmap(0, chunk_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+        if (memory == MAP_FAILED) return false;
+
+        Chunk *chunk = (Chunk *)memory;
+        chunk->prev = current;
+        chunk->size = chunk_size;
+        chunk->used = header;
+
+        //the chunk is complete before other threads can see it
+        __sync_synchronize();
+        current = chunk;
+
+        ++chunk_count;
+        mapped += chunk_size;
+
+        return true;
+    }
+
+    Arena(const Arena &);
+    void operator=(const Arena &);
+};
+
+#endif
@@ -0,0 +1,261 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CACHE_REBUILD_H_
+#define CACHE_REBUILD_H_
+
+/*
+    Support for rebuilding an odds-on cache in the background while it is
+    being queried.  Queries report their hits to a HitRateMonitor and
+    record themselves in a QueryReservoir.  When the hit rate drifts below
+    a threshold a new cache is built from the reservoir on another thread
+    and published by swapping a single pointer.  Queries mark the time
+    they may hold the old pointer with Epochs, and the old cache is freed
+    once none can.  None of these ever block a query.
+*/
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "terminal_test.h"
+
+/*
+    Read-copy-update grace periods.  Readers enter before loading a shared
+    pointer and leave once they are done with what it points to; a writer
+    replaces the pointer and then calls synchronize, after which no reader
+    can still hold the old value.  Readers count themselves against one of
+    two epochs, so a steady stream of new readers cannot keep the writer
+    waiting.  There must be at most one writer at a time.
+*/
+class Epochs {
+
+public:
+
+    Epochs() : epoch(0)
+    {
+        active[0] = active[1] = 0;
+    }
+
+    //returns the epoch to pass to leave
+    size_t enter()
+    {
+        size_t e = __sync_fetch_and_add(&epoch, 0) & 1;
+        __sync_fetch_and_add(&active[e], 1);
+        return e;
+    }
+
+    void leave(size_t e)
+    {
+        __sync_fetch_and_sub(&active[e], 1);
+    }
+
+    /** Waits until every reader which entered before the call has left.
+        Readers counted against the old epoch may have read the epoch
+        before an earlier flip, so both epochs are drained in turn.
+    */
+    void synchronize()
+    {
+        for (size_t i = 0; i < 2; ++i) {
+            size_t e = __sync_fetch_and_add(&epoch, 1) & 1;
+            while (__sync_fetch_and_add(&active[e], 0)) sched_yield();
+        }
+    }
+
+private:
+
+    volatile size_t epoch;
+    volatile long active[2];
+
+    Epochs(const Epochs &);
+    void operator=(const Epochs &);
+};
+
+/*
+    The most recent queries, kept in a ring.  A query arriving while
+    another thread is recording is dropped rather than waiting for it.
+*/
+template<class Point> class QueryReservoir {
+
+public:
+
+    QueryReservoir(size_t size)
+        : pts(size ? size : 1)
+        , next(0)
+        , count(0)
+    {
+        pthread_mutex_init(&lock, 0);
+    }
+
+    virtual ~QueryReservoir()
+    {
+        pthread_mutex_destroy(&lock);
+    }
+
+    void record(const Point &pt)
+    {
+        if (pthread_mutex_trylock(&lock)) return;
+
+        pts[next] = pt;
+        next = (next + 1) % pts.size();
+        if (count < pts.size()) ++count;
+
+        pthread_mutex_unlock(&lock);
+    }
+
+    //copies out the recorded queries, returning how many there are
+    size_t snapshot(std::vector<Point> &out)
+    {
+        pthread_mutex_lock(&lock);
+        out.assign(pts.begin(), pts.begin() + count);
+        pthread_mutex_unlock(&lock);
+
+        return out.size();
+    }
+
+private:
+
+    std::vector<Point> pts;
+    size_t next;
+    size_t count;
+    pthread_mutex_t lock;
+
+    QueryReservoir(const QueryReservoir &);
+    void operator=(const QueryReservoir &);
+};
+
+/*
+    Hit rate over consecutive windows of queries.  The rate of the first
+    window after each (re)build is the baseline, and the cache has drifted
+    once a window's rate is below both the threshold and, by a margin, the
+    baseline.  Comparing against the baseline stops a query distribution
+    which no cache serves well from causing rebuild after rebuild.
+*/
+class HitRateMonitor {
+
+public:
+
+    /** \param window The number of queries in each window.
+        \param threshold The hit rate below which the cache may have drifted.
+    */
+    HitRateMonitor(size_t window, double threshold)
+        : window(window ? window : 1)
+        , threshold(threshold)
+        , hits(0)
+        , queries(0)
+        , baseline(-1)
+        , last(-1)
+    {
+    }
+
+    /** Adds the hits and queries counted by one thread since it last
+        reported.  Safe to call concurrently.
+
+        \return True if this completed a window in which the cache drifted.
+    */
+    bool add(size_t new_hits, size_t new_queries)
+    {
+        __sync_fetch_and_add(&hits, new_hits);
+        size_t total = __sync_add_and_fetch(&queries, new_queries);
+
+        //only the thread which completes the window checks it
+        if (total < window || total - new_queries >= window) return false;
+
+        size_t window_hits = __sync_lock_test_and_set(&hits, 0);
+        size_t window_queries = __sync_lock_test_and_set(&queries, 0);
+
+        long rate = (long)(rate_scale * window_hits / std::max<size_t>(window_queries, 1));
+        last = rate;
+
+        if (baseline < 0) {
+            baseline = rate;
+            return false;
+        }
+
+        return rate < threshold * rate_scale && rate + drift_margin < baseline;
+    }
+
+    //starts a new baseline, once a rebuilt cache is in use
+    void reset()
+    {
+        __sync_lock_test_and_set(&hits, 0);
+        __sync_lock_test_and_set(&queries, 0);
+        baseline = -1;
+    }
+
+    //hit rate of the last complete window, or -1 if there has been none
+    double rate() const
+    {
+        return last < 0 ? -1.0 : (double)last / rate_scale;
+    }
+
+private:
+
+    //rates are stored as integers so they can be read and written atomically
+    static const long rate_scale = 1000000;
+
+    //how far below the baseline a window must fall, five points of hit rate
+    static const long drift_margin = rate_scale / 20;
+
+    size_t window;
+    double threshold;
+
+    volatile size_t hits;
+    volatile size_t queries;
+    volatile long baseline;
+    volatile long last;
+};
+
+/*
+    State shared by the queries and the rebuilds of one tree.
+*/
+template<class Point> struct CacheRebuild {
+
+    CacheRebuild(double threshold, size_t sample_size, size_t max_depth, size_t window,
+            OddsonTreeTerminalTest test)
+        : reservoir(sample_size)
+        , monitor(window, threshold)
+        , max_depth(max_depth)
+        , test(test)
+        , running(0)
+        , count(0)
+    {
+    }
+
+    QueryReservoir<Point> reservoir;
+    HitRateMonitor monitor;
+    Epochs epochs;
+
+    //used to build each new cache
+    size_t max_depth;
+    OddsonTreeTerminalTest test;
+
+    //set while a rebuild is in progress, and the number published
+    volatile long running;
+    volatile size_t count;
+};
+
+#endif
+
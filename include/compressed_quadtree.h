@@ -30,6 +30,24 @@ THE SOFTWARE.
     Eppstein, D., Goodrich, M. T., Sun, J. Z. (2008) The Skip Quadtree:
     A Simple Dynamic Data Structure for Multidimensional Data,
     Int. Journal on Computational Geometry and Applications, 18(1/2), pp. 131 - 160
+
+    As with the kd-tree, a non-zero Dim fixes the dimension at compile time.
+
+    Nodes store only their occupied children, packed in order of quadrant
+    after a bit mask of the quadrants they occupy.  The child in a quadrant
+    is found by counting the bits of the mask below it, so memory and
+    searches scale with the children actually present rather than with
+    1 << dim, which matters in higher dimensions.  Nodes and their children
+    are allocated from an arena owned by the tree and are all freed at
+    once with it, so Point must not need its destructor run.
+
+    The tree is built either by splitting the points between the children
+    of each node in turn, partitioning a single array of them as it goes, or
+    from the points sorted by Morton key.  The key
+    of a point is the sequence of children it falls in on its way down, so
+    the points of every node are a contiguous run of the sorted points and
+    its children are found by binary search, without copying any points.
+    Both give the same tree.
 */
 
 #include <algorithm>
@@ -39,27 +57,116 @@ THE SOFTWARE.
 #include <vector>
 #include <iostream>
 #include <cstring>
+#include <new>
 
+#include <stdint.h>
+
+#include "arena.h"
+#include "distance.h"
 #include "fixed_size_priority_queue.h"
 #include "priority_queue.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
 
-template<class Point> class CompressedQuadtree {
+template<class Point, int Dim = 0> class CompressedQuadtree {
 
     public:
 
         //Nodes of the quadtree
         struct Node { 
-            Node **nodes;       //children
+            Node **nodes;       //occupied children, in order of quadrant
             Point mid;          //midpoint
             double radius;      //half side length
             Point *pt;          //point, if data stored
+            unsigned int count; //points below, kept by the builds, see count_subtrees
+            bool ended;         //build ended by an EndBuildFn, pt is not a stored point
 
             Node()
-                : nodes(0), pt(0)
+                : nodes(0), pt(0), count(0), ended(false)
             {
 
             }
 
+            //the child in quadrant n, if any
+            Node *child(size_t n, size_t dim) const
+            {
+                const uint64_t *mask = occupancy(dim);
+                uint64_t bit = (uint64_t)1 << (n & 63);
+                if (!(mask[n >> 6] & bit)) return 0;
+
+                size_t rank = __builtin_popcountll(mask[n >> 6] & (bit - 1));
+                for (size_t w = 0; w < (n >> 6); ++w) {
+                    rank += __builtin_popcountll(mask[w]);
+                }
+
+                return nodes[rank];
+            }
+
+            size_t child_count(size_t dim) const
+            {
+                if (!nodes) return 0;
+
+                const uint64_t *mask = occupancy(dim);
+                size_t count = 0;
+                for (size_t w = 0; w < mask_words(dim); ++w) {
+                    count += __builtin_popcountll(mask[w]);
+                }
+
+                return count;
+            }
+
+            //the quadrant pt falls in
+            size_t quadrant(const Point &pt, size_t dim) const
+            {
+                size_t n = 0;
+                for (size_t d = 0; d < dim; ++d) {
+                    if (pt[d] > mid[d]) n += 1 << d;
+                }
+
+                return n;
+            }
+
+            /** Stores the children given by an array of one per quadrant,
+                null where a quadrant is empty, in place of any stored before,
+                allocating room for them from the arena of the tree.
+            */
+            void set_children(Node *const *children, size_t dim, Arena &arena)
+            {
+                nodes = 0;
+
+                size_t nnodes = 1 << dim;
+                size_t count = 0;
+                for (size_t n = 0; n < nnodes; ++n) {
+                    if (children[n]) ++count;
+                }
+
+                if (!count) return;
+
+                //the mask and the children share one allocation
+                size_t words = mask_words(dim);
+                uint64_t *block = (uint64_t *)arena.allocate((words + count)*sizeof(uint64_t));
+                memset(block, 0, words*sizeof(uint64_t));
+                nodes = (Node **)(block + words);
+
+                size_t i = 0;
+                for (size_t n = 0; n < nnodes; ++n) {
+                    if (children[n]) {
+                        block[n >> 6] |= (uint64_t)1 << (n & 63);
+                        nodes[i++] = children[n];
+                    }
+                }
+            }
+
+            static size_t mask_words(size_t dim)
+            {
+                return ((size_t)(1 << dim) + 63) / 64;
+            }
+
+            const uint64_t *occupancy(size_t dim) const
+            {
+                return (const uint64_t *)nodes - mask_words(dim);
+            }
+
             bool in_node(const Point &pt, size_t dim)
             {
 
@@ -81,6 +188,24 @@ template<class Point> class CompressedQuadtree {
             } 
         };
 
+        /** Scratch state for a single search.  The const query methods take
+            one of these from the caller so that a single tree can be shared
+            between threads, as long as each thread owns its own context.
+        */
+        struct SearchContext {
+            SearchContext(int size = 32)
+                : searchpq(size)
+            {
+            }
+
+            PriorityQueue<Node *> searchpq;
+
+        private:
+
+            SearchContext(const SearchContext &);
+            void operator=(const SearchContext &);
+        };
+
         struct EndBuildFn {
             virtual bool operator()(Node *, size_t depth)
             {
@@ -91,34 +216,97 @@ template<class Point> class CompressedQuadtree {
         CompressedQuadtree(size_t dim, Point *pts, size_t n, double *range, EndBuildFn &fn)
             : dim(dim)
             , nnodes(1 << dim)
-            , searchpq(std::max(32, (int)log(n)))
+            , counted(false)
+            , context(std::max(32, (int)log(n)))
         { 
+            build(pts, n, range, fn, 0);
+        }
 
-            //calculate mid point and half side length
-            Point mid, side; 
-            double radius = 0;
-            for (size_t d = 0; d < dim; ++d) {
-                mid[d] = (range[d*dim]+range[d*dim + 1]) / 2;
-                double side = (range[d*dim + 1]-range[d*dim]) / 2;
-                if (side > radius) radius = side;
-            } 
+        /** As above, but builds the tree using the threads of the pool, so fn
+            must be safe to call concurrently on different nodes.
+        */
+        CompressedQuadtree(size_t dim, Point *pts, size_t n, double *range, EndBuildFn &fn,
+                ThreadPool &pool)
+            : dim(dim)
+            , nnodes(1 << dim)
+            , counted(false)
+            , context(std::max(32, (int)log(n)))
+        { 
+            build(pts, n, range, fn, &pool);
+        }
 
-            //set up points vector 
-            std::vector<Point *> pts_vector;
-            for (size_t i = 0; i < n; ++i) {
-                pts_vector.push_back(&pts[i]);
-            }
+        //selects the build from points sorted by Morton key
+        struct MortonOrder {
+        };
+
+        /** As the constructors above, but builds the tree from the points
+            sorted by Morton key, which is faster for large numbers of points.
+        */
+        CompressedQuadtree(size_t dim, Point *pts, size_t n, double *range, EndBuildFn &fn,
+                MortonOrder)
+            : dim(dim)
+            , nnodes(1 << dim)
+            , counted(false)
+            , context(std::max(32, (int)log(n)))
+        { 
+            build_morton(pts, n, range, fn, 0);
+        }
+
+        CompressedQuadtree(size_t dim, Point *pts, size_t n, double *range, EndBuildFn &fn,
+                MortonOrder, ThreadPool &pool)
+            : dim(dim)
+            , nnodes(1 << dim)
+            , counted(false)
+            , context(std::max(32, (int)log(n)))
+        { 
+            build_morton(pts, n, range, fn, &pool);
+        }
 
-            root = worker(mid, radius, pts_vector, fn, 0);
+        /** An empty tree, for one built elsewhere, such as one read back
+            from a file.  Its nodes must be made with node and given their
+            children with set_children.
+        */
+        CompressedQuadtree(size_t dim)
+            : root(0)
+            , dim(dim)
+            , nnodes(1 << dim)
+            , counted(false)
+        {
         }
 
         virtual ~CompressedQuadtree()
         {
-           if (root) delete_worker(root);  
+        }
+
+        //a new node, which is freed with the tree
+        Node *node()
+        {
+            return new (arena.allocate(sizeof(Node))) Node;
+        }
+
+        //links the children of a node made with node, the tree is then uncounted
+        void set_children(Node *node, Node *const *children)
+        {
+            node->set_children(children, dim, arena);
+            counted = false;
+        }
+
+        //bytes of memory mapped for the nodes
+        size_t memory() const
+        {
+            return arena.size();
         }
 
         std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps) 
         {
+            return knn(k, pt, eps, context);
+        }
+
+        std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps,
+            SearchContext &ctx) const
+        {
+            PriorityQueue<Node *> &searchpq = ctx.searchpq;
+
             //setup query result vector
             std::list<std::pair<Point *, double> > qr; 
 
@@ -136,10 +324,7 @@ template<class Point> class CompressedQuadtree {
 
                 if (node->nodes == 0) { 
                     //calculate distance from query point to this point
-                    double dist = 0.0; 
-                    for (size_t d = 0; d < dim; ++d) {
-                        dist += ((*node->pt)[d]-pt[d]) * ((*node->pt)[d]-pt[d]); 
-                    }
+                    double dist = SquaredDistance<Point, double, Dim>::compute(*node->pt, pt, dim);
 
                     //insert point in result 
                     if (!resultpq.full() || dist < resultpq.peek().priority) {
@@ -156,75 +341,552 @@ template<class Point> class CompressedQuadtree {
                         break;
                     }
 
-                    for (size_t n = 0; n < nnodes; ++n) { 
-                        //calculate distance to each of the non-zero children
+                    size_t count = node->child_count(dim);
+                    for (size_t n = 0; n < count; ++n) { 
+                        //calculate distance to each of the children
                         //if less than k-th distance, then visit 
-                        if (node->nodes[n]) {
+                        double min_dist = min_pt_dist_to_node(pt, node->nodes[n]);
 
-                            double min_dist = min_pt_dist_to_node(pt, node->nodes[n]);
-
-                            //if closer than k-th distance, search
-                            if (min_dist < kth_dist) { 
-                                searchpq.push(min_dist, node->nodes[n]); 
-                            }
-                        } 
+                        //if closer than k-th distance, search
+                        if (min_dist < kth_dist) { 
+                            searchpq.push(min_dist, node->nodes[n]); 
+                        }
                     }
                 }
             } 
 
             while(resultpq.length) {
                 typename FixedSizePriorityQueue<Node *>::Entry e = resultpq.pop();
-                qr.push_front(std::make_pair<Point *, double>(e.data->pt,
-                    e.priority));
+                qr.push_front(std::pair<Point *, double>(e.data->pt, e.priority));
             } 
 
             return qr;
         }
 
+        /** Called for each point found by a radius search, as it is found.
+            Returning false ends the search.
+        */
+        struct RangeVisitor {
+            virtual bool operator()(Point *) = 0;
+        };
+
+        /** Passes the points stored in the tree within distance r of pt to
+            visit as they are found.  Nodes whose cells lie farther than r
+            from pt are skipped along with everything below them.
+
+            \return False if visit ended the search early.
+        */
+        bool radius_search(const Point &pt, double r, RangeVisitor &visit) const
+        {
+            return !root || radius_search(root, pt, r*r, visit);
+        }
+
+        std::vector<Point *> radius_search(const Point &pt, double r) const
+        {
+            CollectVisitor collect;
+            radius_search(pt, r, collect);
+
+            return collect.qr;
+        }
+
+        //the number of points stored in the tree within distance r of pt
+        size_t radius_count(const Point &pt, double r) const
+        {
+            CountVisitor count;
+            radius_search(pt, r, count);
+
+            return count.count;
+        }
+
+        /** Stores the number of points below each node, so that range_count
+            adds up cells inside the range in constant time rather than
+            visiting their points.  Trees built from points keep these counts
+            as they are built, so this is only needed for trees assembled
+            with node and set_children, which are not counted until it is
+            called.  Cells whose builds were ended early keep the number of
+            points that reached them.
+        */
+        void count_subtrees()
+        {
+            if (root) count_subtree(root);
+            counted = true;
+        }
+
+        /** Counts the points stored in the tree inside range, given as the
+            low and high bound of each dimension in turn.  With a non-zero
+            eps the count is approximate, as in Arya and Mount's approximate
+            range searching: the range is shrunk and grown about its centre
+            by a factor of 1 - eps and 1 + eps, cells outside the shrunken
+            range are skipped and cells inside the grown range counted
+            whole, so every point in the shrunken range is counted and none
+            outside the grown range.  The cells visited then depend on eps
+            rather than on the number of points near the boundary, so on a
+            counted tree the query takes roughly O(log n + 1/eps^(dim-1))
+            time however many points it counts.  Cells whose builds were
+            ended early by an EndBuildFn keep only the number of points that
+            reached them, so they add to the count only when counted whole.
+        */
+        size_t range_count(const double *range, double eps = 0.0) const
+        {
+            if (!root) return 0;
+
+            std::vector<double> inner(2*dim), outer(2*dim);
+            for (size_t d = 0; d < dim; ++d) {
+                double centre = (range[d*2] + range[d*2 + 1]) / 2.0;
+                double half = (range[d*2 + 1] - range[d*2]) / 2.0;
+                inner[d*2] = centre - (1.0 - eps)*half;
+                inner[d*2 + 1] = centre + (1.0 - eps)*half;
+                outer[d*2] = centre - (1.0 + eps)*half;
+                outer[d*2 + 1] = centre + (1.0 + eps)*half;
+            }
+
+            //exact counts use the range itself, unaltered by rounding
+            if (eps == 0.0) {
+                inner.assign(range, range + 2*dim);
+                outer.assign(range, range + 2*dim);
+            }
+
+            return range_count(root, range, &inner[0], &outer[0]);
+        }
+
         Node *root;
         size_t dim; 
 
     private:
 
+        struct CollectVisitor : public RangeVisitor {
+            virtual bool operator()(Point *pt)
+            {
+                qr.push_back(pt);
+                return true;
+            }
+
+            std::vector<Point *> qr;
+        };
+
+        struct CountVisitor : public RangeVisitor {
+            CountVisitor() : count(0)
+            {
+            }
+
+            virtual bool operator()(Point *)
+            {
+                ++count;
+                return true;
+            }
+
+            size_t count;
+        };
+
         size_t nnodes;
-        PriorityQueue<Node *> searchpq;
 
-        Node *worker(const Point &mid, double radius, std::vector<Point *> &pts, EndBuildFn &fn, size_t depth)
+        //whether the counts of the nodes are set, see count_subtrees
+        bool counted;
+        SearchContext context;
+        Arena arena;
+
+        //nodes with more points than this build their children as separate tasks
+        static const size_t parallel_build_cutoff = 1 << 6;
+
+        //the points of the splitting build, which the nodes divide between
+        //their children in place, and room for dividing them
+        struct SplitPoints {
+            Point **pts;
+            Point **scratch;
+            size_t *quadrants;
+        };
+
+        struct WorkerTask : public ThreadPool::Task {
+
+            WorkerTask(CompressedQuadtree *tree, Node **result, const Point &mid,
+                double radius, const SplitPoints &pts, size_t begin, size_t end,
+                EndBuildFn &fn, size_t depth)
+                : tree(tree)
+                , result(result)
+                , mid(mid)
+                , radius(radius)
+                , pts(pts)
+                , begin(begin)
+                , end(end)
+                , fn(fn)
+                , depth(depth)
+            {
+            }
+
+            virtual void operator()(ThreadPool &pool)
+            {
+                *result = tree->worker(mid, radius, pts, begin, end, fn, depth, &pool);
+            }
+
+            CompressedQuadtree *tree;
+            Node **result;
+            Point mid;
+            double radius;
+            const SplitPoints &pts;
+            size_t begin;
+            size_t end;
+            EndBuildFn &fn;
+            size_t depth;
+        };
+
+        typedef typename RadixSort<Point *>::Item KeyedPoint;
+
+        struct MortonTask : public ThreadPool::Task {
+
+            MortonTask(CompressedQuadtree *tree, Node **result, const KeyedPoint *pts,
+                size_t begin, size_t end, size_t level, const Point &mid, double radius,
+                EndBuildFn &fn, size_t depth)
+                : tree(tree)
+                , result(result)
+                , pts(pts)
+                , begin(begin)
+                , end(end)
+                , level(level)
+                , mid(mid)
+                , radius(radius)
+                , fn(fn)
+                , depth(depth)
+            {
+            }
+
+            virtual void operator()(ThreadPool &pool)
+            {
+                *result = tree->morton_worker(pts, begin, end, level, mid, radius, fn, depth, &pool);
+            }
+
+            CompressedQuadtree *tree;
+            Node **result;
+            const KeyedPoint *pts;
+            size_t begin;
+            size_t end;
+            size_t level;
+            Point mid;
+            double radius;
+            EndBuildFn &fn;
+            size_t depth;
+        };
+
+        struct KeyFn : public ThreadPool::RangeFn {
+
+            KeyFn(const CompressedQuadtree *tree, Point *pts, KeyedPoint *keyed, size_t levels,
+                const Point &mid, const double *radii)
+                : tree(tree)
+                , pts(pts)
+                , keyed(keyed)
+                , levels(levels)
+                , mid(mid)
+                , radii(radii)
+            {
+            }
+
+            virtual void operator()(size_t begin, size_t end)
+            {
+                tree->morton_keys(pts, begin, end, keyed, levels, mid, radii);
+            }
+
+            const CompressedQuadtree *tree;
+            Point *pts;
+            KeyedPoint *keyed;
+            size_t levels;
+            const Point &mid;
+            const double *radii;
+        };
+
+        //compares the leading levels of Morton keys, given by a shift
+        struct PrefixLess {
+            PrefixLess(size_t shift) : shift(shift)
+            {
+            }
+
+            bool operator()(uint64_t prefix, const KeyedPoint &pt) const
+            {
+                return prefix < (pt.first >> shift);
+            }
+
+            size_t shift;
+        };
+
+        static const size_t key_grain = 1 << 12;
+
+        void bounds(double *range, Point &mid, double &radius) const
         {
-            Node *node = new Node; 
+            //calculate mid point and half side length
+            radius = 0;
+            for (size_t d = 0; d < dim; ++d) {
+                mid[d] = (range[d*2]+range[d*2 + 1]) / 2;
+                double side = (range[d*2 + 1]-range[d*2]) / 2;
+                if (side > radius) radius = side;
+            } 
+        }
+
+        void build(Point *pts, size_t n, double *range, EndBuildFn &fn, ThreadPool *pool)
+        {
+            Point mid; 
+            double radius;
+            bounds(range, mid, radius);
+
+            //set up points array, partitioned by the nodes as the tree is built
+            std::vector<Point *> pts_vector(n);
+            for (size_t i = 0; i < n; ++i) {
+                pts_vector[i] = &pts[i];
+            }
+
+            root = split(mid, radius, pts_vector, fn, 0, pool);
+            counted = true;
+        }
+
+        void build_morton(Point *pts, size_t n, double *range, EndBuildFn &fn, ThreadPool *pool)
+        {
+            //as many levels as fit in a key
+            size_t levels = dim < 64 ? 64 / dim : 0;
+            if (levels == 0 || n == 0) {
+                build(pts, n, range, fn, pool);
+                return;
+            }
+
+            Point mid; 
+            double radius;
+            bounds(range, mid, radius);
+
+            std::vector<double> radii(levels);
+            for (size_t level = 0; level < levels; ++level) {
+                radii[level] = (level ? radii[level - 1] : radius) / 2.0;
+            }
+
+            std::vector<KeyedPoint> keyed(n);
+            KeyFn keys(this, pts, &keyed[0], levels, mid, &radii[0]);
+            if (pool) pool->parallel_for(0, n, key_grain, keys);
+            else keys(0, n);
+
+            RadixSort<Point *>::sort(&keyed[0], n, levels*dim, pool);
+
+            root = morton_worker(&keyed[0], 0, n, 0, mid, radius, fn, 0, pool);
+            counted = true;
+        }
+
+        /** Finds the Morton keys of pts[begin, end): the children each point
+            falls in from the root down, a level per dim bits starting from
+            the top.  The midpoints are found exactly as the splitting build
+            finds them, so the points go to the same children.  The side of
+            the midpoint in each dimension depends on that dimension alone,
+            so each is bisected in turn and the bits interleaved, and a group
+            of points is bisected together so that their steps overlap.
+
+            \param radii The half side length of the children at each level.
+        */
+        void morton_keys(Point *pts, size_t begin, size_t end, KeyedPoint *keyed, size_t levels,
+            const Point &root_mid, const double *radii) const
+        {
+            const size_t group = 8;
+
+            for (size_t i = begin; i < end; i += group) {
+                size_t count = std::min(group, end - i);
+
+                uint64_t keys[group] = {0};
+                for (size_t d = 0; d < dim; ++d) {
+                    double mids[group];
+                    for (size_t j = 0; j < count; ++j) {
+                        mids[j] = root_mid[d];
+                    }
+
+                    for (size_t level = 0; level < levels; ++level) {
+                        size_t shift = (levels - level - 1)*dim + d;
+                        double step[2] = {-radii[level], radii[level]};
+
+                        for (size_t j = 0; j < count; ++j) {
+                            size_t above = pts[i + j][d] > mids[j];
+                            keys[j] |= (uint64_t)above << shift;
+                            mids[j] = mids[j] + step[above];
+                        }
+                    }
+                }
+
+                for (size_t j = 0; j < count; ++j) {
+                    keyed[i + j] = KeyedPoint(keys[j], &pts[i + j]);
+                }
+            }
+        }
+
+        //builds the subtree over pts[begin, end), the points of a node at level
+        Node *morton_worker(const KeyedPoint *pts, size_t begin, size_t end, size_t level,
+            const Point &mid, double radius, EndBuildFn &fn, size_t depth, ThreadPool *pool)
+        {
+            size_t levels = 64 / dim;
+
+            Node *node = this->node(); 
             for (size_t d = 0; d < dim; ++d) {
                 node->mid[d] = mid[d];
             }
             node->radius = radius; 
+            node->count = end - begin;
+
+            while (end - begin > 1 && level < levels) {
+
+                if (fn(node, depth)) {
+                    node->ended = true;
+                    return node;
+                }
+
+                //children of the first and last points, the rest lie between
+                size_t shift = (levels - level - 1)*dim;
+                size_t first = (pts[begin].first >> shift) & (nnodes - 1);
+                size_t last = (pts[end - 1].first >> shift) & (nnodes - 1);
+                double new_radius = node->radius / 2.0;
+
+                //all points in one child, which takes the place of this node
+                if (first == last) {
+                    for (size_t d = 0; d < dim; ++d) { 
+                        if (first & (1 << d)) {
+                            node->mid[d] = node->mid[d] + new_radius;
+                        } else { 
+                            node->mid[d] = node->mid[d] - new_radius;
+                        }
+                    }
+                    node->radius = new_radius;
+
+                    ++level;
+                    ++depth;
+                    continue;
+                }
+
+                std::vector<Node *> children(nnodes);
+
+                ThreadPool::TaskGroup group;
+                PrefixLess less(shift);
+                for (size_t i = begin; i < end; ) {
+                    size_t n = (pts[i].first >> shift) & (nnodes - 1);
+                    size_t j = std::upper_bound(pts + i, pts + end, pts[i].first >> shift, less) - pts;
+
+                    Point new_mid;
+                    for (size_t d = 0; d < dim; ++d) { 
+                        if (n & (1 << d)) {
+                            new_mid[d] = node->mid[d] + new_radius;
+                        } else { 
+                            new_mid[d] = node->mid[d] - new_radius;
+                        }
+                    }
+
+                    if (pool && j - i > parallel_build_cutoff) {
+                        pool->spawn(group, new MortonTask(this, &children[n], pts, i, j,
+                            level + 1, new_mid, new_radius, fn, depth + 1));
+                    } else {
+                        children[n] = morton_worker(pts, i, j, level + 1, new_mid, new_radius,
+                            fn, depth + 1, pool);
+                    }
+
+                    i = j;
+                }
+
+                if (pool) pool->wait(group);
+
+                node->set_children(&children[0], dim, arena);
+
+                return node;
+            }
+
+            //a single point is kept unless fn replaces it
+            if (end - begin == 1) {
+                node->pt = pts[begin].second;
+                node->ended = fn(node, depth) && node->pt != pts[begin].second;
+                return node;
+            }
+
+            //points too close for the keys to separate, split them as before
+            Point node_mid;
+            for (size_t d = 0; d < dim; ++d) {
+                node_mid[d] = node->mid[d];
+            }
+            double node_radius = node->radius;
+
+            std::vector<Point *> rest(end - begin);
+            for (size_t i = begin; i < end; ++i) {
+                rest[i - begin] = pts[i].second;
+            }
+
+            return split(node_mid, node_radius, rest, fn, depth, pool);
+        }
+
+        //builds the subtree over pts by splitting, reordering them
+        Node *split(const Point &mid, double radius, std::vector<Point *> &pts, EndBuildFn &fn,
+            size_t depth, ThreadPool *pool)
+        {
+            std::vector<Point *> scratch(pts.size());
+            std::vector<size_t> quadrants(pts.size());
+
+            SplitPoints split_pts;
+            split_pts.pts = pts.empty() ? 0 : &pts[0];
+            split_pts.scratch = pts.empty() ? 0 : &scratch[0];
+            split_pts.quadrants = pts.empty() ? 0 : &quadrants[0];
 
-            if (pts.size() == 1) {
+            return worker(mid, radius, split_pts, 0, pts.size(), fn, depth, pool);
+        }
+
+        /** Divides the points [begin, end) between the quadrants of node,
+            so that the points of each quadrant follow those of the quadrants
+            before it, by counting the points in each quadrant and then moving
+            them to the run of their quadrant through the scratch space and
+            back.  The points of a run keep their order, so as the runs get
+            shorter they are read in order of address rather than scattered.
+
+            \param offsets Room for 2*nnodes + 1 entries, the first nnodes + 1
+                set to where the run of each quadrant starts, with end last.
+        */
+        void partition(const Node *node, const SplitPoints &pts, size_t begin, size_t end,
+            size_t *offsets) const
+        {
+            std::fill(offsets, offsets + nnodes + 1, 0);
+            offsets[0] = begin;
+            for (size_t i = begin; i < end; ++i) {
+                pts.quadrants[i] = node->quadrant(*pts.pts[i], dim);
+                ++offsets[pts.quadrants[i] + 1];
+            }
+
+            for (size_t q = 0; q < nnodes; ++q) {
+                offsets[q + 1] += offsets[q];
+            }
+
+            size_t *next = offsets + nnodes + 1;
+            std::copy(offsets, offsets + nnodes, next);
+            for (size_t i = begin; i < end; ++i) {
+                pts.scratch[next[pts.quadrants[i]]++] = pts.pts[i];
+            }
+
+            std::copy(pts.scratch + begin, pts.scratch + end, pts.pts + begin);
+        }
+
+        Node *worker(const Point &mid, double radius, const SplitPoints &pts, size_t begin,
+            size_t end, EndBuildFn &fn, size_t depth, ThreadPool *pool)
+        {
+            Node *node = this->node(); 
+            for (size_t d = 0; d < dim; ++d) {
+                node->mid[d] = mid[d];
+            }
+            node->radius = radius; 
+            node->count = end - begin;
+
+            //a single point is kept unless fn replaces it
+            if (end - begin == 1) {
                 node->nodes = 0;
-                node->pt = pts[0];
-                fn(node, depth);
-            } else if (!fn(node, depth)) { 
+                node->pt = pts.pts[begin];
+                node->ended = fn(node, depth) && node->pt != pts.pts[begin];
+            } else if (fn(node, depth)) {
+                node->ended = true;
+            } else { 
                 node->pt = 0;
-                node->nodes = new Node *[nnodes];
+                std::vector<Node *> children(nnodes);
 
                 //divide points between the nodes 
-                std::vector<Point *> *node_pts = new std::vector<Point *>[nnodes];
-                for (typename std::vector<Point *>::iterator itor = pts.begin(); itor != pts.end(); ++itor) {
-
-                    //determine node index based upon which which side of midpoint for each dimension
-                    size_t n = 0;
-                    for (size_t d = 0; d < dim; ++d) {
-                        if ((*(*itor))[d] > mid[d]) n += 1 << d; 
-                    } 
+                std::vector<size_t> offsets(2*nnodes + 1);
+                partition(node, pts, begin, end, &offsets[0]);
 
-                    node_pts[n].push_back(*itor);
-                } 
-
-                //create new nodes recursively
+                //create new nodes recursively, large children as separate tasks
+                ThreadPool::TaskGroup group;
                 size_t ninteresting = 0;
                 for (size_t n = 0; n < nnodes; ++n) {
 
-                    if (node_pts[n].size()) {
+                    size_t count = offsets[n + 1] - offsets[n];
+                    if (count) {
 
-                        Point nbounds[2];
                         Point new_mid;
                         double new_radius = radius / 2.0;
                         for (size_t d = 0; d < dim; ++d) { 
@@ -236,31 +898,137 @@ template<class Point> class CompressedQuadtree {
                         }
 
                         ++ninteresting;
-                        node->nodes[n] = worker(new_mid, new_radius, node_pts[n], fn, depth + 1);
-                    } else {
-                        node->nodes[n] = 0; 
+                        if (pool && count > parallel_build_cutoff) {
+                            pool->spawn(group, new WorkerTask(this, &children[n], new_mid,
+                                new_radius, pts, offsets[n], offsets[n + 1], fn, depth + 1));
+                        } else {
+                            children[n] = worker(new_mid, new_radius, pts, offsets[n],
+                                offsets[n + 1], fn, depth + 1, pool);
+                        }
                     }
                 }
 
-                delete[] node_pts;
+                if (pool) pool->wait(group);
 
-                //compress if less than 2 interesting nodes
+                //compress if less than 2 interesting nodes, the node
+                //compressed away stays in the arena until the tree is freed
                 if (ninteresting < 2) {
                     for (size_t n = 0; n < nnodes; ++n) {
-                        if (node->nodes[n]) {
-                            Node *temp = node;
-                            node = node->nodes[n];
-                            delete temp;
+                        if (children[n]) {
+                            node = children[n];
                             break;
                         }
                     }
-                } 
+                } else {
+                    node->set_children(&children[0], dim, arena);
+                }
             } 
 
             return node;
         } 
 
-        double min_pt_dist_to_node(const Point &pt, Node *node)
+        //returns false if visit ended the search
+        bool radius_search(const Node *node, const Point &pt, double r2, RangeVisitor &visit) const
+        {
+            if (cell_distance(pt, node) > r2) return true;
+
+            if (!node->nodes) {
+                if (!node->pt || SquaredDistance<Point, double, Dim>::compute(*node->pt, pt, dim) > r2) {
+                    return true;
+                }
+
+                return visit(node->pt);
+            }
+
+            size_t count = node->child_count(dim);
+            for (size_t n = 0; n < count; ++n) {
+                if (!radius_search(node->nodes[n], pt, r2, visit)) return false;
+            }
+
+            return true;
+        }
+
+        //points stored in a leaf, or for one whose build was ended, the points that reached it
+        size_t leaf_count(const Node *node) const
+        {
+            return node->ended ? node->count : node->pt != 0;
+        }
+
+        size_t count_subtree(Node *node)
+        {
+            size_t count = node->nodes ? 0 : leaf_count(node);
+
+            size_t children = node->child_count(dim);
+            for (size_t n = 0; n < children; ++n) {
+                count += count_subtree(node->nodes[n]);
+            }
+
+            node->count = count;
+
+            return count;
+        }
+
+        //points stored below node, counting them unless the tree is counted
+        size_t subtree_count(const Node *node) const
+        {
+            if (counted) return node->count;
+
+            size_t count = node->nodes ? 0 : leaf_count(node);
+
+            size_t children = node->child_count(dim);
+            for (size_t n = 0; n < children; ++n) {
+                count += subtree_count(node->nodes[n]);
+            }
+
+            return count;
+        }
+
+        size_t range_count(const Node *node, const double *range, const double *inner,
+            const double *outer) const
+        {
+            //skip cells outside the inner range, count those inside the outer range whole
+            bool inside = true;
+            for (size_t d = 0; d < dim; ++d) {
+                double low = node->mid[d] - node->radius;
+                double high = node->mid[d] + node->radius;
+                if (high < inner[d*2] || low > inner[d*2 + 1]) return 0;
+                if (low < outer[d*2] || high > outer[d*2 + 1]) inside = false;
+            }
+
+            if (inside) return subtree_count(node);
+
+            if (!node->nodes) {
+                if (!node->pt || node->ended) return 0;
+
+                for (size_t d = 0; d < dim; ++d) {
+                    if ((*node->pt)[d] < range[d*2] || (*node->pt)[d] > range[d*2 + 1]) return 0;
+                }
+
+                return 1;
+            }
+
+            size_t count = 0;
+            size_t children = node->child_count(dim);
+            for (size_t n = 0; n < children; ++n) {
+                count += range_count(node->nodes[n], range, inner, outer);
+            }
+
+            return count;
+        }
+
+        //squared distance from pt to the nearest point of the cell of node
+        double cell_distance(const Point &pt, const Node *node) const
+        {
+            double dist = 0.0;
+            for (size_t d = 0; d < dim; ++d) {
+                double gap = std::abs(pt[d] - node->mid[d]) - node->radius;
+                if (gap > 0.0) dist += gap*gap;
+            }
+
+            return dist;
+        }
+
+        double min_pt_dist_to_node(const Point &pt, Node *node) const
         {
             bool inside = true; 
             double min_dist = std::numeric_limits<double>::max();
@@ -282,19 +1050,6 @@ template<class Point> class CompressedQuadtree {
             else return min_dist*min_dist;
         }
 
-        void delete_worker(Node *node)
-        {
-            if (node->nodes) {
-                for (size_t n = 0; n < nnodes; ++n) { 
-                    if (node->nodes[n]) delete_worker(node->nodes[n]); 
-                }
-
-                delete node->nodes;
-            }
-
-            delete node; 
-        }    
-
 };
 
 #endif
@@ -0,0 +1,232 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CORNER_CACHE_H_
+#define CORNER_CACHE_H_
+
+/*
+    Hash table of query results keyed on the exact coordinates of the query
+    point.  Neighbouring cells of the odds-on cache share corners, and a
+    child cell shares corners with its parent, so remembering the nearest
+    neighbour of each corner saves most of the queries made while building.
+
+    Open addressing with linear probing.  The table is split into shards,
+    each with its own lock and grown independently, so threads building
+    different subtrees rarely contend.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+template<class Point, class Value> class CornerCache {
+
+public:
+
+    /** \param dim The number of coordinates of the keys.
+        \param size The expected number of entries.
+    */
+    CornerCache(size_t dim, size_t size)
+        : dim(dim)
+        , lookups(0)
+        , hits(0)
+    {
+        //start each shard at a power of two at least twice its share
+        size_t capacity = 16;
+        while (capacity * shard_count < size * 2) capacity <<= 1;
+
+        shards = new Shard[shard_count];
+        for (size_t i = 0; i < shard_count; ++i) {
+            pthread_mutex_init(&shards[i].lock, 0);
+            shards[i].entries.resize(capacity);
+            shards[i].count = 0;
+        }
+    }
+
+    virtual ~CornerCache()
+    {
+        for (size_t i = 0; i < shard_count; ++i) {
+            pthread_mutex_destroy(&shards[i].lock);
+        }
+
+        delete[] shards;
+    }
+
+    /** Looks up the value stored for a point.
+
+        \return True if the point was found, in which case value is set.
+    */
+    bool find(const Point &pt, Value &value)
+    {
+        uint64_t h = hash(pt);
+        Shard &shard = shards[h >> (64 - shard_bits)];
+        bool found = false;
+
+        pthread_mutex_lock(&shard.lock);
+        size_t mask = shard.entries.size() - 1;
+        for (size_t i = h & mask; shard.entries[i].used; i = (i + 1) & mask) {
+            if (equal(shard.entries[i].key, pt)) {
+                value = shard.entries[i].value;
+                found = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&shard.lock);
+
+        __sync_fetch_and_add(&lookups, 1);
+        if (found) __sync_fetch_and_add(&hits, 1);
+
+        return found;
+    }
+
+    /** Stores the value for a point, unless the point is already present.
+    */
+    void insert(const Point &pt, const Value &value)
+    {
+        uint64_t h = hash(pt);
+        Shard &shard = shards[h >> (64 - shard_bits)];
+
+        pthread_mutex_lock(&shard.lock);
+        if ((shard.count + 1) * 2 > shard.entries.size()) {
+            grow(shard);
+        }
+
+        if (put(shard.entries, h, pt, value)) ++shard.count;
+        pthread_mutex_unlock(&shard.lock);
+    }
+
+    //number of calls to find, and how many of those found a value
+    size_t lookup_count() const
+    {
+        return lookups;
+    }
+
+    size_t hit_count() const
+    {
+        return hits;
+    }
+
+    size_t size() const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < shard_count; ++i) {
+            count += shards[i].count;
+        }
+
+        return count;
+    }
+
+private:
+
+    static const size_t shard_bits = 6;
+    static const size_t shard_count = 1 << shard_bits;
+
+    struct Entry {
+        Entry() : used(false)
+        {
+        }
+
+        Point key;
+        Value value;
+        bool used;
+    };
+
+    struct Shard {
+        pthread_mutex_t lock;
+        std::vector<Entry> entries;
+        size_t count;
+    };
+
+    size_t dim;
+    Shard *shards;
+
+    volatile size_t lookups;
+    volatile size_t hits;
+
+    //keys are compared by bit pattern, so the hash must be too
+    uint64_t hash(const Point &pt) const
+    {
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (size_t d = 0; d < dim; ++d) {
+            double x = pt[d];
+            uint64_t bits;
+            memcpy(&bits, &x, sizeof(bits));
+
+            h ^= bits + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        }
+
+        //finalize so both the shard (high) and slot (low) bits are mixed
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+
+        return h;
+    }
+
+    bool equal(const Point &a, const Point &b) const
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            double x = a[d], y = b[d];
+            if (memcmp(&x, &y, sizeof(double))) return false;
+        }
+
+        return true;
+    }
+
+    bool put(std::vector<Entry> &entries, uint64_t h, const Point &pt, const Value &value)
+    {
+        size_t mask = entries.size() - 1;
+        size_t i = h & mask;
+        for (; entries[i].used; i = (i + 1) & mask) {
+            if (equal(entries[i].key, pt)) return false;
+        }
+
+        entries[i].key = pt;
+        entries[i].value = value;
+        entries[i].used = true;
+
+        return true;
+    }
+
+    void grow(Shard &shard)
+    {
+        std::vector<Entry> entries(shard.entries.size() * 2);
+        for (size_t i = 0; i < shard.entries.size(); ++i) {
+            if (shard.entries[i].used) {
+                put(entries, hash(shard.entries[i].key), shard.entries[i].key, shard.entries[i].value);
+            }
+        }
+
+        shard.entries.swap(entries);
+    }
+
+    CornerCache(const CornerCache &);
+    void operator=(const CornerCache &);
+};
+
+#endif
+
@@ -0,0 +1,201 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef DISTANCE_H_
+#define DISTANCE_H_
+
+/*
+    Squared Euclidean distance between two points, specialized on the
+    dimension.  A Dim of zero means the dimension is only known at runtime
+    and a plain loop is used.  Otherwise the loop is unrolled at compile
+    time.  On x86 the distances to blocks of bucketed points use AVX2 or
+    AVX-512 kernels when the processor supports them, chosen once at
+    runtime.  Single distances stay scalar, since summing in order leaves
+    nothing to gain from gathering one point into a vector.  Define
+    DISTANCE_DISABLE_SIMD to always use the scalar code.
+
+    Every version sums the coordinates in order and without fused multiply
+    adds, so all of them give bit for bit the same distances.  Results
+    found through different trees or caches can then be compared exactly.
+*/
+
+#include <cstdlib>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(DISTANCE_DISABLE_SIMD)
+#define DISTANCE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+template<class Point, class Number, int Dim> struct UnrolledSquaredDistance {
+    static Number sum(const Point &a, const Point &b)
+    {
+        Number d = a[Dim - 1] - b[Dim - 1];
+        return UnrolledSquaredDistance<Point, Number, Dim - 1>::sum(a, b) + d*d;
+    }
+};
+
+template<class Point, class Number> struct UnrolledSquaredDistance<Point, Number, 0> {
+    static Number sum(const Point &, const Point &)
+    {
+        return 0;
+    }
+};
+
+template<class Point, class Number, int Dim> struct SquaredDistance {
+    static Number compute(const Point &a, const Point &b, size_t)
+    {
+        return UnrolledSquaredDistance<Point, Number, Dim>::sum(a, b);
+    }
+};
+
+template<class Point, class Number> struct SquaredDistance<Point, Number, 0> {
+    static Number compute(const Point &a, const Point &b, size_t dim)
+    {
+        Number distance = 0;
+        for (size_t i = 0; i < dim; ++i) {
+            distance += (a[i] - b[i]) * (a[i] - b[i]);
+        }
+
+        return distance;
+    }
+};
+
+/*
+    Squared distances from a query point to a block of count points stored
+    coordinate by coordinate, so coordinate d of point j is block[d*count + j].
+    Each distance is summed in the same order as SquaredDistance<..., 0>, so
+    the results are identical to computing them one point at a time.
+*/
+template<class Point, class Number, int Dim> struct ScalarBlockSquaredDistance {
+    static void compute(const Number *block, size_t count, const Point &pt, size_t dim,
+        Number *out)
+    {
+        for (size_t j = 0; j < count; ++j) out[j] = 0;
+
+        for (size_t d = 0; d < (Dim ? Dim : dim); ++d) {
+            const Number *coords = block + d*count;
+            Number q = pt[d];
+            for (size_t j = 0; j < count; ++j) {
+                Number diff = coords[j] - q;
+                out[j] += diff*diff;
+            }
+        }
+    }
+};
+
+template<class Point, class Number, int Dim> struct BlockSquaredDistance
+    : public ScalarBlockSquaredDistance<Point, Number, Dim> {
+};
+
+#ifdef DISTANCE_X86_KERNELS
+
+enum DistanceKernel {
+    ScalarKernel,
+    Avx2Kernel,
+    Avx512Kernel
+};
+
+//best kernel supported by this processor, checked on first use
+inline DistanceKernel distance_kernel()
+{
+    static const DistanceKernel kernel = (__builtin_cpu_init(),
+        __builtin_cpu_supports("avx512f") ? Avx512Kernel :
+        __builtin_cpu_supports("avx2") ? Avx2Kernel : ScalarKernel);
+
+    return kernel;
+}
+
+template<class Point> __attribute__((target("avx2"), optimize("fp-contract=off")))
+void block_squared_distance_avx2(const double *block, size_t count, const Point &pt,
+    size_t dim, double *out)
+{
+    size_t vcount = count & ~(size_t)3;
+
+    for (size_t j = 0; j < count; ++j) out[j] = 0;
+
+    for (size_t d = 0; d < dim; ++d) {
+        const double *coords = block + d*count;
+        double q = pt[d];
+        __m256d vq = _mm256_set1_pd(q);
+
+        size_t j = 0;
+        for (; j < vcount; j += 4) {
+            __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(coords + j), vq);
+            _mm256_storeu_pd(out + j, _mm256_add_pd(_mm256_loadu_pd(out + j),
+                _mm256_mul_pd(diff, diff)));
+        }
+
+        for (; j < count; ++j) {
+            double diff = coords[j] - q;
+            out[j] += diff*diff;
+        }
+    }
+}
+
+template<class Point> __attribute__((target("avx512f"), optimize("fp-contract=off")))
+void block_squared_distance_avx512(const double *block, size_t count, const Point &pt,
+    size_t dim, double *out)
+{
+    size_t vcount = count & ~(size_t)7;
+
+    for (size_t j = 0; j < count; ++j) out[j] = 0;
+
+    for (size_t d = 0; d < dim; ++d) {
+        const double *coords = block + d*count;
+        double q = pt[d];
+        __m512d vq = _mm512_set1_pd(q);
+
+        size_t j = 0;
+        for (; j < vcount; j += 8) {
+            __m512d diff = _mm512_sub_pd(_mm512_loadu_pd(coords + j), vq);
+            _mm512_storeu_pd(out + j, _mm512_add_pd(_mm512_loadu_pd(out + j),
+                _mm512_mul_pd(diff, diff)));
+        }
+
+        for (; j < count; ++j) {
+            double diff = coords[j] - q;
+            out[j] += diff*diff;
+        }
+    }
+}
+
+template<class Point, int Dim> struct BlockSquaredDistance<Point, double, Dim> {
+    static void compute(const double *block, size_t count, const Point &pt, size_t dim,
+        double *out)
+    {
+        switch (distance_kernel()) {
+            case Avx512Kernel:
+                block_squared_distance_avx512(block, count, pt, Dim ? Dim : dim, out);
+                break;
+            case Avx2Kernel:
+                block_squared_distance_avx2(block, count, pt, Dim ? Dim : dim, out);
+                break;
+            default:
+                ScalarBlockSquaredDistance<Point, double, Dim>::compute(block, count, pt, dim, out);
+        }
+    }
+};
+
+#endif
+
+#endif
+
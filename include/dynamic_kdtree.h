@@ -0,0 +1,336 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef DYNAMIC_KDTREE_H_
+#define DYNAMIC_KDTREE_H_
+
+/*
+    A kd-tree supporting insertions and removals, using the logarithmic
+    method of:
+
+    Bentley, J. L., Saxe, J. B. (1980) Decomposable Searching Problems I:
+    Static-to-Dynamic Transformation, Journal of Algorithms, 1(4), pp. 301 - 358
+
+    Inserted points collect in a small buffer which is searched directly.
+    When the buffer fills it is merged with the trees below the first free
+    level into a new static bucketed tree at that level, so level i holds at
+    most buffer_size << i points and each point is rebuilt O(log n) times
+    over all.  Removed points are flagged in their tree, and a tree is
+    rebuilt without them once half of its points are gone.  Searches visit
+    the largest trees first, whose results bound the searches of the rest.
+
+    Each tree owns a copy of its points, so the points returned by searches
+    are only valid until the next insert or remove.
+*/
+
+#include <list>
+#include <vector>
+
+#include "distance.h"
+#include "fixed_size_priority_queue.h"
+#include "kdtree.h"
+#include "thread_pool.h"
+
+template<class Point, class Number, int Dim = 0> class DynamicKdTree {
+
+public:
+
+    typedef KdTree<Point, Number, Dim> Tree;
+    typedef typename Tree::SearchContext SearchContext;
+    typedef typename Tree::RangeVisitor RangeVisitor;
+
+    /** Builds a tree over a copy of the points ps.
+
+        \param buffer_size The number of inserted points kept outside the
+                           trees before they are built into one.
+    */
+    DynamicKdTree(size_t dim, const Point *ps, size_t n,
+            size_t buffer_size = default_buffer_size)
+        : dim(dim)
+        , buffer_size(buffer_size ? buffer_size : 1)
+        , live(0)
+        , pool(0)
+    {
+        build(ps, n);
+    }
+
+    /** As above, but builds the trees, including those rebuilt later by
+        insert and remove, using the threads of the pool.
+    */
+    DynamicKdTree(size_t dim, const Point *ps, size_t n, ThreadPool &pool,
+            size_t buffer_size = default_buffer_size)
+        : dim(dim)
+        , buffer_size(buffer_size ? buffer_size : 1)
+        , live(0)
+        , pool(&pool)
+    {
+        build(ps, n);
+    }
+
+    virtual ~DynamicKdTree()
+    {
+        for (size_t i = 0; i < levels.size(); ++i) {
+            delete levels[i];
+        }
+    }
+
+    void insert(const Point &pt)
+    {
+        buffer.push_back(pt);
+        ++live;
+
+        if (buffer.size() < buffer_size) return;
+
+        //merge the buffer and the trees below the first free level into it
+        std::vector<Point> pts;
+        pts.swap(buffer);
+
+        size_t level = 0;
+        for (; level < levels.size() && levels[level]; ++level) {
+            collect(levels[level], pts);
+            delete levels[level];
+            levels[level] = 0;
+        }
+
+        if (level == levels.size()) levels.push_back(0);
+        levels[level] = build_level(pts);
+    }
+
+    /** Removes a point equal to pt.
+
+        \return True if a point was removed, false if there is none.
+    */
+    bool remove(const Point &pt)
+    {
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (equal(buffer[i], pt)) {
+                buffer[i] = buffer.back();
+                buffer.pop_back();
+                --live;
+                return true;
+            }
+        }
+
+        for (size_t i = 0; i < levels.size(); ++i) {
+            Level *level = levels[i];
+            if (!level || !level->tree->remove(pt)) continue;
+
+            --live;
+
+            //rebuild once half the points are gone, the level only shrinks
+            if (2*level->tree->removed_count() >= level->pts.size()) {
+                std::vector<Point> pts;
+                collect(level, pts);
+                delete level;
+                levels[i] = build_level(pts);
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    //number of points in the tree
+    size_t size() const
+    {
+        return live;
+    }
+
+    //number of static trees the points are currently spread across
+    size_t tree_count() const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (levels[i]) ++count;
+        }
+
+        return count;
+    }
+
+    /** Searches for the k nearest neighbours of pt, as KdTree::knn.
+    */
+    std::list<std::pair<Point *, Number> > knn(size_t k, const Point &pt, Number eps)
+    {
+        return knn(k, pt, eps, context);
+    }
+
+    std::list<std::pair<Point *, Number> > knn(size_t k, const Point &pt, Number eps,
+        SearchContext &ctx) const
+    {
+        std::vector<std::pair<Point *, Number> > qr(k);
+        size_t count = knn(k, pt, eps, &qr[0], ctx);
+
+        return std::list<std::pair<Point *, Number> >(qr.begin(), qr.begin() + count);
+    }
+
+    /** As knn, but writes the results into a caller supplied buffer.
+
+        \return The number of results written, at most k.
+    */
+    size_t knn(size_t k, const Point &pt, Number eps, std::pair<Point *, Number> *qr,
+        SearchContext &ctx) const
+    {
+        FixedSizePriorityQueue<Point *> pq(k);
+
+        for (size_t i = levels.size(); i-- > 0;) {
+            if (levels[i]) levels[i]->tree->knn(pq, pt, eps, ctx);
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            Number d = SquaredDistance<Point, Number, Dim>::compute(buffer[i], pt, dim);
+            if (!pq.full() || d < pq.peek().priority) {
+                pq.push(d, const_cast<Point *>(&buffer[i]));
+            }
+        }
+
+        size_t count = pq.length;
+        while (pq.length) {
+            typename FixedSizePriorityQueue<Point *>::Entry e = pq.pop();
+            qr[pq.length] = std::pair<Point *, Number>(e.data, e.priority);
+        }
+
+        return count;
+    }
+
+    /** Passes the points within distance r of pt to visit, as
+        KdTree::radius_search.
+
+        \return False if visit ended the search early.
+    */
+    bool radius_search(const Point &pt, Number r, RangeVisitor &visit) const
+    {
+        for (size_t i = levels.size(); i-- > 0;) {
+            if (levels[i] && !levels[i]->tree->radius_search(pt, r, visit)) return false;
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (SquaredDistance<Point, Number, Dim>::compute(buffer[i], pt, dim) <= r*r) {
+                if (!visit(const_cast<Point *>(&buffer[i]))) return false;
+            }
+        }
+
+        return true;
+    }
+
+    //the number of points within distance r of pt
+    size_t radius_count(const Point &pt, Number r) const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (levels[i]) count += levels[i]->tree->radius_count(pt, r);
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (SquaredDistance<Point, Number, Dim>::compute(buffer[i], pt, dim) <= r*r) ++count;
+        }
+
+        return count;
+    }
+
+private:
+
+    //one static tree and the points it was built over
+    struct Level {
+        Level() : tree(0)
+        {
+        }
+
+        virtual ~Level()
+        {
+            delete tree;
+        }
+
+        std::vector<Point> pts;
+        Tree *tree;
+    };
+
+    static const size_t default_buffer_size = 256;
+
+    size_t dim;
+    size_t buffer_size;
+
+    //points inserted since the last merge
+    std::vector<Point> buffer;
+
+    //level i is empty or holds a tree over at most buffer_size << i points
+    std::vector<Level *> levels;
+
+    size_t live;
+    ThreadPool *pool;
+
+    SearchContext context;
+
+    //puts the initial points at the lowest level with room for them all
+    void build(const Point *ps, size_t n)
+    {
+        size_t level = 0;
+        while ((buffer_size << level) < n) ++level;
+
+        std::vector<Point> pts(ps, ps + n);
+        levels.resize(level + 1);
+        levels[level] = build_level(pts);
+
+        live = n;
+    }
+
+    //builds a level over pts, taking the points from it
+    Level *build_level(std::vector<Point> &pts)
+    {
+        if (pts.empty()) return 0;
+
+        Level *level = new Level;
+        level->pts.swap(pts);
+
+        typename Tree::Buckets buckets;
+        if (pool) {
+            level->tree = new Tree(dim, &level->pts[0], level->pts.size(), buckets, *pool);
+        } else {
+            level->tree = new Tree(dim, &level->pts[0], level->pts.size(), buckets);
+        }
+
+        return level;
+    }
+
+    //appends the points of a level which have not been removed
+    void collect(const Level *level, std::vector<Point> &pts) const
+    {
+        for (size_t i = 0; i < level->pts.size(); ++i) {
+            if (!level->tree->is_removed(&level->pts[i])) pts.push_back(level->pts[i]);
+        }
+    }
+
+    bool equal(const Point &a, const Point &b) const
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            if (a[d] != b[d]) return false;
+        }
+
+        return true;
+    }
+
+    DynamicKdTree(const DynamicKdTree &);
+    void operator=(const DynamicKdTree &);
+};
+
+#endif
+
@@ -26,67 +26,270 @@ THE SOFTWARE.
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
+#include <algorithm>
 #include <limits>
 #include <list>
 #include <vector>
 
 #include <sys/mman.h>
 
+#include "distance.h"
 #include "fixed_size_priority_queue.h"
+#include "mapped_file.h"
 #include "priority_queue.h"
+#include "thread_pool.h"
 
-template<class Point, class Number> class KdTree {
+/*
+    If Dim is non-zero it fixes the dimension at compile time, which lets
+    distance calculations be unrolled and vectorized.  The dimension passed
+    to the constructors must then be the same.
+*/
+template<class Point, class Number, int Dim = 0> class KdTree {
 
 public:
 
+    //first point and number of points of a bucket leaf
+    struct BucketLeaf {
+        unsigned int first;
+        unsigned int count;
+    };
+
+    /** Nodes are 16 bytes for double coordinates, so four fit in a cache
+        line.  Nothing is stored that can be recomputed: the split axis
+        follows from the depth, and in trees without buckets the point of a
+        node is the point with the same index as the node's slot in the arena
+        (see point).  Children always follow their parent in the arena, so
+        their offsets are unsigned, and trees of up to 2^32 - 1 points can be
+        built.
+    */
     struct Node {
-        Point *pt;
-        Number median;
-        Node *children;
-        int axis;
+        union {
+            Number median;
+            BucketLeaf bucket;
+        };
+
+        //offsets from this node to its left and right children, zero if there is no child
+        unsigned int left_offset;
+        unsigned int right_offset;
+
+        inline bool is_leaf() const
+        {
+            return !(left_offset | right_offset);
+        }
 
         inline Node *left()
         {
-            return (long)children & 0xA0000000 ? this + 1 : 0;
+            return left_offset ? this + left_offset : 0;
         }
 
         inline Node *right()
         {
-            Node *n = this + ((long)children & ~0xA0000000);
-            return this == n ? 0 : n;
+            return right_offset ? this + right_offset : 0;
+        }
+
+        inline void set_children(Node *left, Node *right)
+        {
+            left_offset = left ? (unsigned int)(left - this) : 0;
+            right_offset = right ? (unsigned int)(right - this) : 0;
         }
     };
 
-    KdTree(size_t dim, Point *pts, size_t n)
+    //a subtree still to be searched and the axis its root splits on
+    typedef std::pair<Node *, size_t> SearchNode;
+
+    /** Scratch state for a single search: the queue of subtrees still to be
+        visited and, optionally, search statistics.  The const query methods
+        take one of these from the caller, so a single tree can be shared
+        between threads as long as each thread owns its own context.
+    */
+    struct SearchContext {
+        SearchContext(int size = 32)
+            : searchpq(size)
+        {
+            #ifdef KDTREE_COLLECT_KNN_STATS
+            knn_nodes_visited = 0;
+            #endif
+        }
+
+        PriorityQueue<SearchNode> searchpq;
+
+        #ifdef KDTREE_COLLECT_KNN_STATS
+        size_t knn_nodes_visited;
+        #endif
+
+    private:
+
+        SearchContext(const SearchContext &);
+        void operator=(const SearchContext &);
+    };
+
+    /** Builds a kd-tree over the points, which are reordered in place.
+        Medians are found with randomized selection; each subtree draws its
+        pivots from a generator seeded by the seed and the subtree's position,
+        so the resulting tree and point order depend only on the input and
+        the seed.
+    */
+    KdTree(size_t dim, Point *pts, size_t n, unsigned long seed = default_seed)
         : dim(dim)
         , arena(0)
-        , searchpq(std::max(32, (int)log(n)))
+        , arena_size(n*sizeof(Node))
+        , arena_nodes(n)
+        , bucket_size(0)
+        , blocks(0)
+        , file(0)
+        , removed_points(0)
+        , seed(seed)
+        , context(std::max(32, (int)log(n)))
     {
-        arena = (Node *)mmap(0, n*sizeof(Node), PROT_READ|PROT_WRITE,
+        arena = (Node *)mmap(0, arena_size, PROT_READ|PROT_WRITE,
             MAP_PRIVATE|MAP_ANON, -1, 0);  
-        arena_offset = 0;
-        root = build_kdtree(pts, n, 0);
+        base = pts;
+        root = build_kdtree(arena, pts, n, 0, 0);
         this->n = n;
     }
 
+    /** As above, but builds the tree using the threads of the pool.  The
+        subtrees are built as independent tasks, and the large partitions near
+        the root are split into blocks which are partitioned in parallel.  The
+        result is identical to the serial build.
+    */
+    KdTree(size_t dim, Point *pts, size_t n, ThreadPool &pool, unsigned long seed = default_seed)
+        : dim(dim)
+        , arena(0)
+        , arena_size(n*sizeof(Node))
+        , arena_nodes(n)
+        , bucket_size(0)
+        , blocks(0)
+        , file(0)
+        , removed_points(0)
+        , seed(seed)
+        , context(std::max(32, (int)log(n)))
+    {
+        arena = (Node *)mmap(0, arena_size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANON, -1, 0);  
+        base = pts;
+
+        ThreadPool::TaskGroup group;
+        root = n ? arena : 0;
+        if (n) pool.spawn(group, new BuildTask(this, group, arena, pts, n, 0));
+        pool.wait(group);
+
+        this->n = n;
+    }
+
+    /** Selects the bucketed constructors below.  A bucketed tree stops
+        splitting at subtrees of at most size points, which are stored in
+        a single leaf along with a copy of their coordinates laid out one
+        coordinate at a time, and interior nodes hold only the split.  This
+        gives far fewer nodes and lets searches scan whole leaves with
+        vectorized distance calculations rather than following a pointer to
+        every point visited.
+
+        Searches that return nodes, such as nn, are only meaningful on trees
+        built without buckets.
+    */
+    struct Buckets {
+        explicit Buckets(size_t size = default_bucket_size) : size(size)
+        {
+        }
+
+        size_t size;
+    };
+
+    /** Builds a bucketed kd-tree over the points, which are reordered in
+        place as in the constructors above.  Bucket sizes are clamped to at
+        most max_bucket_size points.
+    */
+    KdTree(size_t dim, Point *pts, size_t n, Buckets buckets, unsigned long seed = default_seed)
+        : dim(dim)
+        , arena(0)
+        , file(0)
+        , removed_points(0)
+        , seed(seed)
+        , context(std::max(32, (int)log(n)))
+    {
+        build_buckets(pts, n, buckets, 0);
+    }
+
+    KdTree(size_t dim, Point *pts, size_t n, Buckets buckets, ThreadPool &pool,
+            unsigned long seed = default_seed)
+        : dim(dim)
+        , arena(0)
+        , file(0)
+        , removed_points(0)
+        , seed(seed)
+        , context(std::max(32, (int)log(n)))
+    {
+        build_buckets(pts, n, buckets, &pool);
+    }
+
+    /** Called for each node as it is built, with the point stored at the
+        node and the region of space covered by the node's subtree.
+        Returning true makes the node terminal, so its subtree is not built.
+    */
     struct EndBuildFn {
-        virtual bool operator()(Node *, Number *, size_t)
+        virtual bool operator()(Node *, Point *, Number *, size_t)
         {
             return false;
         }
     };
 
-    KdTree(size_t dim, Point *pts, size_t n, Number *range, EndBuildFn &fn)
+    /** Builds a kd-tree which stops splitting wherever fn says so.  Each
+        subtree is placed where it would be in a full build, so nodes below
+        terminal nodes leave unused gaps in the arena.
+    */
+    KdTree(size_t dim, Point *pts, size_t n, Number *range, EndBuildFn &fn,
+            unsigned long seed = default_seed)
         : dim(dim)
         , arena(0)
-        , searchpq(std::max(32, (int)log(n)))
+        , arena_size(n*sizeof(Node))
+        , arena_nodes(n)
+        , bucket_size(0)
+        , blocks(0)
+        , file(0)
+        , removed_points(0)
+        , seed(seed)
+        , context(std::max(32, (int)log(n)))
     {
-        arena = (Node *)mmap(0, n*sizeof(Node), PROT_READ|PROT_WRITE,
+        arena = (Node *)mmap(0, arena_size, PROT_READ|PROT_WRITE,
             MAP_PRIVATE|MAP_ANON, -1, 0);  
-        arena_offset = 0;
+        base = pts;
 
-        root = build_kdtree(pts, n, 0, range, fn);
+        root = n ? arena : 0;
+        if (n) build_kdtree(arena, pts, n, 0, range, fn, 0, 0);
+
+        this->n = n;
+    }
+
+    /** As above, but builds the tree using the threads of the pool, so fn
+        must be safe to call concurrently on different nodes.  The result is
+        identical to the serial build.
+    */
+    KdTree(size_t dim, Point *pts, size_t n, Number *range, EndBuildFn &fn,
+            ThreadPool &pool, unsigned long seed = default_seed)
+        : dim(dim)
+        , arena(0)
+        , arena_size(n*sizeof(Node))
+        , arena_nodes(n)
+        , bucket_size(0)
+        , blocks(0)
+        , file(0)
+        , removed_points(0)
+        , seed(seed)
+        , context(std::max(32, (int)log(n)))
+    {
+        arena = (Node *)mmap(0, arena_size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANON, -1, 0);  
+        base = pts;
+
+        ThreadPool::TaskGroup group;
+        root = n ? arena : 0;
+        if (n) {
+            pool.spawn(group, new EndBuildTask(this, group, arena, pts, n, 0, range, fn));
+        }
+        pool.wait(group);
 
         this->n = n;
     }
@@ -94,26 +297,151 @@ public:
 
     virtual ~KdTree()
     {
-        if (arena) munmap(arena, n*sizeof(Node));
+        //trees viewing an image own no arena
+        if (arena && arena_size) munmap(arena, arena_size);
+        delete file;
     }
 
+    /** Writes the tree and its points to f as an image which can be mapped
+        and queried in place by load or view.  All links within the image
+        are relative, so it does not depend on where it is mapped.  Points
+        are written as raw memory, so Point must not hold pointers.  Trees
+        with points removed by remove cannot be saved.
+
+        The image starts at the next multiple of file_alignment in f, and
+        the file is padded up to that first.
+
+        \return True on success.
+    */
+    bool save(FILE *f) const
+    {
+        //images have no room for removed points
+        if (removed_points) return false;
+
+        long start = align_file(f);
+        if (start < 0) return false;
+
+        ImageHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, image_magic, sizeof(header.magic));
+        header.node_size = sizeof(Node);
+        header.point_size = sizeof(Point);
+        header.number_size = sizeof(Number);
+        header.dim = dim;
+        header.bucket_size = bucket_size;
+        header.n = n;
+        header.nodes = arena_nodes;
+        header.root = root ? root - arena + 1 : 0;
+        header.points_offset = aligned(sizeof(header));
+        header.nodes_offset = aligned(header.points_offset + n*sizeof(Point));
+        header.blocks_offset = aligned(header.nodes_offset + arena_nodes*sizeof(Node));
+        header.size = header.blocks_offset + (blocks ? n*dim*sizeof(Number) : 0);
+
+        return write_file(f, &header, 1)
+            && align_file(f) == (long)(start + header.points_offset)
+            && write_file(f, base, n)
+            && align_file(f) == (long)(start + header.nodes_offset)
+            && write_file(f, arena, arena_nodes)
+            && align_file(f) == (long)(start + header.blocks_offset)
+            && (!blocks || write_file(f, blocks, n*dim));
+    }
+
+    /** Writes the tree to the file at path, replacing its contents.
+    */
+    bool save(const char *path) const
+    {
+        FILE *f = fopen(path, "wb");
+        if (!f) return false;
+
+        bool ok = save(f);
+        return fclose(f) == 0 && ok;
+    }
+
+    /** Maps a tree saved to the file at path.  Nothing is copied: the
+        tree is queried directly from the mapping, which is shared with any
+        other process mapping the same file.  The points returned by
+        searches point into the mapping, and both are read only, so the
+        tree must not be changed, for instance by relayout.
+
+        \return The tree, or zero if the file could not be mapped or does
+                not hold a tree of this type.
+    */
+    static KdTree *load(const char *path)
+    {
+        MappedFile *file = new MappedFile(path);
+
+        KdTree *tree = file->data ? view(file->data, file->size) : 0;
+        if (tree) tree->file = file;
+        else delete file;
+
+        return tree;
+    }
+
+    /** As load, but for an image already in memory, such as one inside a
+        larger mapped file.  The image must stay mapped for the life of the
+        tree.
+
+        \param image The start of the image, aligned to file_alignment.
+        \param size The number of bytes available from image onwards.
+    */
+    static KdTree *view(const char *image, size_t size)
+    {
+        const ImageHeader *header = (const ImageHeader *)image;
+
+        if (size < sizeof(ImageHeader)
+            || memcmp(header->magic, image_magic, sizeof(header->magic))
+            || header->node_size != sizeof(Node)
+            || header->point_size != sizeof(Point)
+            || header->number_size != sizeof(Number)
+            || (Dim && header->dim != Dim)
+            || header->size > size
+            || header->points_offset + header->n*sizeof(Point) > header->size
+            || header->nodes_offset + header->nodes*sizeof(Node) > header->size
+            || header->root > header->nodes
+            || (size_t)image % file_alignment) {
+            return 0;
+        }
+
+        return new KdTree(header, image);
+    }
+
+    /** Called for each point found by a range search, as it is found.
+        Returning false ends the search.
+    */
+    struct RangeVisitor {
+        virtual bool operator()(Point *) = 0;
+    };
+
     std::vector<Point *> range_search(Number *range)
+    {
+        std::vector<Point *> qr;
+        CollectVisitor collect(qr);
+        range_search(range, collect);
+
+        return qr;
+    }
+
+    /** Passes the points in range to visit as they are found rather than
+        collecting them, so nothing is allocated however many there are.
+
+        \return False if visit ended the search early.
+    */
+    bool range_search(Number *range, RangeVisitor &visit)
     {
         //set up region
         Number *region = new Number[2 * dim]; 
         for (int i = 0; i < dim; ++i) {
-            region[i] = -std::numeric_limits<Number>::max();
-            region[i + 1] = std::numeric_limits<Number>::max(); 
+            region[i*2] = -std::numeric_limits<Number>::max();
+            region[i*2 + 1] = std::numeric_limits<Number>::max(); 
         }
 
         //run query
-        std::vector<Point *> qr = range_search(root, range, region, 0);
+        bool completed = !root || range_search(root, range, region, 0, visit);
 
         //clean up and return result;
         delete[] region;
 
-        return qr;
-
+        return completed;
     }
 
     size_t range_count(Number *range)
@@ -121,8 +449,8 @@ public:
         //set up region
         Number *region = new Number[2 * dim]; 
         for (int i = 0; i < dim; ++i) {
-            region[i] = -std::numeric_limits<Number>::max();
-            region[i + 1] = std::numeric_limits<Number>::max(); 
+            region[i*2] = -std::numeric_limits<Number>::max();
+            region[i*2 + 1] = std::numeric_limits<Number>::max(); 
         }
 
         //run query
@@ -135,6 +463,58 @@ public:
 
     }
 
+    /** Passes the points within distance r of pt to visit as they are
+        found, as range_search.  Subtrees covering regions farther than r
+        from pt are skipped, and those covering regions wholly inside the
+        ball are reported without testing their points.
+
+        \return False if visit ended the search early.
+    */
+    bool radius_search(const Point &pt, Number r, RangeVisitor &visit) const
+    {
+        if (!root) return true;
+
+        std::vector<Number> region;
+        unbounded_region(region);
+
+        return radius_search(root, pt, r*r, &region[0], 0, visit);
+    }
+
+    std::vector<Point *> radius_search(const Point &pt, Number r) const
+    {
+        std::vector<Point *> qr;
+        CollectVisitor collect(qr);
+        radius_search(pt, r, collect);
+
+        return qr;
+    }
+
+    /** Counts the points within distance r of pt.  Subtrees inside the
+        ball are counted in constant time once count_subtrees has been
+        called.
+    */
+    size_t radius_count(const Point &pt, Number r) const
+    {
+        if (!root) return 0;
+
+        std::vector<Number> region;
+        unbounded_region(region);
+
+        return radius_count(root, pt, r*r, &region[0], 0);
+    }
+
+    /** Stores the number of points left below each node, so that
+        range_count adds up subtrees inside the range in constant time
+        rather than visiting their points.  This takes a pass over the tree
+        and four bytes per node, and the counts are kept up to date by
+        remove and relayout from then on.
+    */
+    void count_subtrees()
+    {
+        counts.assign(arena_nodes, 0);
+        if (root) count_subtree(root);
+    }
+
     /** This function searches for the k nearest neighbours to a query point. 
        
         \param k The number of nearest neighbours to find.
@@ -145,218 +525,854 @@ public:
     */ 
     std::list<std::pair<Point *, Number> > knn(size_t k, const Point &pt, Number eps) 
     {
-        FixedSizePriorityQueue<Node *> pq(k);
+        return knn(k, pt, eps, context);
+    }
 
-        searchpq.clear(); 
-        knn_search(pq, pt, eps);
+    /** As above, but uses the caller's search context rather than the one
+        owned by the tree, so it is safe to call concurrently.
+    */ 
+    std::list<std::pair<Point *, Number> > knn(size_t k, const Point &pt, Number eps,
+        SearchContext &ctx) const
+    {
+        std::vector<std::pair<Point *, Number> > qr(k);
 
-        std::list<std::pair<Point *, Number> > qr; 
-        while(pq.length) {
-            typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop();
-            qr.push_front(std::make_pair<Point *, Number>(e.data->pt,
-                e.priority));
-        }
+        ctx.searchpq.clear(); 
+        size_t count = knn_results(k, pt, eps, &qr[0], ctx);
 
-        return qr;
+        return std::list<std::pair<Point *, Number> >(qr.begin(), qr.begin() + count);
     }
 
-    /** This function searches for the k nearest neighbours to a query point. 
-        It takes an initial set of nodes which may be nearest neighbours
-        of the query point, which potentially reduces how much of the tree
-        must be searched. 
+    /** This function searches for a single exact nearest neighbour and returns
+        the Node containing it.  This is useful for building caches on top of
+        the kd-tree.
        
-        \param pq A priority queue containing potential nearest neighbours to the
-                  query point. 
         \param pt The point for which to find the nearest neighbour.
+        \return The Node containing the nearest neighbour. 
+    */
+    Node *nn(const Point &pt) 
+    {
+        return nn(pt, context);
+    }
+
+    Node *nn(const Point &pt, SearchContext &ctx) const
+    {
+        FixedSizePriorityQueue<Node *> pq(1); 
+        ctx.searchpq.clear(); 
+        knn_search(ctx, pq, pt, 0.0); 
+        typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop(); 
+        return e.data;
+    }
+
+    /** This function searches for the k nearest neighbours to a query point,
+        starting from a set of candidate neighbours such as those cached by an
+        odds-on tree.  The candidates bound the search from the start, so
+        less of the tree must be searched.
+
+        \param candidates Points and their squared distances to the query
+                          point.  The queue is emptied by the search.
+    */
+    std::list<std::pair<Point *, Number> > knn(size_t k, PriorityQueue<Point *> &candidates,
+        const Point &pt, Number eps, SearchContext &ctx) const
+    { 
+        std::vector<std::pair<Point *, Number> > qr(k);
+
+        ctx.searchpq.clear();
+        size_t count = knn_results(k, pt, eps, &qr[0], ctx, &candidates);
+
+        return std::list<std::pair<Point *, Number> >(qr.begin(), qr.begin() + count);
+    }
+
+    /** Adds the neighbours of pt in this tree to resultpq, which may already
+        hold points found elsewhere, for instance in the other trees of a
+        DynamicKdTree.  Those bound the search from the start, just as the
+        candidates above do.
+    */
+    void knn(FixedSizePriorityQueue<Point *> &resultpq, const Point &pt, Number eps,
+        SearchContext &ctx) const
+    {
+        ctx.searchpq.clear();
+        if (!root) return;
+
+        if (bucket_size) bucket_search(ctx, resultpq, pt, eps);
+        else knn_search(ctx, resultpq, pt, eps);
+    }
+
+    /** As knn, but writes the results into a caller supplied buffer rather
+        than allocating a list.
+
+        \param qr Receives up to k points and squared distances, nearest first. 
+        \return The number of results written.
+    */ 
+    size_t knn(size_t k, const Point &pt, Number eps, std::pair<Point *, Number> *qr,
+        SearchContext &ctx) const
+    {
+        ctx.searchpq.clear(); 
+        return knn_results(k, pt, eps, qr, ctx);
+    }
+
+    size_t knn(size_t k, PriorityQueue<Point *> &candidates, const Point &pt, Number eps,
+        std::pair<Point *, Number> *qr, SearchContext &ctx) const
+    {
+        ctx.searchpq.clear();
+        return knn_results(k, pt, eps, qr, ctx, &candidates);
+    }
+
+    /** Searches for the nearest neighbour of each point in a batch, spreading
+        the batch across the threads of the pool.
+
+        \param qs The query points.
+        \param count The number of query points.
         \param eps The epsilon for approximate nearest neighbour searches.
-        \return A list containing points and distances of the k nearest neighbours
-                to the query point. 
+        \param qr Receives the nearest neighbour and squared distance of each
+                  query point.
+        \param pool The pool of threads used to run the queries.
+    */
+    void nn_batch(const Point *qs, size_t count, Number eps,
+        std::pair<Point *, Number> *qr, ThreadPool &pool) const
+    {
+        knn_batch(1, qs, count, eps, qr, pool);
+    }
+
+    /** Searches for the k nearest neighbours of each point in a batch,
+        spreading the batch across the threads of the pool.  Results for
+        query i are stored at qr[i*k] through qr[i*k + k - 1], nearest first;
+        if the tree holds fewer than k points the remaining entries are set
+        to a null point at maximum distance.
+    */
+    void knn_batch(size_t k, const Point *qs, size_t count, Number eps,
+        std::pair<Point *, Number> *qr, ThreadPool &pool) const
+    {
+        BatchFn fn(this, k, qs, eps, qr);
+        pool.parallel_for(0, count, batch_grain, fn);
+    }
+
+    /** This function searches for the node containing a query point.
+        Since we don't track the bounds of the original point set, this will
+        return incorrect results if the query point is outside of the bounds
+        of the kd-tree.  
+       
+        \param pt The point for which to locate the node. 
+        \return The Node containing the query point. 
     */ 
-    std::list<std::pair<Point *, Number> > knn(size_t k, PriorityQueue<Node *> &searchnodes, const Point &pt, Number eps) 
+    Node *locate(const Point &pt) const
     { 
-        searchpq = searchnodes;
+        Node *node = root; 
+        size_t axis = 0;
+
+        while (node && !node->is_leaf()) { 
+
+            Node *next;
+            if (pt[axis] < node->median) { 
+                next = node->left(); 
+            } else { 
+                next = node->right(); 
+            }
+
+            if (!next) break;
+            node = next;
+            axis = (axis + 1) % dim;
+        } 
+
+        return node; 
+    }
+
+    /** Returns the point stored at a node of a tree built without buckets.
+    */
+    Point *point(const Node *node) const
+    {
+        return base + (node - arena);
+    }
+
+    //the points of the tree, in the order the tree arranged them
+    Point *points() const
+    {
+        return base;
+    }
+
+    //number of points in the tree, including any removed
+    size_t size() const
+    {
+        return n;
+    }
+
+    /** Removes a point equal to pt.  Its node and its place in the points
+        stay where they are, flagged so searches skip them, so the tree is
+        never restructured and points returned by earlier searches stay
+        valid.  Searches slow down as removed points accumulate, so trees
+        which change a lot should be rebuilt from time to time, as
+        DynamicKdTree does.  This must not run concurrently with searches.
+
+        \return True if a point was removed, false if there is no point
+                equal to pt left in the tree.
+    */
+    bool remove(const Point &pt)
+    {
+        size_t index;
+        std::vector<Node *> path;
+        if (!find(root, pt, 0, index, counts.empty() ? 0 : &path)) return false;
+
+        if (removed.empty()) removed.resize(n);
+        removed[index] = 1;
+        ++removed_points;
+
+        for (size_t i = 0; i < path.size(); ++i) {
+            --counts[path[i] - arena];
+        }
+
+        return true;
+    }
+
+    //number of points removed by remove
+    size_t removed_count() const
+    {
+        return removed_points;
+    }
+
+    //whether a point of the tree has been removed
+    bool is_removed(const Point *pt) const
+    {
+        return removed_points && removed[pt - base];
+    }
+
+
+    /** Rearranges the nodes in the arena into a van Emde Boas layout.  The
+        top half of the levels of the tree are stored together, followed by
+        each of the subtrees below them, each laid out the same way.  A
+        descent from the root then touches O(log_B n) cache lines or pages
+        for any block size B, rather than a new one at each level below the
+        top few as in preorder.  Nodes returned by earlier searches are no
+        longer valid afterwards.
+
+        In trees without buckets the points are reordered to match, since
+        each node's point is found from its slot.  Points below terminal
+        nodes, which are not in the tree, are moved after the others.
+    */
+    void relayout()
+    {
+        if (!root) return;
+
+        std::vector<Node *> order, scratch;
+        relayout_order(root, height(root), order, scratch);
+
+        //new slot of each node, by old slot
+        size_t slots = 0;
+        for (size_t i = 0; i < order.size(); ++i) {
+            slots = std::max(slots, (size_t)(order[i] - arena) + 1);
+        }
+
+        std::vector<size_t> index(slots);
+        for (size_t i = 0; i < order.size(); ++i) {
+            index[order[i] - arena] = i;
+        }
+
+        //copy nodes out with the new slots of their children, then write them back
+        std::vector<Node> nodes(order.size());
+        std::vector<std::pair<Node *, Node *> > children(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            Node *left = order[i]->left();
+            Node *right = order[i]->right();
+
+            nodes[i] = *order[i];
+            children[i].first = left ? arena + index[left - arena] : 0;
+            children[i].second = right ? arena + index[right - arena] : 0;
+        }
+
+        for (size_t i = 0; i < order.size(); ++i) {
+            arena[i] = nodes[i];
+            arena[i].set_children(children[i].first, children[i].second);
+        }
+
+        if (!bucket_size) {
+            //old index of the point to move to each index
+            std::vector<size_t> source(n);
+            std::vector<bool> used(n);
+            for (size_t i = 0; i < order.size(); ++i) {
+                source[i] = order[i] - arena;
+                used[source[i]] = true;
+            }
+
+            for (size_t i = 0, j = order.size(); i < n; ++i) {
+                if (!used[i]) source[j++] = i;
+            }
+
+            //follow each cycle of the permutation, swapping points into place
+            std::vector<bool> done(n);
+            for (size_t i = 0; i < n; ++i) {
+                if (done[i]) continue;
+
+                size_t j = i;
+                while (source[j] != i) {
+                    std::swap(base[j], base[source[j]]);
+                    if (removed_points) std::swap(removed[j], removed[source[j]]);
+                    done[j] = true;
+                    j = source[j];
+                }
+                done[j] = true;
+            }
+        }
+
+        root = arena;
+
+        if (!counts.empty()) count_subtrees();
+    }
+    
+    Node *root;
+
+private:
+
+    size_t n;
+    size_t dim;
+
+    Node *arena;
+    size_t arena_size;
+    size_t arena_nodes;
+
+    //maximum points per leaf, or zero if every node holds one point
+    size_t bucket_size;
+
+    //coordinates of the points in bucket leaves, in the same order as the points
+    Number *blocks;
+
+    //file mapped by load, if any
+    MappedFile *file;
+
+    //flags of the points removed by remove, empty until one is
+    std::vector<unsigned char> removed;
+    size_t removed_points;
+
+    //points left below each node by slot, empty unless count_subtrees was called
+    std::vector<unsigned int> counts;
+
+    //start of the point array and seed used for pivot selection while building
+    Point *base;
+    unsigned long seed;
+
+    SearchContext context;
+
+    static const unsigned long default_seed = 0x5eed;
+
+    static const char image_magic[8];
+
+    struct ImageHeader {
+        char magic[8];
+        unsigned int node_size;
+        unsigned int point_size;
+        unsigned int number_size;
+        unsigned int bucket_size;
+        unsigned long long dim;
+        unsigned long long n;
+        unsigned long long nodes;
+
+        //slot of the root plus one, zero if the tree is empty
+        unsigned long long root;
+
+        //offsets from the start of the image
+        unsigned long long points_offset;
+        unsigned long long nodes_offset;
+        unsigned long long blocks_offset;
+        unsigned long long size;
+    };
+
+    //tree over an image checked by view
+    KdTree(const ImageHeader *header, const char *image)
+        : n(header->n)
+        , dim(header->dim)
+        , arena((Node *)(image + header->nodes_offset))
+        , arena_size(0)
+        , arena_nodes(header->nodes)
+        , bucket_size(header->bucket_size)
+        , blocks(header->bucket_size ? (Number *)(image + header->blocks_offset) : 0)
+        , file(0)
+        , removed_points(0)
+        , base((Point *)(image + header->points_offset))
+        , seed(default_seed)
+        , context(std::max(32, (int)log(header->n)))
+    {
+        root = header->root ? arena + header->root - 1 : 0;
+    }
+
+    static size_t aligned(size_t offset)
+    {
+        return (offset + file_alignment - 1) / file_alignment * file_alignment;
+    }
+
+    static const size_t default_bucket_size = 32;
+    static const size_t max_bucket_size = 64;
+
+    //subtrees smaller than this are built serially by a single task; the end
+    //build function is usually expensive, so those builds split much smaller
+    static const size_t parallel_build_cutoff = 1 << 12;
+    static const size_t parallel_end_build_cutoff = 1 << 6;
+
+    //ranges larger than this are partitioned in blocks of partition_block points
+    static const size_t parallel_partition_cutoff = 1 << 16;
+    static const size_t partition_block = 1 << 12;
+
+    //splitmix64 generator used to choose pivots
+    struct Random {
+        Random(unsigned long long state) : state(state)
+        {
+        }
+
+        unsigned long long next()
+        {
+            unsigned long long z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+
+        unsigned long long state;
+    };
+
+    struct BuildTask : public ThreadPool::Task {
+
+        BuildTask(KdTree *tree, ThreadPool::TaskGroup &group, Node *result,
+            Point *pts, size_t pt_count, size_t depth)
+            : tree(tree)
+            , group(group)
+            , result(result)
+            , pts(pts)
+            , pt_count(pt_count)
+            , depth(depth)
+        {
+        }
+
+        virtual void operator()(ThreadPool &pool)
+        {
+            //spawn left subtrees and carry on down the right until the
+            //subtree is small enough to build serially
+            while (pt_count > parallel_build_cutoff) {
+                if (tree->bucket_size) {
+                    size_t median_index = tree->split_bucket_node(result, pts, pt_count, depth, &pool);
+
+                    pool.spawn(group, new BuildTask(tree, group, result + 1, pts,
+                        median_index, depth + 1));
+
+                    result = result->right();
+                    pts += median_index;
+                    pt_count -= median_index;
+                } else {
+                    size_t median_index = tree->split_node(result, pts, pt_count, depth, &pool);
+
+                    pool.spawn(group, new BuildTask(tree, group, result + 1, pts + 1,
+                        median_index, depth + 1));
+
+                    result += median_index + 1;
+                    pts += median_index + 1;
+                    pt_count -= median_index + 1;
+                }
+                ++depth;
+            }
+
+            if (tree->bucket_size) tree->build_buckets(result, pts, pt_count, depth, &pool);
+            else tree->build_kdtree(result, pts, pt_count, depth, &pool);
+        }
+
+        KdTree *tree;
+        ThreadPool::TaskGroup &group;
+        Node *result;
+        Point *pts;
+        size_t pt_count;
+        size_t depth;
+    };
+
+    struct EndBuildTask : public ThreadPool::Task {
+
+        EndBuildTask(KdTree *tree, ThreadPool::TaskGroup &group, Node *result,
+            Point *pts, size_t pt_count, size_t depth, Number *range, EndBuildFn &fn)
+            : tree(tree)
+            , group(group)
+            , result(result)
+            , pts(pts)
+            , pt_count(pt_count)
+            , depth(depth)
+            , range(range, range + 2*tree->dim)
+            , fn(fn)
+        {
+        }
+
+        virtual void operator()(ThreadPool &pool)
+        {
+            tree->build_kdtree(result, pts, pt_count, depth, &range[0], fn, &pool, &group);
+        }
+
+        KdTree *tree;
+        ThreadPool::TaskGroup &group;
+        Node *result;
+        Point *pts;
+        size_t pt_count;
+        size_t depth;
+        std::vector<Number> range;
+        EndBuildFn &fn;
+    };
+
+    //partitions each block of a range around the pivot at the end of the range
+    struct PartitionBlocksFn : public ThreadPool::RangeFn {
+
+        PartitionBlocksFn(const KdTree *tree, Point *pts, size_t start, size_t end,
+            size_t coord, size_t *less)
+            : tree(tree)
+            , pts(pts)
+            , start(start)
+            , end(end)
+            , coord(coord)
+            , less(less)
+        {
+        }
+
+        virtual void operator()(size_t begin_block, size_t end_block)
+        {
+            for (size_t b = begin_block; b < end_block; ++b) {
+                size_t block_start = start + b*partition_block;
+                size_t block_end = std::min(block_start + partition_block, end);
+
+                size_t i = block_start;
+                for (size_t j = block_start; j < block_end; ++j) {
+                    if (tree->pt_lt(coord, pts[j], pts[end])) {
+                        std::swap(pts[i], pts[j]);
+                        ++i;
+                    }
+                }
+
+                less[b] = i - block_start;
+            }
+        }
+
+        const KdTree *tree;
+        Point *pts;
+        size_t start;
+        size_t end;
+        size_t coord;
+        size_t *less;
+    };
+
+    //swaps the i-th misplaced point on the low side with the i-th on the high side
+    struct SwapMisplacedFn : public ThreadPool::RangeFn {
+
+        SwapMisplacedFn(Point *pts, std::vector<size_t> &high_start,
+            std::vector<size_t> &high_rank, std::vector<size_t> &low_start,
+            std::vector<size_t> &low_rank)
+            : pts(pts)
+            , high_start(high_start)
+            , high_rank(high_rank)
+            , low_start(low_start)
+            , low_rank(low_rank)
+        {
+        }
+
+        virtual void operator()(size_t begin, size_t end)
+        {
+            size_t h = std::upper_bound(high_rank.begin(), high_rank.end(), begin) - high_rank.begin() - 1;
+            size_t l = std::upper_bound(low_rank.begin(), low_rank.end(), begin) - low_rank.begin() - 1;
+
+            for (size_t i = begin; i < end; ++i) {
+                while (high_rank[h + 1] <= i) ++h;
+                while (low_rank[l + 1] <= i) ++l;
+
+                std::swap(pts[high_start[h] + i - high_rank[h]],
+                    pts[low_start[l] + i - low_rank[l]]);
+            }
+        }
+
+        Point *pts;
+        std::vector<size_t> &high_start;
+        std::vector<size_t> &high_rank;
+        std::vector<size_t> &low_start;
+        std::vector<size_t> &low_rank;
+    };
+
+    //queries per batch task, small since query cost varies widely
+    static const size_t batch_grain = 32;
+
+    struct BatchFn : public ThreadPool::RangeFn {
+
+        BatchFn(const KdTree *tree, size_t k, const Point *qs, Number eps,
+            std::pair<Point *, Number> *qr)
+            : tree(tree)
+            , k(k)
+            , qs(qs)
+            , eps(eps)
+            , qr(qr)
+        {
+        }
+
+        virtual void operator()(size_t begin, size_t end)
+        {
+            SearchContext ctx;
+
+            for (size_t i = begin; i < end; ++i) {
+                std::pair<Point *, Number> *result = qr + i*k;
+                size_t found = tree->knn(k, qs[i], eps, result, ctx);
+                for (size_t j = found; j < k; ++j) {
+                    result[j] = std::pair<Point *, Number>(0, std::numeric_limits<Number>::max());
+                }
+            }
+        }
+
+        const KdTree *tree;
+        size_t k;
+        const Point *qs;
+        Number eps;
+        std::pair<Point *, Number> *qr;
+    };
+
+    /** Builds the subtree over pts into the arena starting at result.  Each
+        point becomes one node and nodes are laid out in preorder, so the left
+        subtree starts at result + 1 and the right subtree directly after it.
+        The points are laid out the same way, so each node's point has the
+        same index as the node.
+    */
+    Node *build_kdtree(Node *result, Point *pts, size_t pt_count, size_t depth,
+        ThreadPool *pool)
+    {
+        if (pt_count == 0) {
+            //empty branch
+            return 0;
+        } else if (pt_count == 1) {
+            //leaf node, its point is already in place
+            new (result) Node; 
+            result->median = 0;
+            result->set_children(0, 0);
+        } else {
+            size_t median_index = split_node(result, pts, pt_count, depth, pool);
+
+            //recursively build tree
+            build_kdtree(result + 1, pts + 1, median_index, depth + 1, pool); 
+            build_kdtree(result + median_index + 1, &pts[median_index + 1],
+                pt_count - median_index - 1, depth + 1, pool);
+        } 
+
+        return result;
+    }
+
+    /** Creates an interior node over pts at result, partitioning pts around
+        the median and moving the median point to the front, so the left
+        subtree's points follow it and the right subtree's points follow
+        those.  Since the layout is fixed, the children offsets are known
+        before the subtrees are built.
+
+        \return The number of points in the left subtree.
+    */
+    size_t split_node(Node *result, Point *pts, size_t pt_count, size_t depth,
+        ThreadPool *pool)
+    {
+        new (result) Node; 
 
-        FixedSizePriorityQueue<Node *> pq(k);
-        knn_search(pq, pt, eps);
+        //find median (has side effect of partitioning input array around median)
+        size_t median_index = (pt_count / 2) >> 1 << 1;
+        Random rng = subtree_random(pts, pt_count);
+        result->median = select_order(median_index, pts, pt_count, depth % dim, rng, pool);
+        std::swap(pts[0], pts[median_index]);
 
-        std::list<std::pair<Point *, Number> > qr; 
-        while(pq.length) {
-            typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop();
-            qr.push_front(std::make_pair<Point *, Number>(e.data->pt,
-                e.priority));
-        }
+        result->set_children(median_index ? result + 1 : 0, result + median_index + 1);
 
-        return qr;
+        return median_index;
     }
 
-    /** This function searches for a single exact nearest neighbour and returns
-        the Node containing it.  This is useful for building caches on top of
-        the kd-tree.
-       
-        \param pt The point for which to find the nearest neighbour.
-        \return The Node containing the nearest neighbour. 
-    */
-    Node *nn(const Point &pt) 
+    Random subtree_random(Point *pts, size_t pt_count) const
     {
-        FixedSizePriorityQueue<Node *> pq(1); 
-        searchpq.clear(); 
-        knn_search(pq, pt, 0.0); 
-        typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop(); 
-        return e.data;
+        return Random(seed ^ (unsigned long long)(pts - base) * 0x9e3779b97f4a7c15ULL
+            ^ (unsigned long long)pt_count * 0xc2b2ae3d27d4eb4fULL);
     }
 
-    /** This function searches for the node containing a query point.
-        Since we don't track the bounds of the original point set, this will
-        return incorrect results if the query point is outside of the bounds
-        of the kd-tree.  
-       
-        \param pt The point for which to locate the node. 
-        \return The Node containing the query point. 
-    */ 
-    Node *locate(const Point &pt) 
-    { 
-        Node *node = root; 
+    size_t height(Node *node) const
+    {
+        if (!node) return 0;
+        return 1 + std::max(height(node->left()), height(node->right()));
+    }
 
-        size_t depth = 1;
+    /** Appends the subtree of the given height below node to order in van
+        Emde Boas order.  The roots of the bottom subtrees are collected on
+        the end of scratch, which is restored before returning.
+    */
+    void relayout_order(Node *node, size_t height, std::vector<Node *> &order,
+        std::vector<Node *> &scratch) const
+    {
+        if (!node) return;
 
-        while (node->children) { 
+        if (height == 1) {
+            order.push_back(node);
+            return;
+        }
 
-            if (pt[depth % dim] < node->median) { 
-                node = node->left(); 
-            } else { 
-                node = node->right(); 
-            }
+        size_t top = height / 2;
+        relayout_order(node, top, order, scratch);
 
-            ++depth; 
-        } 
+        size_t start = scratch.size();
+        collect_level(node, top, scratch);
+        size_t end = scratch.size();
 
-        return node; 
+        for (size_t i = start; i < end; ++i) {
+            relayout_order(scratch[i], height - top, order, scratch);
+        }
+
+        scratch.resize(start);
     }
-    
-    Node *root;
 
-    #ifdef KDTREE_COLLECT_KNN_STATS
-    int knn_nodes_visited; 
-    #endif
+    //appends the nodes depth levels below node, from left to right
+    void collect_level(Node *node, size_t depth, std::vector<Node *> &level) const
+    {
+        if (!node) return;
 
-private:
+        if (depth == 0) {
+            level.push_back(node);
+        } else {
+            collect_level(node->left(), depth - 1, level);
+            collect_level(node->right(), depth - 1, level);
+        }
+    }
 
-    size_t n;
-    size_t dim;
+    void build_buckets(Point *pts, size_t n, Buckets buckets, ThreadPool *pool)
+    {
+        bucket_size = std::max((size_t)1, std::min(buckets.size, (size_t)max_bucket_size));
+        base = pts;
+        this->n = n;
 
-    Node *arena;
-    size_t arena_offset;
+        //nodes followed by the coordinate blocks
+        size_t nodes = n ? bucket_nodes(n) : 0;
+        arena_size = nodes*sizeof(Node) + n*dim*sizeof(Number);
+        arena_nodes = nodes;
+        arena = (Node *)mmap(0, arena_size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANON, -1, 0);  
+        blocks = (Number *)(arena + nodes);
+
+        root = n ? arena : 0;
+        if (!n) return;
 
-    PriorityQueue<Node *> searchpq;
+        if (pool) {
+            ThreadPool::TaskGroup group;
+            pool->spawn(group, new BuildTask(this, group, arena, pts, n, 0));
+            pool->wait(group);
+        } else {
+            build_buckets(arena, pts, n, 0, 0);
+        }
+    }
 
-    Node *build_kdtree(Point *pts, size_t pt_count, size_t depth)
+    //number of nodes in a bucketed subtree over pt_count points
+    size_t bucket_nodes(size_t pt_count) const
     {
-        Node *result = 0;
+        if (pt_count <= bucket_size) return 1;
 
-        if (pt_count == 0) {
-            //empty branch
-        } else if (pt_count == 1) {
-            //leaf node, store point and return
-            result = new (arena + arena_offset) Node; 
-            ++arena_offset;
-            result->pt = pts;
-            result->median = 0;
-            result->children = 0;
-        } else {
+        size_t median_index = pt_count / 2;
+        return 1 + bucket_nodes(median_index) + bucket_nodes(pt_count - median_index);
+    }
 
-            result = new (arena + arena_offset) Node; 
-            ++arena_offset;
+    /** Builds a bucketed subtree over pts into the arena starting at result.
+        Nodes are laid out in preorder as in build_kdtree, but interior nodes
+        hold no point, so the median goes to the right subtree.
+    */
+    void build_buckets(Node *result, Point *pts, size_t pt_count, size_t depth,
+        ThreadPool *pool)
+    {
+        if (pt_count <= bucket_size) {
+            new (result) Node;
+            result->bucket.first = pts - base;
+            result->bucket.count = pt_count;
+            result->set_children(0, 0);
+
+            //copy coordinates into the block, one coordinate at a time
+            Number *block = blocks + (pts - base)*dim;
+            for (size_t d = 0; d < dim; ++d) {
+                for (size_t i = 0; i < pt_count; ++i) {
+                    block[d*pt_count + i] = pts[i][d];
+                }
+            }
+        } else {
+            size_t median_index = split_bucket_node(result, pts, pt_count, depth, pool);
 
-            //branch coordinate
-            result->axis = depth % dim; 
+            build_buckets(result + 1, pts, median_index, depth + 1, pool);
+            build_buckets(result->right(), pts + median_index, pt_count - median_index,
+                depth + 1, pool);
+        }
+    }
 
-            //find median (has side effect of partitioning input array around median)
-            size_t median_index = (pt_count / 2) >> 1 << 1;
-            Number median = select_order(median_index, pts, pt_count, result->axis);
+    /** Creates an interior node of a bucketed tree over pts at result.
 
-            //recursively build tree
-            result->children = 0;
-            Node *left = build_kdtree(pts, median_index, depth + 1); 
-            Node *right = build_kdtree(&pts[median_index + 1],
-                pt_count - median_index - 1, depth + 1);
+        \return The number of points in the left subtree.
+    */
+    size_t split_bucket_node(Node *result, Point *pts, size_t pt_count, size_t depth,
+        ThreadPool *pool)
+    {
+        new (result) Node; 
 
-            result->children = (Node *)(right - result);
-            if (left) result->children = (Node *)((long)result->children | 0xA0000000);
+        //both subtrees are non-empty since pt_count > bucket_size >= 1
+        size_t median_index = pt_count / 2;
+        Random rng = subtree_random(pts, pt_count);
+        result->median = select_order(median_index, pts, pt_count, depth % dim, rng, pool);
 
-            //store point and median value
-            result->pt = &pts[median_index];
-            result->median = median;
-        } 
+        result->set_children(result + 1, result + bucket_nodes(median_index) + 1);
 
-        return result;
+        return median_index;
     }
 
-
-    Node *build_kdtree(Point *pts, size_t pt_count, size_t depth,
-        Number *range, EndBuildFn &fn)
+    /** Builds the subtree over pts at result, stopping wherever fn says
+        so.  Subtrees are placed at the same arena slots as in a full build,
+        so if there is a pool, left subtrees over more than
+        parallel_end_build_cutoff points can be handed to other threads.
+    */
+    Node *build_kdtree(Node *result, Point *pts, size_t pt_count, size_t depth,
+        Number *range, EndBuildFn &fn, ThreadPool *pool, ThreadPool::TaskGroup *group)
     {
-        Node *result = 0;
-
         if (pt_count == 0) {
             //empty branch
+            return 0;
         } else if (pt_count == 1) {
-            //leaf node, store point and return
-            result = new (arena + arena_offset) Node; 
-            ++arena_offset;
-            result->pt = pts;
+            //leaf node, its point is already in place
+            new (result) Node; 
             result->median = 0;
-            result->children = 0;
-            fn(result, range, depth);
+            result->set_children(0, 0);
+            fn(result, pts, range, depth);
         } else {
 
-            result = new (arena + arena_offset) Node; 
-            ++arena_offset;
-
-            //branch coordinate
-            result->axis = depth % dim; 
+            new (result) Node; 
 
             //find median (has side effect of partitioning input array around median)
             size_t median_index = (pt_count / 2) >> 1 << 1;
-            Number median = select_order(median_index, pts, pt_count, result->axis); 
-
-            //store point and median value
-            result->pt = &pts[median_index];
-            result->median = median; 
-            result->children = 0;
+            Random rng = subtree_random(pts, pt_count);
+            result->median = select_order(median_index, pts, pt_count, depth % dim, rng, pool); 
+            std::swap(pts[0], pts[median_index]);
+            result->set_children(0, 0);
 
             //if not terminal, recursively build tree
-            if (!fn(result, range, depth)) { 
+            if (!fn(result, pts, range, depth)) { 
                 double t;
                 size_t range_coord = (depth%dim)*2;
 
                 t = range[range_coord+1]; 
                 range[range_coord+1] = result->median;
-                Node *left = build_kdtree(pts, median_index, depth + 1, range, fn); 
+                if (pool && median_index > parallel_end_build_cutoff) {
+                    pool->spawn(*group, new EndBuildTask(this, *group, result + 1, pts + 1,
+                        median_index, depth + 1, range, fn));
+                } else {
+                    build_kdtree(result + 1, pts + 1, median_index, depth + 1, range, fn,
+                        pool, group); 
+                }
                 range[range_coord+1] = t; 
 
                 t = range[range_coord]; 
                 range[range_coord] = result->median; 
-                Node *right = build_kdtree(&pts[median_index + 1],
-                    pt_count - median_index - 1, depth + 1, range, fn);
+                build_kdtree(result + median_index + 1, &pts[median_index + 1],
+                    pt_count - median_index - 1, depth + 1, range, fn, pool, group);
                 range[range_coord] = t; 
 
-                result->children = (Node *)(right - result);
-                if (left) result->children = (Node *)((long)result->children | 0xA0000000);
+                result->set_children(median_index ? result + 1 : 0, result + median_index + 1);
             }
-
         } 
 
         return result;
     }
 
-    size_t partition(size_t start, size_t end, Point *pts, size_t coord)
+    size_t partition(size_t start, size_t end, Point *pts, size_t coord, Random &rng,
+        ThreadPool *pool)
     { 
         //choose pivot and place at end
-        size_t pivot = start + rand() % (end - start); 
+        size_t pivot = start + rng.next() % (end - start); 
         std::swap(pts[pivot], pts[end]);
 
-        //get pivot value
-        Number value = pts[end][coord];
+        if (end - start > parallel_partition_cutoff) {
+            return partition_blocks(start, end, pts, coord, pool);
+        }
 
         //move values around pivot
         size_t i = start;
@@ -372,7 +1388,59 @@ private:
         return i; 
     } 
 
-    Number select_order(size_t i, Point *pts, size_t pt_count, size_t coord)
+    /** Partitions [start, end) around the pivot at end by partitioning fixed
+        size blocks independently, then swapping the points left on the wrong
+        side of the split.  Block boundaries do not depend on the number of
+        threads, so neither does the result.
+    */
+    size_t partition_blocks(size_t start, size_t end, Point *pts, size_t coord,
+        ThreadPool *pool)
+    {
+        size_t nblocks = (end - start + partition_block - 1) / partition_block;
+        std::vector<size_t> less(nblocks);
+
+        PartitionBlocksFn partition_fn(this, pts, start, end, coord, &less[0]);
+        if (pool) pool->parallel_for(0, nblocks, 1, partition_fn);
+        else partition_fn(0, nblocks);
+
+        size_t split = start;
+        for (size_t b = 0; b < nblocks; ++b) split += less[b];
+
+        //collect runs of high points below the split and low points above it
+        std::vector<size_t> high_start, high_rank, low_start, low_rank;
+        size_t high_count = 0, low_count = 0;
+        for (size_t b = 0; b < nblocks; ++b) {
+            size_t block_start = start + b*partition_block;
+            size_t block_mid = block_start + less[b];
+            size_t block_end = std::min(block_start + partition_block, end);
+
+            if (block_mid < split && block_mid < block_end) {
+                high_start.push_back(block_mid);
+                high_rank.push_back(high_count);
+                high_count += std::min(block_end, split) - block_mid;
+            }
+
+            if (block_mid > split && block_start < block_mid) {
+                size_t low = std::max(block_start, split);
+                low_start.push_back(low);
+                low_rank.push_back(low_count);
+                low_count += block_mid - low;
+            }
+        }
+        high_rank.push_back(high_count);
+        low_rank.push_back(low_count);
+
+        SwapMisplacedFn swap_fn(pts, high_start, high_rank, low_start, low_rank);
+        if (pool) pool->parallel_for(0, high_count, partition_block, swap_fn);
+        else swap_fn(0, high_count);
+
+        std::swap(pts[split], pts[end]);
+
+        return split;
+    }
+
+    Number select_order(size_t i, Point *pts, size_t pt_count, size_t coord, Random &rng,
+        ThreadPool *pool)
     {
         size_t start = 0;
         size_t end = pt_count - 1; 
@@ -381,7 +1449,7 @@ private:
 
             if (start == end) return pts[start][coord];
      
-            size_t pivot = partition(start, end, pts, coord);
+            size_t pivot = partition(start, end, pts, coord, rng, pool);
 
             if (i == pivot) {
                 return pts[pivot][coord];
@@ -425,29 +1493,59 @@ private:
         return 1; 
     }
 
-    int region_intersects_range(Number *range, Number *region)
+    int region_intersects_range(Number *region, Number *range)
     {
-        int intersects = 0;
         for (int i = 0; i < dim; ++i) {
-            if (range[i*2] < region[i*2] || range[i*2+1] > region[i*2+1]) intersects = 1; 
-            if (range[i*2] < region[i*2+1] || range[i*2+1] > region[i*2]) intersects = 1; 
+            if (range[i*2] > region[i*2+1] || range[i*2+1] < region[i*2]) return 0; 
         }
 
-        return intersects; 
+        return 1; 
     }
 
-    void report_subtree(Node *tree, std::vector<Point *> &qr)
+    struct CollectVisitor : public RangeVisitor {
+
+        CollectVisitor(std::vector<Point *> &qr) : qr(qr)
+        {
+        }
+
+        virtual bool operator()(Point *pt)
+        {
+            qr.push_back(pt);
+            return true;
+        }
+
+        std::vector<Point *> &qr;
+    };
+
+    bool report_subtree(Node *tree, RangeVisitor &visit) const
     { 
-        qr.push_back(tree->pt);
+        if (!bucket_size) {
+            if (!is_removed(point(tree)) && !visit(point(tree))) return false;
+        } else if (tree->is_leaf()) {
+            Point *pts = base + tree->bucket.first;
+            for (size_t i = 0; i < tree->bucket.count; ++i) {
+                if (!is_removed(pts + i) && !visit(pts + i)) return false;
+            }
+        }
 
         //recurse through tree
-        if (tree->left()) report_subtree(tree->left(), qr);
-        if (tree->right()) report_subtree(tree->right(), qr);
+        if (tree->left() && !report_subtree(tree->left(), visit)) return false;
+        if (tree->right() && !report_subtree(tree->right(), visit)) return false;
+
+        return true;
     }
 
-    size_t report_subtree(Node *tree)
+    size_t report_subtree(Node *tree) const
     { 
-        size_t result = 1;
+        if (!counts.empty()) return counts[tree - arena];
+
+        size_t result = 0;
+        if (!bucket_size) {
+            result = !is_removed(point(tree));
+        } else if (tree->is_leaf()) {
+            Point *pts = base + tree->bucket.first;
+            for (size_t i = 0; i < tree->bucket.count; ++i) result += !is_removed(pts + i);
+        }
 
         //recurse through tree
         if (tree->left()) result += report_subtree(tree->left());
@@ -456,23 +1554,181 @@ private:
         return result;
     }
 
+    //the region covering all of space, as the low and high bound of each dimension
+    void unbounded_region(std::vector<Number> &region) const
+    {
+        region.resize(2*dim);
+        for (size_t i = 0; i < dim; ++i) {
+            region[i*2] = -std::numeric_limits<Number>::max();
+            region[i*2 + 1] = std::numeric_limits<Number>::max();
+        }
+    }
 
-    std::vector<Point *> range_search(Node *tree, Number *range, Number *region, size_t depth)
+    //squared distance from pt to the nearest point of region
+    Number region_distance(const Point &pt, const Number *region) const
     {
-        std::vector<Point *> qr;
+        Number dist = 0;
+        for (size_t i = 0; i < dim; ++i) {
+            Number gap = 0;
+            if (pt[i] < region[i*2]) gap = region[i*2] - pt[i];
+            else if (pt[i] > region[i*2+1]) gap = pt[i] - region[i*2+1];
+            dist += gap*gap;
+        }
 
-        //check for empty branch
-        if (!tree) return qr;
+        return dist;
+    }
+
+    //whether all of region is within squared distance r2 of pt
+    bool ball_contains_region(const Point &pt, Number r2, const Number *region) const
+    {
+        Number dist = 0;
+        for (size_t i = 0; i < dim; ++i) {
+            //unbounded regions reach outside any ball
+            if (region[i*2] == -std::numeric_limits<Number>::max()
+                || region[i*2+1] == std::numeric_limits<Number>::max()) {
+                return false;
+            }
+
+            Number gap = std::max(pt[i] - region[i*2], region[i*2+1] - pt[i]);
+            dist += gap*gap;
+        }
+
+        return dist <= r2;
+    }
+
+    //returns false if visit ended the search
+    bool radius_search(Node *tree, const Point &pt, Number r2, Number *region, size_t depth,
+        RangeVisitor &visit) const
+    {
+        //leaf node
+        if (!bucket_size) {
+            Point *p = point(tree);
+            if (SquaredDistance<Point, Number, Dim>::compute(*p, pt, dim) <= r2 && !is_removed(p)) {
+                if (!visit(p)) return false;
+            }
+        } else if (tree->is_leaf()) {
+            Point *pts = base + tree->bucket.first;
+            for (size_t i = 0; i < tree->bucket.count; ++i) {
+                if (SquaredDistance<Point, Number, Dim>::compute(pts[i], pt, dim) <= r2
+                    && !is_removed(pts + i)) {
+                    if (!visit(pts + i)) return false;
+                }
+            }
+        }
+
+        if (tree->is_leaf()) return true;
+
+        Node *children[2] = {tree->left(), tree->right()};
+        int changed[2] = {2 * (int)(depth % dim) + 1, 2 * (int)(depth % dim)};
 
+        for (size_t side = 0; side < 2; ++side) {
+            if (!children[side]) continue;
+
+            //the region of the child
+            Number changed_value = region[changed[side]];
+            region[changed[side]] = tree->median;
+
+            bool completed = true;
+            if (region_distance(pt, region) > r2) {
+                //nothing to search
+            } else if (ball_contains_region(pt, r2, region)) {
+                completed = report_subtree(children[side], visit);
+            } else {
+                completed = radius_search(children[side], pt, r2, region, depth + 1, visit);
+            }
+
+            region[changed[side]] = changed_value;
+
+            if (!completed) return false;
+        }
+
+        return true;
+    }
+
+    size_t radius_count(Node *tree, const Point &pt, Number r2, Number *region, size_t depth) const
+    {
+        size_t qr = 0;
+
+        //leaf node
+        if (!bucket_size) {
+            Point *p = point(tree);
+            if (SquaredDistance<Point, Number, Dim>::compute(*p, pt, dim) <= r2 && !is_removed(p)) ++qr;
+        } else if (tree->is_leaf()) {
+            Point *pts = base + tree->bucket.first;
+            for (size_t i = 0; i < tree->bucket.count; ++i) {
+                if (SquaredDistance<Point, Number, Dim>::compute(pts[i], pt, dim) <= r2
+                    && !is_removed(pts + i)) {
+                    ++qr;
+                }
+            }
+        }
+
+        if (tree->is_leaf()) return qr;
+
+        Node *children[2] = {tree->left(), tree->right()};
+        int changed[2] = {2 * (int)(depth % dim) + 1, 2 * (int)(depth % dim)};
+
+        for (size_t side = 0; side < 2; ++side) {
+            if (!children[side]) continue;
+
+            //the region of the child
+            Number changed_value = region[changed[side]];
+            region[changed[side]] = tree->median;
+
+            if (region_distance(pt, region) > r2) {
+                //nothing to count
+            } else if (ball_contains_region(pt, r2, region)) {
+                qr += report_subtree(children[side]);
+            } else {
+                qr += radius_count(children[side], pt, r2, region, depth + 1);
+            }
+
+            region[changed[side]] = changed_value;
+        }
+
+        return qr;
+    }
+
+    size_t count_subtree(Node *tree)
+    { 
+        size_t result = 0;
+        if (!bucket_size) {
+            result = !is_removed(point(tree));
+        } else if (tree->is_leaf()) {
+            Point *pts = base + tree->bucket.first;
+            for (size_t i = 0; i < tree->bucket.count; ++i) result += !is_removed(pts + i);
+        }
+
+        if (tree->left()) result += count_subtree(tree->left());
+        if (tree->right()) result += count_subtree(tree->right());
+
+        counts[tree - arena] = result;
+
+        return result;
+    }
+
+
+    //returns false if visit ended the search
+    bool range_search(Node *tree, Number *range, Number *region, size_t depth, RangeVisitor &visit)
+    {
         //leaf node
-        if (point_in_range(tree->pt, range)) {
-            qr.push_back(tree->pt);
+        if (!bucket_size) {
+            if (point_in_range(point(tree), range) && !is_removed(point(tree))) {
+                if (!visit(point(tree))) return false;
+            }
+        } else if (tree->is_leaf()) {
+            Point *pts = base + tree->bucket.first;
+            for (size_t i = 0; i < tree->bucket.count; ++i) {
+                if (point_in_range(pts + i, range) && !is_removed(pts + i)) {
+                    if (!visit(pts + i)) return false;
+                }
+            }
         }
 
         //not leaf node
-        if (tree->children) {
+        if (!tree->is_leaf()) {
 
-            std::vector<Point *> lqr, rqr;
+            bool completed = true;
 
             Number split_value = tree->median;
 
@@ -482,39 +1738,39 @@ private:
             Number changed_value = region[changed_index];    
             region[changed_index] = split_value; 
 
-            if (range_contains_region(range, region)) {
-                if (tree->left()) {
-                    report_subtree(tree->left(), lqr);
-                }
+            if (!tree->left()) {
+                //nothing to search
+            } else if (range_contains_region(range, region)) {
+                completed = report_subtree(tree->left(), visit);
             } else if (region_intersects_range(region, range)) {
-                lqr = range_search(tree->left(), range, region, depth+1); 
+                completed = range_search(tree->left(), range, region, depth+1, visit); 
             }
 
             //restore region 
             region[changed_index] = changed_value; 
 
+            if (!completed) return false;
+
             //right subtree -- update region 
             changed_index = 2 * (depth % dim);
             changed_value = region[changed_index];    
             region[changed_index] = split_value; 
 
-            if (range_contains_region(range, region)) {
-                if (tree->right()) {
-                    report_subtree(tree->right(), rqr);
-                }
+            if (!tree->right()) {
+                //nothing to search
+            } else if (range_contains_region(range, region)) {
+                completed = report_subtree(tree->right(), visit);
             } else if (region_intersects_range(region, range)) {
-                rqr = range_search(tree->right(), range, region, depth+1); 
+                completed = range_search(tree->right(), range, region, depth+1, visit); 
             }
 
             //restore region 
             region[changed_index] = changed_value; 
 
-            //collect results
-            qr.insert(qr.end(), lqr.begin(), lqr.end());
-            qr.insert(qr.end(), rqr.begin(), rqr.end()); 
+            if (!completed) return false;
         }
 
-        return qr; 
+        return true; 
     }
     
     size_t range_count(Node *tree, Number *range, Number *region, size_t depth)
@@ -525,12 +1781,17 @@ private:
         if (!tree) return qr;
 
         //leaf node
-        if (point_in_range(tree->pt, range)) {
-            ++qr;
+        if (!bucket_size) {
+            if (point_in_range(point(tree), range) && !is_removed(point(tree))) ++qr;
+        } else if (tree->is_leaf()) {
+            Point *pts = base + tree->bucket.first;
+            for (size_t i = 0; i < tree->bucket.count; ++i) {
+                if (point_in_range(pts + i, range) && !is_removed(pts + i)) ++qr;
+            }
         }
 
         //not leaf node
-        if (tree->children) {
+        if (!tree->is_leaf()) {
 
             size_t lqr = 0, rqr = 0;
 
@@ -576,16 +1837,116 @@ private:
         return qr; 
     }
     
-    void knn_search(FixedSizePriorityQueue<Node *> &resultpq,
-        const Point &pt, Number eps)
+    /** Finds a point equal to pt which has not been removed in the subtree
+        below node.  Points equal to a split on its axis may be on either
+        side of it, so both sides are searched.
+
+        \param path If set, the nodes from node down to the one holding the
+            point found are added to it.
+    */
+    bool find(Node *node, const Point &pt, size_t axis, size_t &index,
+        std::vector<Node *> *path = 0) const
+    {
+        size_t path_size = path ? path->size() : 0;
+
+        while (node) {
+            if (path) path->push_back(node);
+
+            if (bucket_size && node->is_leaf()) {
+                Point *pts = base + node->bucket.first;
+                for (size_t i = 0; i < node->bucket.count; ++i) {
+                    if (equal(pts[i], pt) && !is_removed(pts + i)) {
+                        index = node->bucket.first + i;
+                        return true;
+                    }
+                }
+
+                break;
+            }
+
+            if (!bucket_size && equal(*point(node), pt) && !is_removed(point(node))) {
+                index = node - arena;
+                return true;
+            }
+
+            size_t next_axis = axis + 1 == dim ? 0 : axis + 1;
+
+            if (pt[axis] < node->median) {
+                node = node->left();
+            } else if (pt[axis] > node->median) {
+                node = node->right();
+            } else {
+                if (find(node->left(), pt, next_axis, index, path)) return true;
+                node = node->right();
+            }
+
+            axis = next_axis;
+        }
+
+        if (path) path->resize(path_size);
+
+        return false;
+    }
+
+    bool equal(const Point &a, const Point &b) const
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            if (a[d] != b[d]) return false;
+        }
+
+        return true;
+    }
+
+    size_t knn_results(size_t k, const Point &pt, Number eps,
+        std::pair<Point *, Number> *qr, SearchContext &ctx,
+        PriorityQueue<Point *> *candidates = 0) const
+    {
+        FixedSizePriorityQueue<Point *> pq(k);
+
+        while (candidates && candidates->length) {
+            typename PriorityQueue<Point *>::Entry e = candidates->pop();
+            if (!pq.full() || e.priority < pq.peek().priority) {
+                pq.push(e.priority, e.data);
+            }
+        }
+
+        if (bucket_size) bucket_search(ctx, pq, pt, eps);
+        else knn_search(ctx, pq, pt, eps);
+
+        size_t count = pq.length;
+        while (pq.length) {
+            typename FixedSizePriorityQueue<Point *>::Entry e = pq.pop();
+            qr[pq.length] = std::pair<Point *, Number>(e.data, e.priority);
+        }
+
+        return count;
+    }
+
+    //knn_search can collect either the nodes or the points it finds
+    Node *search_result(Node *node, Node *) const
+    {
+        return node;
+    }
+
+    Point *search_result(Node *node, Point *) const
     {
-        searchpq.push(0, root);
+        return point(node);
+    }
+
+    template<class Result> void knn_search(SearchContext &ctx,
+        FixedSizePriorityQueue<Result> &resultpq, const Point &pt, Number eps) const
+    {
+        PriorityQueue<SearchNode> &searchpq = ctx.searchpq;
+        const unsigned char *dead = removed_points ? &removed[0] : 0;
+
+        searchpq.push(0, SearchNode(root, 0));
 
         while (searchpq.length) {
 
-            typename PriorityQueue<Node *>::Entry entry = searchpq.pop();
+            typename PriorityQueue<SearchNode>::Entry entry = searchpq.pop();
 
-            Node *node = entry.data;
+            Node *node = entry.data.first;
+            size_t axis = entry.data.second;
 
             //need to square distance since resultpq distances are squared
             Number distance = entry.priority*entry.priority;
@@ -595,44 +1956,121 @@ private:
                 while (node) {
 
                     #ifdef KDTREE_COLLECT_KNN_STATS
-                    ++knn_nodes_visited; 
+                    ++ctx.knn_nodes_visited; 
                     #endif 
 
                     //calculate distance from query point to this point
-                    Number distance = 0; 
-                    for (int i = 0; i < dim; ++i) {
-                        distance += ((*(node->pt))[i]-pt[i]) * ((*(node->pt))[i]-pt[i]); 
-                    }
+                    Number distance = SquaredDistance<Point, Number, Dim>::compute(*point(node), pt, dim);
 
-                    if (!resultpq.full() || distance < resultpq.peek().priority) {
-                        resultpq.push(distance, node); 
+                    if ((!dead || !dead[node - arena])
+                        && (!resultpq.full() || distance < resultpq.peek().priority)) {
+                        resultpq.push(distance, search_result(node, (Result)0)); 
                     }
 
-                    if (pt[node->axis] < node->median) { 
+                    size_t next_axis = axis + 1 == dim ? 0 : axis + 1;
+
+                    if (pt[axis] < node->median) { 
 
                         if (node->right()) {
-                            Number d = (1.0 + eps)*abs(node->median - pt[node->axis]);
-                            if (d < resultpq.peek().priority) {
-                                searchpq.push(abs(node->median - pt[node->axis]), node->right()); 
+                            //resultpq distances are squared
+                            Number d = std::abs(node->median - pt[axis]);
+                            if (!resultpq.full() || (1.0 + eps)*d*d < resultpq.peek().priority) {
+                                searchpq.push(d, SearchNode(node->right(), next_axis)); 
                             }
                         }
 
                         node = node->left(); 
                     } else {
                         if (node->left()) {
-                            Number d = (1.0 + eps)*abs(node->median - pt[node->axis]);
-                            if (d < resultpq.peek().priority) {
-                                searchpq.push(abs(node->median - pt[node->axis]), node->left()); 
+                            //resultpq distances are squared
+                            Number d = std::abs(node->median - pt[axis]);
+                            if (!resultpq.full() || (1.0 + eps)*d*d < resultpq.peek().priority) {
+                                searchpq.push(d, SearchNode(node->left(), next_axis)); 
                             }
                         }
 
                         node = node->right();
                     } 
+
+                    axis = next_axis;
                 } 
             } 
         } 
     } 
+
+    /** Search used by bucketed trees.  Interior nodes only hold splits, so
+        distances are calculated only for the points of the leaves reached,
+        a whole block at a time.
+    */
+    void bucket_search(SearchContext &ctx, FixedSizePriorityQueue<Point *> &resultpq,
+        const Point &pt, Number eps) const
+    {
+        PriorityQueue<SearchNode> &searchpq = ctx.searchpq;
+        Number distances[max_bucket_size];
+        const unsigned char *dead = removed_points ? &removed[0] : 0;
+
+        //searchpq pops the largest priority first, so subtrees are pushed with
+        //negated distances to visit the nearest first
+        if (root) searchpq.push(0, SearchNode(root, 0));
+
+        while (searchpq.length) {
+
+            typename PriorityQueue<SearchNode>::Entry entry = searchpq.pop();
+
+            Node *node = entry.data.first;
+            size_t axis = entry.data.second;
+
+            //need to square distance since resultpq distances are squared
+            Number distance = entry.priority*entry.priority;
+
+            if (resultpq.full() && (1.0 + eps)*distance >= resultpq.peek().priority) {
+                continue;
+            }
+
+            while (!node->is_leaf()) {
+
+                #ifdef KDTREE_COLLECT_KNN_STATS
+                ++ctx.knn_nodes_visited; 
+                #endif 
+
+                Number d = pt[axis] - node->median;
+                axis = axis + 1 == dim ? 0 : axis + 1;
+
+                Node *far;
+                if (d < 0) {
+                    far = node->right();
+                    node = node->left();
+                } else {
+                    far = node->left();
+                    node = node->right();
+                }
+
+                if (!resultpq.full() || (1.0 + eps)*d*d < resultpq.peek().priority) {
+                    searchpq.push(-std::abs(d), SearchNode(far, axis));
+                }
+            }
+
+            #ifdef KDTREE_COLLECT_KNN_STATS
+            ++ctx.knn_nodes_visited; 
+            #endif 
+
+            size_t first = node->bucket.first;
+            size_t count = node->bucket.count;
+            BlockSquaredDistance<Point, Number, Dim>::compute(blocks + first*dim, count, pt, dim,
+                distances);
+
+            for (size_t i = 0; i < count; ++i) {
+                if ((!dead || !dead[first + i])
+                    && (!resultpq.full() || distances[i] < resultpq.peek().priority)) {
+                    resultpq.push(distances[i], base + first + i); 
+                }
+            }
+        } 
+    } 
 };
 
+template<class Point, class Number, int Dim>
+const char KdTree<Point, Number, Dim>::image_magic[8] = { 'K', 'D', 'T', 'R', 'E', 'E', '1', 0 };
+
 #endif
 
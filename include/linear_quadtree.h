@@ -0,0 +1,292 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef LINEAR_QUADTREE_H_
+#define LINEAR_QUADTREE_H_
+
+/*
+    Linear quadtree over the cells of a compressed quadtree, for point
+    location without walking down from the root.  A cell is named by its
+    level, the number of times the root was halved to get it, and its
+    Morton prefix, the children taken at each level to reach it.  The
+    table maps the cell of every node to the node, and each cell skipped
+    by a compressed edge to the node above the edge.
+
+    The cells held along the path of a point are then those down to the
+    deepest one containing it, so that cell is found by binary search over
+    the levels, with a lookup for each.  Both the slots the next lookup may
+    need are prefetched while the current one is waited on, so the lookups
+    largely overlap.  Cells are found with the same midpoint arithmetic as
+    the tree's builds, so the midpoints compare exactly.  Levels go down
+    only as far as fit in a 64 bit key, and deeper nodes are not held, so
+    location may have to carry on down the tree from the node found.
+*/
+
+#include <algorithm>
+#include <vector>
+
+#include <stdint.h>
+
+#include "compressed_quadtree.h"
+
+template<class Point, int Dim = 0> class LinearQuadtree {
+
+public:
+
+    typedef typename CompressedQuadtree<Point, Dim>::Node Node;
+
+    /** Indexes the cells of a tree, which must not change while the index
+        is in use.
+    */
+    LinearQuadtree(size_t dim, Node *root)
+        : dim(dim)
+        , root(root)
+        , levels(0)
+        , count(0)
+    {
+        if (!root) return;
+
+        for (size_t d = 0; d < dim; ++d) {
+            root_mid[d] = root->mid[d];
+        }
+
+        //the half side length of the cells of each level, as the builds halve it
+        size_t max_levels = 63 / dim;
+        radii.push_back(root->radius);
+        for (size_t level = 1; level <= max_levels; ++level) {
+            radii.push_back(radii.back() / 2.0);
+        }
+
+        levels = std::min(max_levels, height(root, 0));
+
+        size_t capacity = 16;
+        while (capacity < cells(root, 0) * 2) capacity <<= 1;
+        table.resize(capacity);
+
+        insert(root, 0, 0, 0);
+    }
+
+    /** Finds the deepest node of the tree whose cell holds pt, to the
+        depth of the index.  Children of the node found may still hold pt,
+        either below that depth or only within the tolerance of
+        Node::in_node.
+
+        \return The node, or null if pt is outside the root.
+    */
+    Node *locate(const Point &pt) const
+    {
+        if (!root || !root->in_node(pt, dim)) return 0;
+
+        uint64_t key = morton_key(pt);
+
+        //the root's cell is always held, and none beyond the last level
+        Node *found = root;
+        size_t lo = 0;
+        size_t hi = levels + 1;
+        while (hi - lo > 1) {
+            size_t level = (lo + hi) / 2;
+
+            prefetch(key, (level + hi) / 2);
+            prefetch(key, (lo + level) / 2);
+
+            Node *node = find(cell(level, key >> ((levels - level)*dim)));
+            if (node) {
+                lo = level;
+                found = node;
+            } else {
+                hi = level;
+            }
+        }
+
+        return found;
+    }
+
+    //number of cells held
+    size_t size() const
+    {
+        return count;
+    }
+
+    //deepest level held
+    size_t depth() const
+    {
+        return levels;
+    }
+
+private:
+
+    struct Entry {
+        Entry() : key(0), node(0)
+        {
+        }
+
+        uint64_t key;
+
+        //the node whose cell this is, or the node above a compressed edge
+        Node *node;
+    };
+
+    size_t dim;
+    Node *root;
+    Point root_mid;
+    std::vector<double> radii;
+    size_t levels;
+
+    std::vector<Entry> table;
+    size_t count;
+
+    //the level of the cell of a node below one at level above
+    size_t level_of(const Node *node, size_t above) const
+    {
+        size_t level = above + 1;
+        while (level < radii.size() && radii[level] > node->radius) ++level;
+
+        return level;
+    }
+
+    //the deepest level of the nodes below node
+    size_t height(const Node *node, size_t level) const
+    {
+        size_t deepest = level;
+        if (!node->nodes || level >= radii.size() - 1) return deepest;
+
+        size_t count = node->child_count(dim);
+        for (size_t n = 0; n < count; ++n) {
+            deepest = std::max(deepest, height(node->nodes[n], level_of(node->nodes[n], level)));
+        }
+
+        return deepest;
+    }
+
+    //the number of cells to hold for the nodes below node
+    size_t cells(const Node *node, size_t level) const
+    {
+        size_t total = 1;
+        if (!node->nodes) return total;
+
+        size_t count = node->child_count(dim);
+        for (size_t n = 0; n < count; ++n) {
+            Node *child = node->nodes[n];
+            size_t child_level = level_of(child, level);
+            if (child_level > levels) {
+                total += levels - level;
+            } else {
+                total += child_level - level - 1 + cells(child, child_level);
+            }
+        }
+
+        return total;
+    }
+
+    //holds the cell of node, at level, the cells of the edge above it and those below it
+    void insert(Node *node, Node *above, size_t above_level, size_t level)
+    {
+        uint64_t key = morton_key(node->mid);
+
+        for (size_t l = above ? above_level + 1 : level; l <= std::min(level, levels); ++l) {
+            Entry e;
+            e.key = cell(l, key >> ((levels - l)*dim));
+            e.node = l == level ? node : above;
+            put(e);
+        }
+
+        if (!node->nodes || level > levels) return;
+
+        size_t count = node->child_count(dim);
+        for (size_t n = 0; n < count; ++n) {
+            insert(node->nodes[n], node, level, level_of(node->nodes[n], level));
+        }
+    }
+
+    //the children pt falls in at each level, as CompressedQuadtree finds Morton keys
+    uint64_t morton_key(const Point &pt) const
+    {
+        Point mid = root_mid;
+
+        uint64_t key = 0;
+        for (size_t level = 0; level < levels; ++level) {
+            double step[2] = {-radii[level + 1], radii[level + 1]};
+
+            size_t n = 0;
+            for (size_t d = 0; d < dim; ++d) {
+                size_t above = pt[d] > mid[d];
+                n |= above << d;
+                mid[d] = mid[d] + step[above];
+            }
+
+            key = (key << dim) | n;
+        }
+
+        return key;
+    }
+
+    //a cell's prefix below a marker bit for its level, so no key is zero
+    uint64_t cell(size_t level, uint64_t prefix) const
+    {
+        return ((uint64_t)1 << (level*dim)) | prefix;
+    }
+
+    static uint64_t hash(uint64_t h)
+    {
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+
+        return h;
+    }
+
+    Node *find(uint64_t key) const
+    {
+        size_t mask = table.size() - 1;
+        for (size_t i = hash(key) & mask; table[i].key; i = (i + 1) & mask) {
+            if (table[i].key == key) return table[i].node;
+        }
+
+        return 0;
+    }
+
+    //starts loading the slot of the cell of pt at level
+    void prefetch(uint64_t key, size_t level) const
+    {
+        size_t mask = table.size() - 1;
+        __builtin_prefetch(&table[hash(cell(level, key >> ((levels - level)*dim))) & mask]);
+    }
+
+    void put(const Entry &e)
+    {
+        size_t mask = table.size() - 1;
+        size_t i = hash(e.key) & mask;
+        for (; table[i].key; i = (i + 1) & mask) {
+            if (table[i].key == e.key) return;
+        }
+
+        table[i] = e;
+        ++count;
+    }
+
+    LinearQuadtree(const LinearQuadtree &);
+    void operator=(const LinearQuadtree &);
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+/*
+    Helpers for the on-disk formats of the trees.  Files are written with
+    stdio, each section starting on a file_alignment boundary, and read back
+    by mapping the whole file read-only and shared, so the trees can be
+    queried in place and processes on the same host share one copy of the
+    file in the page cache.
+
+    Files hold raw node and point data, so they can only be read by builds
+    using the same Point type, word size and byte order.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class MappedFile {
+
+public:
+
+    /** Maps the file at path.  If that fails, data is zero.
+    */
+    MappedFile(const char *path)
+        : data(0)
+        , size(0)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const char *)p;
+                size = st.st_size;
+            }
+        }
+
+        close(fd);
+    }
+
+    virtual ~MappedFile()
+    {
+        if (data) munmap((void *)data, size);
+    }
+
+    const char *data;
+    size_t size;
+
+private:
+
+    MappedFile(const MappedFile &);
+    void operator=(const MappedFile &);
+};
+
+//sections of a file start at multiples of this, enough for any point or node type
+static const size_t file_alignment = 64;
+
+/** Pads f with zeros up to the next multiple of file_alignment.
+
+    \return The new position, or -1 on error.
+*/
+inline long align_file(FILE *f)
+{
+    long pos = ftell(f);
+    if (pos < 0) return -1;
+
+    while (pos % file_alignment) {
+        if (fputc(0, f) == EOF) return -1;
+        ++pos;
+    }
+
+    return pos;
+}
+
+//writes count objects, returning false on error
+template<class T> bool write_file(FILE *f, const T *data, size_t count)
+{
+    return fwrite(data, sizeof(T), count, f) == count;
+}
+
+#endif
+
@@ -28,61 +28,157 @@ Odds-on Tree implementation based upon descriptions in:
     Bose, P. et al (2010) Odds-on Trees retrieved from: http://arxiv.org/abs/1002.1092 
 */ 
 
+#include "terminal_test.h"
+
 #if defined ODDSON_TREE_KDTREE_IMPLEMENTATION
 
 #define KDTREE_COLLECT_KNN_STATS
+#include "corner_cache.h"
+#include "distance.h"
 #include "kdtree.h"
+#include "cache_rebuild.h"
+#include "mapped_file.h"
+#include "point_set.h"
+#include "refinement_cache.h"
+#include "thread_pool.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <vector>
 
-template<class Point> class OddsonTree {
+#include <unistd.h>
+
+template<class Point, int Dim = 0> class OddsonTree {
 
 public:
 
+    /** Cache entries hold the index of the neighbour in the backup tree's
+        points rather than a pointer, so a saved cache can be mapped back in
+        at any address.
+    */
     struct CachedPoint : Point { 
         bool terminal;
-        typename KdTree<Point, double>::Node *nn;
 
-        CachedPoint() : nn(0)
+        //index of the nearest neighbour plus one, zero if there is none
+        size_t nn;
+
+        CachedPoint() : terminal(false), nn(0)
         { 
         }
 
     };
 
-    struct OddsonTreeTerminal : public KdTree<CachedPoint, double>::EndBuildFn {
+    /** Runs the nearest neighbour queries for a range of corners of a cell,
+        recording the first neighbour found and whether any corner disagrees
+        with it.  Safe to run concurrently over different ranges of corners.
+    */
+    struct CornerFn : public ThreadPool::RangeFn {
+
+        CornerFn(const PointSet<Point, Dim> *backup, CornerCache<Point, Point *> *memo,
+                size_t dim, const double *range)
+            : backup(backup)
+            , memo(memo)
+            , dim(dim)
+            , range(range)
+            , nn(0)
+            , mismatch(0)
+        {
+        }
+
+        virtual void operator()(size_t begin, size_t end)
+        {
+            typename PointSet<Point, Dim>::SearchContext ctx;
+
+            for (size_t i = begin; i < end && !__sync_fetch_and_add(&mismatch, 0); ++i) {
+                Point qp;
+                for (size_t d = 0; d < dim; ++d) {
+                    if (i & (1 << d)) qp[d] = range[d*2];
+                    else qp[d] = range[d*2+1];
+                }
+
+                Point *qr;
+                if (!memo || !memo->find(qp, qr)) {
+                    std::pair<Point *, double> result;
+                    qr = backup->knn(1, qp, 0.0, &result, ctx) ? result.first : 0;
+                    if (memo) memo->insert(qp, qr);
+                }
+
+                Point *first = __sync_val_compare_and_swap(&nn, (Point *)0, qr);
+                if (first && first != qr) {
+                    __sync_fetch_and_add(&mismatch, 1);
+                }
+            } 
+        }
+
+        const PointSet<Point, Dim> *backup;
+        CornerCache<Point, Point *> *memo;
+        size_t dim;
+        const double *range;
+
+        Point * volatile nn;
+        volatile long mismatch;
+    };
+
+    struct OddsonTreeTerminal : public KdTree<CachedPoint, double, Dim>::EndBuildFn {
+
+        OddsonTreeTerminal() : memo(0), test(CornerTest), pool(0)
+        {
+        }
+
+        PointSet<Point, Dim> *backup;
+
+        //if set, remembers corner queries so cells sharing corners run them once
+        CornerCache<Point, Point *> *memo;
 
-        KdTree<Point, double> *backup;
         int dim;
         size_t max_depth;
+        OddsonTreeTerminalTest test;
 
-        virtual bool operator()(typename KdTree<CachedPoint, double>::Node *node, double *range, size_t depth)
-        {
-            CachedPoint *pt = node->pt;
+        //if set, cells with many corners query them in parallel
+        ThreadPool *pool;
 
+        virtual bool operator()(typename KdTree<CachedPoint, double, Dim>::Node *, CachedPoint *pt,
+            double *range, size_t depth)
+        {
             if (depth > max_depth) {
                 return true;
             }
 
-            //run interference query (need to make sure all "corners" have same nearest-neighbour)
-            pt->nn = 0;
-            for (size_t i = 0; i < 1<<dim; ++i) {
-                Point qp;
+            if (test == CentreTest) {
+                Point centre;
+                double radius = 0;
                 for (size_t d = 0; d < dim; ++d) {
-                    if (i & (1 << d)) qp[d] = range[d*2];
-                    else qp[d] = range[d*2+1];
+                    centre[d] = (range[d*2] + range[d*2+1]) / 2;
+                    radius += (range[d*2+1] - range[d*2]) * (range[d*2+1] - range[d*2]);
                 }
+                radius = sqrt(radius) / 2;
 
-                typename KdTree<Point, double>::Node *qr = backup->nn(qp);
+                typename PointSet<Point, Dim>::SearchContext ctx;
+                std::pair<Point *, double> qr[2];
+                size_t found = backup->knn(2, centre, 0.0, qr, ctx);
 
-                if (pt->nn == 0) {
-                    pt->nn = qr;
-                } else {
-                    if (pt->nn != qr) {
-                        return false;
-                    }
+                pt->nn = found ? backup->index(qr[0].first) + 1 : 0;
+                if (found == 2 && sqrt(qr[1].second) - sqrt(qr[0].second) <= 2*radius) {
+                    return false;
                 }
+
+                pt->terminal = true;
+                return true;
+            }
+
+            //run interference query (need to make sure all "corners" have same nearest-neighbour)
+            CornerFn corners(backup, memo, dim, range);
+            size_t ncorners = 1 << dim;
+            if (pool && ncorners >= parallel_corner_cutoff) {
+                pool->parallel_for(0, ncorners, corner_grain, corners);
+            } else {
+                corners(0, ncorners);
+            }
+
+            pt->nn = corners.nn ? backup->index(corners.nn) + 1 : 0;
+            if (corners.mismatch) {
+                return false;
             } 
 
             pt->terminal = true;
@@ -90,413 +186,2158 @@ public:
         } 
     };
 
-    OddsonTree(int dim, Point *ps, int n, Point *qs, int m, size_t max_depth)
-        : dim(dim)
-    {
+    /** Per-thread query state: the search context for the backup tree and
+        hit statistics.  The const query methods take one of these from the
+        caller so that a single tree can be shared between threads.
+    */
+    struct QueryContext {
+        QueryContext()
+            : hits(0)
+            , queries(0)
+            , reported_hits(0)
+            , reported_queries(0)
+        {
+        }
 
-        backup = new KdTree<Point, double>(dim, ps, n);
+        typename PointSet<Point, Dim>::SearchContext backup;
 
-        //track range covered by sample
-        range = new double[2*dim]; 
-        for (size_t d = 0; d < dim; ++d) {
-            range[d*2] = std::numeric_limits<double>::max();
-            range[d*2+1] = -std::numeric_limits<double>::max();
-        }
+        size_t hits;
+        size_t queries;
 
-        //generate sample points
-        CachedPoint *sample = new CachedPoint[m];
-        for (size_t i = 0; i < m; ++i) {
-            Point &pt = qs[i];
+        //counts already reported to the rebuild monitor
+        size_t reported_hits;
+        size_t reported_queries;
+    };
 
-            //copy into cached point
-            for (size_t d = 0; d < dim; ++d) {
-                sample[i][d] = pt[d];
-                if (pt[d] < range[d*2]) range[d*2] = pt[d];
-                if (pt[d] > range[d*2+1]) range[d*2+1] = pt[d];
-            }
-        }
+    /** Builds the backup tree over the points ps and a cache over the
+        sample query points qs.
 
-        //build kdtree for cache
-        OddsonTreeTerminal fn;
-        fn.backup = backup;
-        fn.dim = dim;
-        fn.max_depth = max_depth;
-        cache = new KdTree<CachedPoint, double>(dim, sample, m, range, fn); 
+        \param max_depth The maximum depth of the cache.
+        \param test The test used to decide whether cells are terminal.
+    */
+    OddsonTree(int dim, Point *ps, int n, Point *qs, int m, size_t max_depth,
+            OddsonTreeTerminalTest test = CornerTest)
+        : dim(dim)
+        , file(0)
+        , refinement(0)
+        , bounds(0)
+        , rebuild(0)
+        , changes(0)
+        , retested(0)
+    {
+        build(ps, n, qs, m, max_depth, test, 0);
+    }
 
-        hits = 0;
-        queries = 0;
-        backup->knn_nodes_visited = 0;
+    /** As above, but builds the backup tree and the cache using the threads
+        of the pool.  Subtrees of the cache are tested in parallel, as are the
+        corners of cells in higher dimensions.
+    */
+    OddsonTree(int dim, Point *ps, int n, Point *qs, int m, size_t max_depth, ThreadPool &pool,
+            OddsonTreeTerminalTest test = CornerTest)
+        : dim(dim)
+        , file(0)
+        , refinement(0)
+        , bounds(0)
+        , rebuild(0)
+        , changes(0)
+        , retested(0)
+    {
+        build(ps, n, qs, m, max_depth, test, &pool);
     }
 
     virtual ~OddsonTree()
     {
-        fprintf(stderr, "info: hits: %d queries: %d percent: %0.2f\n", hits, queries, (double)hits / (double)queries);
+        if (rebuild) {
+            wait_for_rebuild();
+            fprintf(stderr, "info: rebuilds: %zu\n", rebuild->count);
+        }
 
-        fprintf(stderr, "info: backup nodes visited: %d\n", backup->knn_nodes_visited);
+        fprintf(stderr, "info: hits: %zu queries: %zu percent: %0.2f\n", context.hits, context.queries, (double)context.hits / (double)context.queries);
 
-        delete[] range;
+        fprintf(stderr, "info: backup nodes visited: %zu\n", context.backup.knn_nodes_visited);
+
+        if (refinement) fprintf(stderr, "info: refined cells: %zu\n", refinement->size());
+
+        if (changes) fprintf(stderr, "info: changes: %zu retested cells: %zu\n", changes, retested);
+
+        delete rebuild;
+        delete refinement;
+        delete[] bounds;
         delete backup;
-        delete cache;
+        delete current;
+        delete file;
     }
 
 
     std::list<std::pair<Point *, double> > nn(const Point &pt, double eps) 
     {
-        std::list<std::pair<Point *, double> > result;
-
-        CachedPoint *cache_result = locate(pt);
-
-        //check if terminal
-        if (cache_result && cache_result->nn) {
-            double d = 0; 
-            for (int i = 0; i < dim; ++i) {
-                d += ((*(cache_result->nn->pt))[i]-pt[i]) * ((*(cache_result->nn->pt))[i]-pt[i]); 
-            } 
+        return nn(pt, eps, context);
+    }
 
-            result.push_back(std::make_pair<Point *, double>(cache_result->nn->pt, d));
+    std::list<std::pair<Point *, double> > nn(const Point &pt, double eps, QueryContext &ctx) const
+    {
+        std::list<std::pair<Point *, double> > result;
 
-            ++hits;
-        } else {
-            result = backup->knn(1, pt, eps); 
-        }
+        std::pair<Point *, double> qr;
+        if (nn(pt, eps, &qr, ctx)) result.push_back(qr);
 
-        ++queries;
         return result; 
     } 
 
     std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps) 
+    {
+        return knn(k, pt, eps, context);
+    }
+
+    std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps, QueryContext &ctx) const
     {
         std::list<std::pair<Point *, double> > result;
 
-        PriorityQueue<typename KdTree<Point, double>::Node *> pq(k);
-        locate(pq, pt);
-        result = backup->knn(k, pq, pt, eps); 
+        PriorityQueue<Point *> pq(k);
+        size_t epoch = enter();
+        locate(current, pq, pt);
+        leave(epoch);
+        result = backup->knn(k, pq, pt, eps, ctx.backup); 
 
-        ++queries;
+        ++ctx.queries;
         return result; 
     }
 
 
-    KdTree<CachedPoint, double> *cache;
-
-private:
+    /** As nn, but writes the result into a caller supplied buffer.
 
-    CachedPoint *locate(const Point &pt) 
-    { 
-        typename KdTree<CachedPoint, double>::Node *node = cache->root; 
-        CachedPoint *qr = 0; 
+        \return The number of results written, at most one.
+    */
+    size_t nn(const Point &pt, double eps, std::pair<Point *, double> *qr, QueryContext &ctx) const
+    {
+        size_t found;
 
-        //early out, not covered by cache
-        for (int i = 0; i < dim; ++i) {
-            if (range[i*2] > pt[i] || range[i*2 + 1] < pt[i]) {
-                return qr;
-            }
-        }
+        size_t epoch = enter();
+        const Cache *c = current;
 
-        size_t depth = 0; 
+        CachedPoint *cache_result = locate(c, pt);
+        Point *nn = cache_result ? neighbour(cache_result) : 0;
 
-        while (node && node->pt && !node->pt->terminal) { 
-            if (pt[depth % dim] < node->median) { 
-                node = node->left(); 
-            } else { 
-                node = node->right(); 
-            }
+        //misses may be served by cells refined since the cache was built
+        if (!nn && refinement) nn = refine(c, pt);
 
-            if (node && node->pt && node->pt->terminal) qr = node->pt; 
-            ++depth; 
-        } 
+        leave(epoch);
 
-        return qr; 
-    }
+        //check if terminal
+        if (nn) {
+            double d = SquaredDistance<Point, double, Dim>::compute(*nn, pt, dim);
 
-    void locate(PriorityQueue<typename KdTree<Point, double>::Node *> &pq, const Point &pt)
-    { 
-        typename KdTree<CachedPoint, double>::Node *node = cache->root; 
+            qr[0] = std::pair<Point *, double>(nn, d);
+            found = 1;
 
-        //early out, not covered by cache
-        for (int i = 0; i < dim; ++i) {
-            if (range[i*2] > pt[i] || range[i*2 + 1] < pt[i]) {
-                return;
-            }
+            ++ctx.hits;
+        } else {
+            found = backup->knn(1, pt, eps, qr, ctx.backup); 
         }
 
-        size_t depth = 0; 
+        ++ctx.queries;
+        if (rebuild) track(pt, ctx);
 
-        while (node && node->pt && !node->pt->terminal) { 
+        return found; 
+    }
 
-            //calculate distance from query point to this point 
-            if (node->pt->nn) {
-                double d = 0; 
-                for (int i = 0; i < dim; ++i) {
-                    d += ((*(node->pt->nn->pt))[i]-pt[i]) * ((*(node->pt->nn->pt))[i]-pt[i]); 
-                }
+    /** As knn, but writes the results into a caller supplied buffer.
 
-                if (d < pq.peek().priority) {
-                    pq.push(d, node->pt->nn);
-                }
-            }
+        \return The number of results written, at most k.
+    */
+    size_t knn(size_t k, const Point &pt, double eps, std::pair<Point *, double> *qr, QueryContext &ctx) const
+    {
+        PriorityQueue<Point *> pq(k);
+        size_t epoch = enter();
+        locate(current, pq, pt);
+        leave(epoch);
+        size_t found = backup->knn(k, pq, pt, eps, qr, ctx.backup); 
+
+        ++ctx.queries;
+        return found; 
+    }
 
-            if (pt[depth % dim] < node->median) { 
-                node = node->left(); 
-            } else { 
-                node = node->right(); 
-            }
+    typedef typename PointSet<Point, Dim>::RangeVisitor RangeVisitor;
 
-            ++depth; 
-        } 
-    }
- 
-    size_t dim;
-    KdTree<Point, double> *backup; 
-    double *range;
+    /** Passes the points within distance r of pt to visit, as
+        KdTree::radius_search.  When pt falls in a terminal cell of the cache
+        its nearest neighbour is known, and if that is farther than r there
+        is nothing to find and the backup tree is not searched.  Every other
+        query is a full search of the backup tree, which the cache does not
+        speed up.
 
-    int hits;
-    int queries; 
-};
+        \return False if visit ended the search early.
+    */
+    bool radius_search(const Point &pt, double r, RangeVisitor &visit)
+    {
+        return radius_search(pt, r, visit, context);
+    }
 
-#elif defined ODDSON_TREE_QUADTREE_IMPLEMENTATION
+    bool radius_search(const Point &pt, double r, RangeVisitor &visit, QueryContext &ctx) const
+    {
+        ++ctx.queries;
+        if (beyond(pt, r, ctx)) return true;
 
-#include "compressed_quadtree.h"
-#include "kdtree.h"
+        return backup->radius_search(pt, r, visit);
+    }
 
-#include <algorithm>
-#include <cstdio>
-#include <list>
-#include <vector>
+    //the number of points within distance r of pt, as radius_search
+    size_t radius_count(const Point &pt, double r)
+    {
+        return radius_count(pt, r, context);
+    }
 
-template<class Point> class OddsonTree {
+    size_t radius_count(const Point &pt, double r, QueryContext &ctx) const
+    {
+        ++ctx.queries;
+        if (beyond(pt, r, ctx)) return 0;
 
-public:
+        return backup->radius_count(pt, r);
+    }
 
-     struct CachedPoint : Point { 
-        bool terminal;
-        typename KdTree<Point, double>::Node *nn;
+    /** Searches for the nearest neighbour of each point in a batch, spreading
+        the batch across the threads of a work-stealing pool.  Cache hits are
+        far cheaper than misses, so rather than giving each thread a fixed
+        share of the batch, idle threads steal work from busy ones.
+
+        \param qs The query points.
+        \param count The number of query points.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param qr Receives the nearest neighbour and squared distance of each
+                  query point.
+        \param pool The pool of threads used to run the queries.
+    */
+    void nn_batch(const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool)
+    {
+        nn_batch(qs, count, eps, qr, pool, context);
+    }
 
-        CachedPoint() : nn(0)
-        { 
-        }
+    void nn_batch(const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool, QueryContext &ctx) const
+    {
+        BatchFn fn(this, 1, qs, eps, qr, ctx);
+        pool.parallel_for(0, count, batch_grain, fn);
+    }
 
-        CachedPoint(const Point &pt)
-            : Point(pt)
-        {
+    /** Searches for the k nearest neighbours of each point in a batch.
+        Results for query i are stored at qr[i*k] through qr[i*k + k - 1],
+        nearest first; if fewer than k points are found the remaining
+        entries are set to a null point at maximum distance.
+    */
+    void knn_batch(size_t k, const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool)
+    {
+        knn_batch(k, qs, count, eps, qr, pool, context);
+    }
 
-        } 
-    };
+    void knn_batch(size_t k, const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool, QueryContext &ctx) const
+    {
+        BatchFn fn(this, k, qs, eps, qr, ctx);
+        pool.parallel_for(0, count, batch_grain, fn);
+    }
 
-    struct OddsonTreeTerminal : public CompressedQuadtree<CachedPoint>::EndBuildFn {
+    /** Refines the cache on demand where queries miss it.  A cell of the
+        cache which keeps taking misses, or the bounds of the points for
+        queries outside the cache, is split and its parts tested as the
+        queries arrive, so the cache follows the queries actually made and
+        a tree can start out with a small sample or none at all.  Only nn
+        uses the refined cells.  This must be called before the tree is
+        shared between threads, but queries may then refine it concurrently.
+
+        \param threshold The number of misses a cell takes before it is split.
+        \param max_depth The number of times a cell of the cache may be split.
+        \param test The test used to decide whether refined cells are terminal.
+    */
+    void enable_refinement(size_t threshold = 2, size_t max_depth = 20,
+        OddsonTreeTerminalTest test = CornerTest)
+    {
+        if (refinement) return;
 
-        KdTree<Point, double> *backup;
-        int dim;
-        size_t max_depth;
+        bounds = new double[2*dim];
+        for (size_t d = 0; d < dim; ++d) {
+            bounds[d*2] = std::numeric_limits<double>::max();
+            bounds[d*2+1] = -std::numeric_limits<double>::max();
+        }
 
-        virtual bool operator()(typename CompressedQuadtree<CachedPoint>::Node *node, size_t depth)
-        {
-            if (depth > max_depth) {
-                return true;
+        const Point *pts = backup->tree()->points();
+        for (size_t i = 0; i < backup->tree()->size(); ++i) {
+            for (size_t d = 0; d < dim; ++d) {
+                if (pts[i][d] < bounds[d*2]) bounds[d*2] = pts[i][d];
+                if (pts[i][d] > bounds[d*2+1]) bounds[d*2+1] = pts[i][d];
             }
+        }
 
-            //run interference query (need to make sure all "corners" have same nearest-neighbour)
-            typename KdTree<Point, double>::Node *nn = 0;
-            for (size_t i = 0; i < 1<<dim; ++i) {
-                Point qp;
-                for (size_t d = 0; d < dim; ++d) {
-                    if (i & (1 << d)) qp[d] = node->mid[d] - node->radius;
-                    else qp[d] = node->mid[d] + node->radius;
-                }
-
-                typename KdTree<Point, double>::Node *qr = backup->nn(qp);
+        refinement = new RefinementCache<Point, Dim>(backup, dim, test, threshold, max_depth);
+    }
 
-                if (nn == 0) {
-                    nn = qr;
-                } else {
-                    if (nn != qr) {
-                        return false;
-                    }
-                }
-            } 
+    /** Rebuilds the cache in the background when the query distribution
+        drifts away from the one it was built for.  The hit rate of nn is
+        measured over windows of queries, and when it falls below both the
+        threshold and the rate measured just after the cache was last
+        built, a new cache is built on another thread over a sample of the
+        most recent queries.  The new cache replaces the old with a single
+        pointer swap, so queries never wait for a rebuild or see one half
+        finished, and the old cache is freed once no query can still be
+        using it.  This must be called before the tree is shared between
+        threads.
+
+        \param threshold The hit rate below which the cache may be rebuilt.
+        \param sample_size The number of recent queries each rebuild uses.
+        \param max_depth The maximum depth of the rebuilt caches.
+        \param window The number of queries the hit rate is measured over.
+        \param test The test used to decide whether cells are terminal.
+    */
+    void enable_rebuild(double threshold, size_t sample_size, size_t max_depth,
+        size_t window = 1 << 16, OddsonTreeTerminalTest test = CornerTest)
+    {
+        if (rebuild) return;
 
-            node->pt = new CachedPoint();
-            node->pt->nn = nn;
-            node->pt->terminal = true;
+        rebuild = new CacheRebuild<Point>(threshold, sample_size, max_depth, window, test);
+    }
 
-            return true;
-        } 
-    };
+    //number of rebuilt caches published so far
+    size_t rebuild_count() const
+    {
+        return rebuild ? rebuild->count : 0;
+    }
 
-    OddsonTree(int dim, Point *ps, int n, Point *qs, int m, size_t max_depth)
-        : dim(dim)
+    /** Inserts a point into the set the tree answers queries over, without
+        rebuilding the cache.  Only the terminal cells which the point may
+        now be the nearest neighbour of somewhere in, those with part of
+        their box closer to it than to their cached neighbour, are tested
+        again, and refined cells are reset to be tested again by the next
+        query to reach them.  Cells which fail the test again become misses,
+        which refinement, if enabled, may then split.  Neither insert nor
+        remove may run concurrently with queries, and trees mapped by load
+        cannot be changed.
+
+        \return False if the tree cannot be changed.
+    */
+    bool insert(const Point &pt)
     {
+        if (file) return false;
 
-        backup = new KdTree<Point, double>(dim, ps, n);
+        wait_for_rebuild();
+        backup->insert(pt);
+        invalidate(pt);
 
-        double *range = new double[2*dim];
-        memset(range, 0, 2*dim*sizeof(double));
+        return true;
+    }
 
-        //generate sample points
-        CachedPoint *sample = new CachedPoint[m];
-        for (size_t i = 0; i < m; ++i) {
-            Point &pt = qs[i];
+    /** Removes a point equal to pt from the set the tree answers queries
+        over, testing again only the cells whose cached neighbour it was.
 
-            //copy into cached point
-            for (size_t d = 0; d < dim; ++d) {
-                sample[i][d] = pt[d]; 
-                if (pt[d] < range[d*2]) range[d*2] = pt[d];
-                if (pt[d] > range[d*2+1]) range[d*2+1] = pt[d]; 
-            }
-        }
+        \return False if there is no such point or the tree cannot be changed.
+    */
+    bool remove(const Point &pt)
+    {
+        if (file) return false;
 
-        OddsonTreeTerminal fn;
-        fn.backup = backup;
-        fn.dim = dim;
-        fn.max_depth = max_depth;
-        cache = new CompressedQuadtree<CachedPoint>(dim, sample, m, range, fn);
- 
-        delete[] range;
+        wait_for_rebuild();
+        if (!backup->remove(pt)) return false;
+        invalidate(pt);
 
-        hits = 0;
-        queries = 0;
+        return true;
     }
 
-    virtual ~OddsonTree()
+    //the backup tree's point which is the neighbour of a cache entry, if any
+    Point *neighbour(const CachedPoint *pt) const
     {
-        fprintf(stderr, "info: hits: %d queries: %d percent: %0.2f\n", hits, queries, (double)hits / (double)queries);
-
-        delete cache;
-        delete backup; 
+        return pt->nn ? backup->point(pt->nn - 1) : 0;
     }
 
-    std::list<std::pair<Point *, double> > nn(const Point &pt, double eps) 
+    /** Writes the backup tree and the cache to the file at path.  The file
+        can be mapped by load and queried in place, so a process can start
+        without rebuilding either, and processes on the same host share one
+        copy of it in the page cache.  Points are written as raw memory, so
+        Point must not hold pointers, and trees whose points have been
+        changed by insert or remove cannot be saved.
+
+        \return True on success.
+    */
+    bool save(const char *path) const
     {
-        std::list<std::pair<Point *, double> > result;
+        FILE *f = fopen(path, "wb");
+        if (!f) return false;
 
-        CachedPoint *cache_result = locate(pt);
+        size_t epoch = enter();
+        const Cache *c = current;
 
-        //check if terminal
-        if (cache_result && cache_result->nn) {
-            double d = 0; 
-            for (int i = 0; i < dim; ++i) {
-                d += ((*(cache_result->nn->pt))[i]-pt[i]) * ((*(cache_result->nn->pt))[i]-pt[i]); 
-            } 
+        FileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, file_magic, sizeof(header.magic));
+        header.dim = dim;
 
-            result.push_back(std::make_pair<Point *, double>(cache_result->nn->pt, d));
+        //the header is written again once the offsets are known
+        bool ok = write_file(f, &header, 1) && write_file(f, c->range, 2*dim);
 
-            ++hits;
-        } else {
-            result = backup->knn(1, pt, eps); 
-        }
+        header.backup_offset = align_file(f);
+        ok = ok && backup->save(f);
+        header.cache_offset = align_file(f);
+        ok = ok && c->tree->save(f);
 
-        ++queries;
-        return result; 
-    } 
+        ok = ok && fseek(f, 0, SEEK_SET) == 0 && write_file(f, &header, 1);
+
+        leave(epoch);
 
-    std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, int eps) 
+        return fclose(f) == 0 && ok;
+    }
+
+    /** Maps an odds-on tree saved to the file at path.  Nothing is rebuilt
+        or copied: both trees are queried directly from the read only
+        mapping, and the points returned point into it.
+
+        \return The tree, or zero if the file could not be mapped or does
+                not hold a tree of this type.
+    */
+    static OddsonTree *load(const char *path)
     {
-        std::list<std::pair<Point *, double> > result;
+        MappedFile *file = new MappedFile(path);
+        const FileHeader *header = (const FileHeader *)file->data;
+
+        if (!file->data || file->size < sizeof(FileHeader)
+            || memcmp(header->magic, file_magic, sizeof(header->magic))
+            || (Dim && header->dim != Dim)
+            || sizeof(FileHeader) + 2*header->dim*sizeof(double) > file->size
+            || header->backup_offset >= file->size
+            || header->cache_offset >= file->size) {
+            delete file;
+            return 0;
+        }
 
-        //check cache
-        bool in_cache = false;
+        OddsonTree *tree = new OddsonTree(header->dim, file);
+        Cache *c = tree->current = new Cache;
 
-        CachedPoint *cp = locate(pt);
+        c->range = new double[2*tree->dim];
+        memcpy(c->range, file->data + sizeof(FileHeader), 2*tree->dim*sizeof(double));
 
-        PriorityQueue<typename KdTree<Point, double>::Node *> pq(k);
-        locate(pq, pt);
-        result = backup->knn(k, pq, pt, eps); 
-        ++queries;
-        return result; 
+        KdTree<Point, double, Dim> *points = KdTree<Point, double, Dim>::view(
+            file->data + header->backup_offset, file->size - header->backup_offset);
+        if (points) tree->backup = new PointSet<Point, Dim>(tree->dim, points);
+        c->tree = KdTree<CachedPoint, double, Dim>::view(file->data + header->cache_offset,
+            file->size - header->cache_offset);
+
+        if (!tree->backup || !c->tree) {
+            delete tree;
+            return 0;
+        }
+
+        return tree;
     }
 
-    CompressedQuadtree<CachedPoint> *cache; 
+    //the cache queries currently use, which a rebuild may replace
+    KdTree<CachedPoint, double, Dim> *cache() const
+    {
+        return current->tree;
+    }
 
 private:
 
-    size_t dim;
-    KdTree<Point, double> *backup; 
+    typedef typename KdTree<CachedPoint, double, Dim>::Node CacheNode;
 
-    int hits;
-    int queries;
+    /** A cache and the range and sample it was built over.  A rebuild
+        replaces all of them at once.
+    */
+    struct Cache {
+        Cache() : tree(0), range(0), sample(0), test(CornerTest)
+        {
+        }
 
-    CachedPoint *locate(const Point &pt) 
-    { 
-        typename CompressedQuadtree<CachedPoint>::Node *node = 0;
-        CachedPoint *qr = 0; 
+        virtual ~Cache()
+        {
+            delete tree;
+            delete[] range;
+            delete[] sample;
+        }
 
-        //search for node containing the query point 
-        if (cache->root->in_node(pt, cache->dim)) { 
-            node = cache->root; 
-
-            while (node) {
-
-                if (node->nodes) { 
-                    size_t n = 0; 
-                    for (size_t d = 0; d < dim; ++d) { 
-                        if (pt[d] > node->mid[d]) n += 1 << d; 
-                    } 
-
-                    if (node->nodes[n] && node->nodes[n]->in_node(pt, cache->dim)) {
-                        node = node->nodes[n]; 
-                        if (node && node->pt && node->pt->terminal) {
-                            qr = node->pt; 
-                            break;
-                        }
-                    } else {
-                        break;
-                    } 
-                } else {
-                    break;
-                } 
-            } 
-        } 
+        KdTree<CachedPoint, double, Dim> *tree;
+        double *range;
 
-        return qr; 
-    } 
+        //zero if the tree is mapped from a file
+        CachedPoint *sample;
 
-    CachedPoint *locate(PriorityQueue<typename KdTree<Point, double>::Node *> &pq, const Point &pt)
-    {
-        typename CompressedQuadtree<CachedPoint>::Node *node = 0;
-        CachedPoint *qr = 0; 
+        //the test its cells passed
+        OddsonTreeTerminalTest test;
+    };
 
-        //search for node containing the query point 
-        if (cache->root->in_node(pt, cache->dim)) { 
-            node = cache->root; 
-
-            while (node) {
-
-                if (node->nodes) { 
-                    size_t n = 0; 
-                    for (size_t d = 0; d < dim; ++d) { 
-                        if (pt[d] > node->mid[d]) n += 1 << d; 
-                    } 
-
-                    if (node->nodes[n] && node->nodes[n]->in_node(pt, cache->dim)) {
-                        node = node->nodes[n]; 
-
-                        if (node->pt && node->pt->nn) {
-                            double d = 0; 
-                            for (int i = 0; i < dim; ++i) {
-                                d += ((*(node->pt->nn->pt))[i]-pt[i]) * ((*(node->pt->nn->pt))[i]-pt[i]); 
-                            } 
-
-                            pq.push(d, node->pt->nn);
-                        }
-
-                        if (node->pt && node->pt->terminal) {
-                            qr = node->pt; 
-                            break;
-                        }
-                    } else {
-                        break;
-                    } 
-                } else {
-                    break;
-                } 
-            } 
-        } 
+    static const char file_magic[8];
 
-        return qr; 
+    //followed by the range covered by the cache, then the images of the trees
+    struct FileHeader {
+        char magic[8];
+        unsigned long long dim;
+        unsigned long long backup_offset;
+        unsigned long long cache_offset;
+    };
+
+    //tree mapped from a file by load
+    OddsonTree(size_t dim, MappedFile *file)
+        : dim(dim)
+        , backup(0)
+        , current(0)
+        , file(file)
+        , refinement(0)
+        , bounds(0)
+        , rebuild(0)
+        , changes(0)
+        , retested(0)
+    {
+    }
+
+    //queries per batch task, small since misses cost far more than hits
+    static const size_t batch_grain = 32;
+
+    struct BatchFn : public ThreadPool::RangeFn {
+
+        BatchFn(const OddsonTree *tree, size_t k, const Point *qs, double eps,
+            std::pair<Point *, double> *qr, QueryContext &stats)
+            : tree(tree)
+            , k(k)
+            , qs(qs)
+            , eps(eps)
+            , qr(qr)
+            , stats(stats)
+        {
+        }
+
+        virtual void operator()(size_t begin, size_t end)
+        {
+            QueryContext ctx;
+
+            for (size_t i = begin; i < end; ++i) {
+                std::pair<Point *, double> *result = qr + i*k;
+
+                size_t found;
+                if (k == 1) found = tree->nn(qs[i], eps, result, ctx);
+                else found = tree->knn(k, qs[i], eps, result, ctx);
+
+                for (size_t j = found; j < k; ++j) {
+                    result[j] = std::pair<Point *, double>(0, std::numeric_limits<double>::max());
+                }
+            }
+
+            if (tree->rebuild) tree->report(ctx);
+
+            __sync_fetch_and_add(&stats.hits, ctx.hits);
+            __sync_fetch_and_add(&stats.queries, ctx.queries);
+            __sync_fetch_and_add(&stats.backup.knn_nodes_visited, ctx.backup.knn_nodes_visited);
+        }
+
+        const OddsonTree *tree;
+        size_t k;
+        const Point *qs;
+        double eps;
+        std::pair<Point *, double> *qr;
+        QueryContext &stats;
+    };
+
+
+    CachedPoint *locate(const Cache *c, const Point &pt) const
+    { 
+        const KdTree<CachedPoint, double, Dim> *cache = c->tree;
+        typename KdTree<CachedPoint, double, Dim>::Node *node = cache->root; 
+        CachedPoint *qr = 0; 
+
+        //early out, not covered by cache
+        for (int i = 0; i < dim; ++i) {
+            if (c->range[i*2] > pt[i] || c->range[i*2 + 1] < pt[i]) {
+                return qr;
+            }
+        }
+
+        size_t depth = 0; 
+
+        while (node && !cache->point(node)->terminal) { 
+            if (pt[depth % dim] < node->median) { 
+                node = node->left(); 
+            } else { 
+                node = node->right(); 
+            }
+
+            if (node && cache->point(node)->terminal) qr = cache->point(node); 
+            ++depth; 
+        } 
+
+        return qr; 
+    }
+
+    /** Finds the cell of the cache which pt falls in, narrowing the range
+        covered by the cache by the medians on the way down.
+
+        \return False if pt is outside the range covered by the cache.
+    */
+    bool miss_cell(const Cache *c, const Point &pt, double *box) const
+    {
+        const double *range = c->range;
+        for (size_t d = 0; d < dim; ++d) {
+            if (range[d*2] > pt[d] || range[d*2 + 1] < pt[d]) return false;
+            box[d*2] = range[d*2];
+            box[d*2+1] = range[d*2+1];
+        }
+
+        const KdTree<CachedPoint, double, Dim> *cache = c->tree;
+        typename KdTree<CachedPoint, double, Dim>::Node *node = cache->root;
+        size_t depth = 0;
+
+        while (node && !cache->point(node)->terminal) {
+            size_t axis = depth % dim;
+            if (pt[axis] < node->median) {
+                box[axis*2+1] = node->median;
+                node = node->left();
+            } else {
+                box[axis*2] = node->median;
+                node = node->right();
+            }
+
+            ++depth;
+        }
+
+        return true;
+    }
+
+    //looks up a cache miss in the refined cells
+    Point *refine(const Cache *c, const Point &pt) const
+    {
+        std::vector<double> box(2*dim);
+        if (!miss_cell(c, pt, &box[0])) {
+            memcpy(&box[0], bounds, 2*dim*sizeof(double));
+        }
+
+        return refinement->find(pt, &box[0]);
+    }
+
+    //tests again the cells a change to the points at pt may affect, once it is made
+    void invalidate(const Point &pt)
+    {
+        Cache *c = current;
+        if (c->tree->root) {
+            std::vector<double> box(c->range, c->range + 2*dim);
+            invalidate(c, c->tree->root, 0, &box[0], pt);
+        }
+
+        if (refinement) refinement->invalidate(pt);
+        ++changes;
+    }
+
+    /** Tests again the terminal cells below node which pt may now be, or
+        may have been, the nearest neighbour of somewhere in.  A subtree is
+        skipped when the neighbour cached at its root is strictly closer
+        than pt to all of its box, since pt is then the nearest neighbour of
+        nothing in it, before or after the change.  Neighbours cached at
+        the roots of subtrees were found no later than those below them, so
+        they remain valid bounds after earlier changes.
+    */
+    void invalidate(const Cache *c, CacheNode *node, size_t depth, double *box, const Point &pt)
+    {
+        CachedPoint *cached = c->tree->point(node);
+
+        //a removed neighbour no longer bounds anything, nor may it seed searches
+        if (cached->nn && backup->equal(*neighbour(cached), pt)) cached->nn = 0;
+
+        if (cached->terminal) {
+            if (!cached->nn || !backup->closer(*neighbour(cached), pt, box)) retest(c, node, cached, box);
+            return;
+        }
+
+        if (cached->nn && backup->closer(*neighbour(cached), pt, box)) return;
+
+        size_t axis = depth % dim;
+        double t;
+
+        if (node->left()) {
+            t = box[axis*2+1];
+            box[axis*2+1] = node->median;
+            invalidate(c, node->left(), depth + 1, box, pt);
+            box[axis*2+1] = t;
+        }
+
+        if (node->right()) {
+            t = box[axis*2];
+            box[axis*2] = node->median;
+            invalidate(c, node->right(), depth + 1, box, pt);
+            box[axis*2] = t;
+        }
+    }
+
+    //runs the terminal test again on a cell, which becomes a miss if it fails
+    void retest(const Cache *c, CacheNode *node, CachedPoint *cached, double *box)
+    {
+        OddsonTreeTerminal fn;
+        fn.backup = backup;
+        fn.dim = dim;
+        fn.max_depth = 0;
+        fn.test = c->test;
+
+        //the cell was within the depth limit when the cache was built
+        cached->terminal = false;
+        fn(node, cached, box, 0);
+
+        ++retested;
+    }
+
+    void locate(const Cache *c, PriorityQueue<Point *> &pq, const Point &pt) const
+    { 
+        const KdTree<CachedPoint, double, Dim> *cache = c->tree;
+        typename KdTree<CachedPoint, double, Dim>::Node *node = cache->root; 
+
+        //early out, not covered by cache
+        for (int i = 0; i < dim; ++i) {
+            if (c->range[i*2] > pt[i] || c->range[i*2 + 1] < pt[i]) {
+                return;
+            }
+        }
+
+        size_t depth = 0; 
+
+        while (node && !cache->point(node)->terminal) { 
+            CachedPoint *cached = cache->point(node);
+
+            //cached neighbours are candidates for the search of the backup tree
+            if (cached->nn) {
+                Point *nn = neighbour(cached);
+                double d = SquaredDistance<Point, double, Dim>::compute(*nn, pt, dim);
+                pq.push(d, nn);
+            }
+
+            if (pt[depth % dim] < node->median) { 
+                node = node->left(); 
+            } else { 
+                node = node->right(); 
+            }
+
+            ++depth; 
+        } 
+    }
+ 
+    size_t dim;
+    PointSet<Point, Dim> *backup; 
+
+    //the cache in use, swapped for a new one by each rebuild
+    Cache * volatile current;
+
+    //file mapped by load, if any
+    MappedFile *file;
+
+    //cells refined on demand, and the bounds of the points, if enabled
+    RefinementCache<Point, Dim> *refinement;
+    double *bounds;
+
+    //state for background rebuilds of the cache, if enabled
+    CacheRebuild<Point> *rebuild;
+
+    //points inserted or removed, and cells tested again after them
+    size_t changes;
+    size_t retested;
+
+    //queries record one in this many of their points for rebuilds
+    static const size_t record_stride = 4;
+
+    //queries between reports of a thread's hits to the rebuild monitor
+    static const size_t report_interval = 256;
+
+    //the reader side of the swap of the current cache
+    size_t enter() const
+    {
+        return rebuild ? rebuild->epochs.enter() : 0;
+    }
+
+    void leave(size_t epoch) const
+    {
+        if (rebuild) rebuild->epochs.leave(epoch);
+    }
+
+    //waits for a rebuild in progress, which may still swap in a new cache
+    void wait_for_rebuild() const
+    {
+        while (rebuild && __sync_fetch_and_add(&rebuild->running, 0)) usleep(1000);
+    }
+
+    /** Whether the cache shows that the nearest neighbour of pt is farther
+        than r, which answers a radius query without the backup tree and so
+        counts as a hit.
+    */
+    bool beyond(const Point &pt, double r, QueryContext &ctx) const
+    {
+        size_t epoch = enter();
+        const Cache *c = current;
+
+        CachedPoint *cache_result = locate(c, pt);
+        Point *nn = cache_result ? neighbour(cache_result) : 0;
+        if (!nn && refinement) nn = refine(c, pt);
+
+        leave(epoch);
+
+        if (!nn || SquaredDistance<Point, double, Dim>::compute(*nn, pt, dim) <= r*r) return false;
+
+        ++ctx.hits;
+        return true;
+    }
+
+    //records a query for future rebuilds, reporting the hits of ctx every so often
+    void track(const Point &pt, QueryContext &ctx) const
+    {
+        if (ctx.queries % record_stride == 0) rebuild->reservoir.record(pt);
+        if (ctx.queries - ctx.reported_queries >= report_interval) report(ctx);
+    }
+
+    //reports the hits of ctx, starting a rebuild if the cache has drifted
+    void report(QueryContext &ctx) const
+    {
+        bool drifted = rebuild->monitor.add(ctx.hits - ctx.reported_hits,
+            ctx.queries - ctx.reported_queries);
+        ctx.reported_hits = ctx.hits;
+        ctx.reported_queries = ctx.queries;
+
+        if (drifted && __sync_bool_compare_and_swap(&rebuild->running, 0, 1)) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+            pthread_t thread;
+            if (pthread_create(&thread, &attr, rebuild_main, const_cast<OddsonTree *>(this))) {
+                __sync_lock_release(&rebuild->running);
+            }
+
+            pthread_attr_destroy(&attr);
+        }
+    }
+
+    static void *rebuild_main(void *tree)
+    {
+        ((OddsonTree *)tree)->rebuild_cache();
+        return 0;
+    }
+
+    //builds a cache over the recent queries and swaps it in for the current one
+    void rebuild_cache()
+    {
+        std::vector<Point> qs;
+        if (rebuild->reservoir.snapshot(qs)) {
+            Cache *fresh = build_cache(&qs[0], qs.size(), rebuild->max_depth, rebuild->test, 0);
+
+            Cache *old = __sync_lock_test_and_set(&current, fresh);
+            rebuild->epochs.synchronize();
+            delete old;
+
+            rebuild->monitor.reset();
+            __sync_fetch_and_add(&rebuild->count, 1);
+        }
+
+        //the tree may be destroyed as soon as this is cleared
+        __sync_lock_release(&rebuild->running);
+    }
+
+    QueryContext context;
+
+    //cells with at least this many corners query them in parallel
+    static const size_t parallel_corner_cutoff = 16;
+    static const size_t corner_grain = 4;
+
+    void build(Point *ps, int n, Point *qs, int m, size_t max_depth,
+        OddsonTreeTerminalTest test, ThreadPool *pool)
+    {
+        //cache misses are served by the backup tree, so use buckets to speed them up
+        typename KdTree<Point, double, Dim>::Buckets buckets;
+        KdTree<Point, double, Dim> *points;
+        if (pool) points = new KdTree<Point, double, Dim>(dim, ps, n, buckets, *pool);
+        else points = new KdTree<Point, double, Dim>(dim, ps, n, buckets);
+
+        backup = new PointSet<Point, Dim>(dim, points);
+
+        current = build_cache(qs, m, max_depth, test, pool);
+    }
+
+    //builds a cache over the sample query points qs
+    Cache *build_cache(const Point *qs, size_t m, size_t max_depth,
+        OddsonTreeTerminalTest test, ThreadPool *pool) const
+    {
+        Cache *c = new Cache;
+        c->test = test;
+
+        //track range covered by sample
+        double *range = c->range = new double[2*dim]; 
+        for (size_t d = 0; d < dim; ++d) {
+            range[d*2] = std::numeric_limits<double>::max();
+            range[d*2+1] = -std::numeric_limits<double>::max();
+        }
+
+        //generate sample points
+        CachedPoint *sample = c->sample = new CachedPoint[m];
+        for (size_t i = 0; i < m; ++i) {
+            const Point &pt = qs[i];
+
+            //copy into cached point
+            for (size_t d = 0; d < dim; ++d) {
+                sample[i][d] = pt[d];
+                if (pt[d] < range[d*2]) range[d*2] = pt[d];
+                if (pt[d] > range[d*2+1]) range[d*2+1] = pt[d];
+            }
+        }
+
+        //build kdtree for cache
+        OddsonTreeTerminal fn;
+        fn.backup = backup;
+        fn.dim = dim;
+        fn.max_depth = max_depth;
+        fn.test = test;
+        fn.pool = pool;
+        if (test == CornerTest) fn.memo = new CornerCache<Point, Point *>(dim, m);
+        if (pool) c->tree = new KdTree<CachedPoint, double, Dim>(dim, sample, m, range, fn, *pool); 
+        else c->tree = new KdTree<CachedPoint, double, Dim>(dim, sample, m, range, fn); 
+
+        if (fn.memo) {
+            fprintf(stderr, "info: corner queries: %zu unique: %zu dedup: %0.2f\n",
+                fn.memo->lookup_count(), fn.memo->size(),
+                (double)fn.memo->lookup_count() / (double)std::max<size_t>(fn.memo->size(), 1));
+            delete fn.memo;
+        }
+
+        return c;
+    }
+};
+
+template<class Point, int Dim>
+const char OddsonTree<Point, Dim>::file_magic[8] = { 'O', 'D', 'D', 'S', 'K', 'D', '1', 0 };
+
+#elif defined ODDSON_TREE_QUADTREE_IMPLEMENTATION
+
+#include "compressed_quadtree.h"
+#include "corner_cache.h"
+#include "distance.h"
+#include "kdtree.h"
+#include "cache_rebuild.h"
+#include "linear_quadtree.h"
+#include "mapped_file.h"
+#include "point_set.h"
+#include "refinement_cache.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <vector>
+
+#include <unistd.h>
+
+template<class Point, int Dim = 0> class OddsonTree {
+
+public:
+
+    /** As in the kd-tree implementation, cache entries hold the index of
+        the neighbour in the backup tree's points.
+    */
+    struct CachedPoint : Point { 
+        bool terminal;
+
+        //index of the nearest neighbour plus one, zero if there is none
+        size_t nn;
+
+        CachedPoint() : terminal(false), nn(0)
+        { 
+        }
+
+        CachedPoint(const Point &pt)
+            : Point(pt)
+            , terminal(false)
+            , nn(0)
+        {
+
+        } 
+    };
+
+    /** Runs the nearest neighbour queries for a range of corners of a cell,
+        recording the first neighbour found and whether any corner disagrees
+        with it.  Safe to run concurrently over different ranges of corners.
+    */
+    struct CornerFn : public ThreadPool::RangeFn {
+
+        CornerFn(const PointSet<Point, Dim> *backup, CornerCache<Point, Point *> *memo,
+                size_t dim, const CachedPoint &mid, double radius)
+            : backup(backup)
+            , memo(memo)
+            , dim(dim)
+            , mid(mid)
+            , radius(radius)
+            , nn(0)
+            , mismatch(0)
+        {
+        }
+
+        virtual void operator()(size_t begin, size_t end)
+        {
+            typename PointSet<Point, Dim>::SearchContext ctx;
+
+            for (size_t i = begin; i < end && !__sync_fetch_and_add(&mismatch, 0); ++i) {
+                Point qp;
+                for (size_t d = 0; d < dim; ++d) {
+                    if (i & (1 << d)) qp[d] = mid[d] - radius;
+                    else qp[d] = mid[d] + radius;
+                }
+
+                Point *qr;
+                if (!memo || !memo->find(qp, qr)) {
+                    std::pair<Point *, double> result;
+                    qr = backup->knn(1, qp, 0.0, &result, ctx) ? result.first : 0;
+                    if (memo) memo->insert(qp, qr);
+                }
+
+                Point *first = __sync_val_compare_and_swap(&nn, (Point *)0, qr);
+                if (first && first != qr) {
+                    __sync_fetch_and_add(&mismatch, 1);
+                }
+            } 
+        }
+
+        const PointSet<Point, Dim> *backup;
+        CornerCache<Point, Point *> *memo;
+        size_t dim;
+        const CachedPoint &mid;
+        double radius;
+
+        Point * volatile nn;
+        volatile long mismatch;
+    };
+
+    struct OddsonTreeTerminal : public CompressedQuadtree<CachedPoint, Dim>::EndBuildFn {
+
+        OddsonTreeTerminal() : memo(0), test(CornerTest), pool(0), entries(0)
+        {
+        }
+
+        PointSet<Point, Dim> *backup;
+
+        //if set, remembers corner queries so cells sharing corners run them once
+        CornerCache<Point, Point *> *memo;
+
+        int dim;
+        size_t max_depth;
+        OddsonTreeTerminalTest test;
+
+        //if set, cells with many corners query them in parallel
+        ThreadPool *pool;
+
+        //terminal entries come from here and are freed with the cache
+        Arena *entries;
+
+        //a terminal cell tested again keeps its entry
+        CachedPoint *entry(typename CompressedQuadtree<CachedPoint, Dim>::Node *node)
+        {
+            if (node->pt && node->pt->terminal) return node->pt;
+            void *mem = entries->allocate(sizeof(CachedPoint));
+            return mem ? new (mem) CachedPoint() : 0;
+        }
+
+        virtual bool operator()(typename CompressedQuadtree<CachedPoint, Dim>::Node *node, size_t depth)
+        {
+            if (depth > max_depth) {
+                return true;
+            }
+
+            if (test == CentreTest) {
+                Point centre;
+                for (size_t d = 0; d < dim; ++d) {
+                    centre[d] = node->mid[d];
+                }
+                double radius = node->radius * sqrt((double)dim);
+
+                typename PointSet<Point, Dim>::SearchContext ctx;
+                std::pair<Point *, double> qr[2];
+                size_t found = backup->knn(2, centre, 0.0, qr, ctx);
+
+                if (found == 2 && sqrt(qr[1].second) - sqrt(qr[0].second) <= 2*radius) {
+                    return false;
+                }
+
+                CachedPoint *cp = entry(node);
+                if (!cp) return false;
+
+                node->pt = cp;
+                node->pt->nn = found ? backup->index(qr[0].first) + 1 : 0;
+                node->pt->terminal = true;
+
+                return true;
+            }
+
+            //run interference query (need to make sure all "corners" have same nearest-neighbour)
+            CornerFn corners(backup, memo, dim, node->mid, node->radius);
+            size_t ncorners = 1 << dim;
+            if (pool && ncorners >= parallel_corner_cutoff) {
+                pool->parallel_for(0, ncorners, corner_grain, corners);
+            } else {
+                corners(0, ncorners);
+            }
+
+            if (corners.mismatch) {
+                return false;
+            } 
+
+            CachedPoint *cp = entry(node);
+            if (!cp) return false;
+
+            node->pt = cp;
+            node->pt->nn = corners.nn ? backup->index(corners.nn) + 1 : 0;
+            node->pt->terminal = true;
+
+            return true;
+        } 
+    };
+
+    /** Per-thread query state: the search context for the backup tree and
+        hit statistics.  The const query methods take one of these from the
+        caller so that a single tree can be shared between threads.
+    */
+    struct QueryContext {
+        QueryContext()
+            : hits(0)
+            , queries(0)
+            , reported_hits(0)
+            , reported_queries(0)
+        {
+        }
+
+        typename PointSet<Point, Dim>::SearchContext backup;
+
+        size_t hits;
+        size_t queries;
+
+        //counts already reported to the rebuild monitor
+        size_t reported_hits;
+        size_t reported_queries;
+    };
+
+    /** Builds the backup tree over the points ps and a cache over the
+        sample query points qs.
+
+        \param max_depth The maximum depth of the cache.
+        \param test The test used to decide whether cells are terminal.
+    */
+    OddsonTree(int dim, Point *ps, int n, Point *qs, int m, size_t max_depth,
+            OddsonTreeTerminalTest test = CornerTest)
+        : dim(dim)
+        , file(0)
+        , refinement(0)
+        , bounds(0)
+        , rebuild(0)
+        , changes(0)
+        , retested(0)
+        , indexed(false)
+    {
+        build(ps, n, qs, m, max_depth, test, 0);
+    }
+
+    /** As above, but builds the backup tree and the cache using the threads
+        of the pool.  Subtrees of the cache are tested in parallel, as are the
+        corners of cells in higher dimensions.
+    */
+    OddsonTree(int dim, Point *ps, int n, Point *qs, int m, size_t max_depth, ThreadPool &pool,
+            OddsonTreeTerminalTest test = CornerTest)
+        : dim(dim)
+        , file(0)
+        , refinement(0)
+        , bounds(0)
+        , rebuild(0)
+        , changes(0)
+        , retested(0)
+        , indexed(false)
+    {
+        build(ps, n, qs, m, max_depth, test, &pool);
+    }
+
+    virtual ~OddsonTree()
+    {
+        if (rebuild) {
+            wait_for_rebuild();
+            fprintf(stderr, "info: rebuilds: %zu\n", rebuild->count);
+        }
+
+        fprintf(stderr, "info: hits: %zu queries: %zu percent: %0.2f\n", context.hits, context.queries, (double)context.hits / (double)context.queries);
+
+        if (refinement) fprintf(stderr, "info: refined cells: %zu\n", refinement->size());
+
+        if (changes) fprintf(stderr, "info: changes: %zu retested cells: %zu\n", changes, retested);
+
+        delete rebuild;
+        delete refinement;
+        delete[] bounds;
+        delete current;
+        delete backup; 
+        delete file;
+    }
+
+    std::list<std::pair<Point *, double> > nn(const Point &pt, double eps) 
+    {
+        return nn(pt, eps, context);
+    }
+
+    std::list<std::pair<Point *, double> > nn(const Point &pt, double eps, QueryContext &ctx) const
+    {
+        std::list<std::pair<Point *, double> > result;
+
+        std::pair<Point *, double> qr;
+        if (nn(pt, eps, &qr, ctx)) result.push_back(qr);
+
+        return result; 
+    } 
+
+    std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps) 
+    {
+        return knn(k, pt, eps, context);
+    }
+
+    std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps, QueryContext &ctx) const
+    {
+        std::list<std::pair<Point *, double> > result;
+
+        PriorityQueue<Point *> pq(k);
+        size_t epoch = enter();
+        locate(current, pq, pt);
+        leave(epoch);
+        result = backup->knn(k, pq, pt, eps, ctx.backup); 
+        ++ctx.queries;
+        return result; 
+    }
+
+    /** As nn, but writes the result into a caller supplied buffer.
+
+        \return The number of results written, at most one.
+    */
+    size_t nn(const Point &pt, double eps, std::pair<Point *, double> *qr, QueryContext &ctx) const
+    {
+        size_t found;
+
+        size_t epoch = enter();
+        const Cache *c = current;
+
+        CachedPoint *cache_result = locate(c, pt);
+        Point *nn = cache_result ? neighbour(cache_result) : 0;
+
+        //misses may be served by cells refined since the cache was built
+        if (!nn && refinement) nn = refine(c, pt);
+
+        leave(epoch);
+
+        //check if terminal
+        if (nn) {
+            double d = SquaredDistance<Point, double, Dim>::compute(*nn, pt, dim);
+
+            qr[0] = std::pair<Point *, double>(nn, d);
+            found = 1;
+
+            ++ctx.hits;
+        } else {
+            found = backup->knn(1, pt, eps, qr, ctx.backup); 
+        }
+
+        ++ctx.queries;
+        if (rebuild) track(pt, ctx);
+
+        return found; 
+    }
+
+    /** As knn, but writes the results into a caller supplied buffer.
+
+        \return The number of results written, at most k.
+    */
+    size_t knn(size_t k, const Point &pt, double eps, std::pair<Point *, double> *qr, QueryContext &ctx) const
+    {
+        PriorityQueue<Point *> pq(k);
+        size_t epoch = enter();
+        locate(current, pq, pt);
+        leave(epoch);
+        size_t found = backup->knn(k, pq, pt, eps, qr, ctx.backup); 
+
+        ++ctx.queries;
+        return found; 
+    }
+
+    typedef typename PointSet<Point, Dim>::RangeVisitor RangeVisitor;
+
+    /** Passes the points within distance r of pt to visit, as
+        KdTree::radius_search.  When pt falls in a terminal cell of the cache
+        its nearest neighbour is known, and if that is farther than r there
+        is nothing to find and the backup tree is not searched.  Every other
+        query is a full search of the backup tree, which the cache does not
+        speed up.
+
+        \return False if visit ended the search early.
+    */
+    bool radius_search(const Point &pt, double r, RangeVisitor &visit)
+    {
+        return radius_search(pt, r, visit, context);
+    }
+
+    bool radius_search(const Point &pt, double r, RangeVisitor &visit, QueryContext &ctx) const
+    {
+        ++ctx.queries;
+        if (beyond(pt, r, ctx)) return true;
+
+        return backup->radius_search(pt, r, visit);
+    }
+
+    //the number of points within distance r of pt, as radius_search
+    size_t radius_count(const Point &pt, double r)
+    {
+        return radius_count(pt, r, context);
+    }
+
+    size_t radius_count(const Point &pt, double r, QueryContext &ctx) const
+    {
+        ++ctx.queries;
+        if (beyond(pt, r, ctx)) return 0;
+
+        return backup->radius_count(pt, r);
+    }
+
+    /** Searches for the nearest neighbour of each point in a batch, spreading
+        the batch across the threads of a work-stealing pool.  Cache hits are
+        far cheaper than misses, so rather than giving each thread a fixed
+        share of the batch, idle threads steal work from busy ones.
+
+        \param qs The query points.
+        \param count The number of query points.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param qr Receives the nearest neighbour and squared distance of each
+                  query point.
+        \param pool The pool of threads used to run the queries.
+    */
+    void nn_batch(const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool)
+    {
+        nn_batch(qs, count, eps, qr, pool, context);
+    }
+
+    void nn_batch(const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool, QueryContext &ctx) const
+    {
+        BatchFn fn(this, 1, qs, eps, qr, ctx);
+        pool.parallel_for(0, count, batch_grain, fn);
+    }
+
+    /** Searches for the k nearest neighbours of each point in a batch.
+        Results for query i are stored at qr[i*k] through qr[i*k + k - 1],
+        nearest first; if fewer than k points are found the remaining
+        entries are set to a null point at maximum distance.
+    */
+    void knn_batch(size_t k, const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool)
+    {
+        knn_batch(k, qs, count, eps, qr, pool, context);
+    }
+
+    void knn_batch(size_t k, const Point *qs, size_t count, double eps,
+        std::pair<Point *, double> *qr, ThreadPool &pool, QueryContext &ctx) const
+    {
+        BatchFn fn(this, k, qs, eps, qr, ctx);
+        pool.parallel_for(0, count, batch_grain, fn);
+    }
+
+    /** Refines the cache on demand where queries miss it.  A cell of the
+        cache which keeps taking misses, or the bounds of the points for
+        queries outside the cache, is split and its parts tested as the
+        queries arrive, so the cache follows the queries actually made and
+        a tree can start out with a small sample or none at all.  Only nn
+        uses the refined cells.  This must be called before the tree is
+        shared between threads, but queries may then refine it concurrently.
+
+        \param threshold The number of misses a cell takes before it is split.
+        \param max_depth The number of times a cell of the cache may be split.
+        \param test The test used to decide whether refined cells are terminal.
+    */
+    void enable_refinement(size_t threshold = 2, size_t max_depth = 20,
+        OddsonTreeTerminalTest test = CornerTest)
+    {
+        if (refinement) return;
+
+        bounds = new double[2*dim];
+        for (size_t d = 0; d < dim; ++d) {
+            bounds[d*2] = std::numeric_limits<double>::max();
+            bounds[d*2+1] = -std::numeric_limits<double>::max();
+        }
+
+        const Point *pts = backup->tree()->points();
+        for (size_t i = 0; i < backup->tree()->size(); ++i) {
+            for (size_t d = 0; d < dim; ++d) {
+                if (pts[i][d] < bounds[d*2]) bounds[d*2] = pts[i][d];
+                if (pts[i][d] > bounds[d*2+1]) bounds[d*2+1] = pts[i][d];
+            }
+        }
+
+        refinement = new RefinementCache<Point, Dim>(backup, dim, test, threshold, max_depth);
+    }
+
+    /** Locates queries in the cache through a linear quadtree, a hash table
+        of its cells, by binary search over the levels of the cells holding
+        the query point rather than by walking down from the root.  The
+        walk visits only the nodes where the cache branches, which are
+        usually near the root and so in the processor's cache.  The search
+        takes a lookup per halving of the depth of the cache, but each one
+        is likely a cache miss, so this only pays for caches which branch
+        many times down the paths of the queries.  Rebuilt caches are
+        indexed as well.  This must be called before the tree is shared
+        between threads.
+    */
+    void enable_linear_index()
+    {
+        if (indexed) return;
+
+        wait_for_rebuild();
+        indexed = true;
+        current->index = new LinearQuadtree<CachedPoint, Dim>(dim, current->tree->root);
+    }
+
+    /** Rebuilds the cache in the background when the query distribution
+        drifts away from the one it was built for.  The hit rate of nn is
+        measured over windows of queries, and when it falls below both the
+        threshold and the rate measured just after the cache was last
+        built, a new cache is built on another thread over a sample of the
+        most recent queries.  The new cache replaces the old with a single
+        pointer swap, so queries never wait for a rebuild or see one half
+        finished, and the old cache is freed once no query can still be
+        using it.  This must be called before the tree is shared between
+        threads.
+
+        \param threshold The hit rate below which the cache may be rebuilt.
+        \param sample_size The number of recent queries each rebuild uses.
+        \param max_depth The maximum depth of the rebuilt caches.
+        \param window The number of queries the hit rate is measured over.
+        \param test The test used to decide whether cells are terminal.
+    */
+    void enable_rebuild(double threshold, size_t sample_size, size_t max_depth,
+        size_t window = 1 << 16, OddsonTreeTerminalTest test = CornerTest)
+    {
+        if (rebuild) return;
+
+        rebuild = new CacheRebuild<Point>(threshold, sample_size, max_depth, window, test);
+    }
+
+    //number of rebuilt caches published so far
+    size_t rebuild_count() const
+    {
+        return rebuild ? rebuild->count : 0;
+    }
+
+    /** Inserts a point into the set the tree answers queries over, without
+        rebuilding the cache.  Only the terminal cells which the point may
+        now be the nearest neighbour of somewhere in, those with part of
+        their box closer to it than to their cached neighbour, are tested
+        again, and refined cells are reset to be tested again by the next
+        query to reach them.  Cells which fail the test again become misses,
+        which refinement, if enabled, may then split.  Neither insert nor
+        remove may run concurrently with queries, and trees mapped by load
+        cannot be changed.
+
+        \return False if the tree cannot be changed.
+    */
+    bool insert(const Point &pt)
+    {
+        if (file) return false;
+
+        wait_for_rebuild();
+        backup->insert(pt);
+        invalidate(pt);
+
+        return true;
+    }
+
+    /** Removes a point equal to pt from the set the tree answers queries
+        over, testing again only the cells whose cached neighbour it was.
+
+        \return False if there is no such point or the tree cannot be changed.
+    */
+    bool remove(const Point &pt)
+    {
+        if (file) return false;
+
+        wait_for_rebuild();
+        if (!backup->remove(pt)) return false;
+        invalidate(pt);
+
+        return true;
+    }
+
+    //the backup tree's point which is the neighbour of a cache entry, if any
+    Point *neighbour(const CachedPoint *pt) const
+    {
+        return pt->nn ? backup->point(pt->nn - 1) : 0;
+    }
+
+    /** Writes the backup tree and the cache to the file at path, to be
+        read back by load.  The backup tree and the cache entries are
+        mapped and used in place, but the quadtree's nodes are linked by
+        pointers, so they are stored as a list of records in preorder and
+        relinked when loaded.  Relinking is linear in the size of the cache
+        and runs no queries.  Points are written as raw memory, so Point
+        must not hold pointers, and trees whose points have been changed by
+        insert or remove cannot be saved.
+
+        \return True on success.
+    */
+    bool save(const char *path) const
+    {
+        size_t epoch = enter();
+        const Cache *c = current;
+
+        //terminal entries are allocated separately from the sample, so gather them
+        std::vector<unsigned long long> records;
+        std::vector<CachedPoint> entries;
+        if (c->tree->root) save_node(c, c->tree->root, records, entries);
+
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            leave(epoch);
+            return false;
+        }
+
+        FileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, file_magic, sizeof(header.magic));
+        header.dim = dim;
+        header.sample_size = c->sample_size;
+        header.entry_count = entries.size();
+        header.record_count = records.size();
+
+        //the header is written again once the offsets are known
+        bool ok = write_file(f, &header, 1);
+
+        header.backup_offset = align_file(f);
+        ok = ok && backup->save(f);
+        header.sample_offset = align_file(f);
+        ok = ok && write_file(f, c->sample, c->sample_size);
+        header.entry_offset = align_file(f);
+        ok = ok && write_file(f, entries.empty() ? 0 : &entries[0], entries.size());
+        header.record_offset = align_file(f);
+        ok = ok && write_file(f, records.empty() ? 0 : &records[0], records.size());
+
+        ok = ok && fseek(f, 0, SEEK_SET) == 0 && write_file(f, &header, 1);
+
+        leave(epoch);
+
+        return fclose(f) == 0 && ok;
+    }
+
+    /** Reads back an odds-on tree saved to the file at path.
+
+        \return The tree, or zero if the file could not be mapped or does
+                not hold a tree of this type.
+    */
+    static OddsonTree *load(const char *path)
+    {
+        MappedFile *file = new MappedFile(path);
+        const FileHeader *header = (const FileHeader *)file->data;
+
+        if (!file->data || file->size < sizeof(FileHeader)
+            || memcmp(header->magic, file_magic, sizeof(header->magic))
+            || (Dim && header->dim != Dim)
+            || header->backup_offset >= file->size
+            || header->sample_offset + header->sample_size*sizeof(CachedPoint) > file->size
+            || header->entry_offset + header->entry_count*sizeof(CachedPoint) > file->size
+            || header->record_offset + header->record_count*sizeof(unsigned long long) > file->size) {
+            delete file;
+            return 0;
+        }
+
+        OddsonTree *tree = new OddsonTree(header->dim, file);
+        Cache *c = tree->current = new Cache;
+        c->mapped = true;
+        c->sample = (CachedPoint *)(file->data + header->sample_offset);
+        c->sample_size = header->sample_size;
+
+        KdTree<Point, double, Dim> *points = KdTree<Point, double, Dim>::view(
+            file->data + header->backup_offset, file->size - header->backup_offset);
+        if (points) tree->backup = new PointSet<Point, Dim>(tree->dim, points);
+
+        const unsigned long long *records = (const unsigned long long *)(file->data + header->record_offset);
+        const unsigned long long *end = records + header->record_count;
+        CachedPoint *entries = (CachedPoint *)(file->data + header->entry_offset);
+
+        c->tree = new CompressedQuadtree<CachedPoint, Dim>(tree->dim);
+
+        bool ok = tree->backup != 0;
+        if (ok && records != end) {
+            c->tree->root = tree->load_node(c, records, end, entries, header->entry_count, ok);
+        }
+
+        if (!ok || records != end) {
+            delete tree;
+            return 0;
+        }
+
+        return tree;
+    }
+
+    //the cache queries currently use, which a rebuild may replace
+    CompressedQuadtree<CachedPoint, Dim> *cache() const
+    {
+        return current->tree;
+    }
+
+private:
+
+    typedef typename CompressedQuadtree<CachedPoint, Dim>::Node CacheNode;
+
+    /** A cache and the sample it was built over.  A rebuild replaces both
+        at once.
+    */
+    struct Cache {
+        Cache() : tree(0), index(0), sample(0), sample_size(0), mapped(false), test(CornerTest)
+        {
+        }
+
+        virtual ~Cache()
+        {
+            delete index;
+            delete tree;
+
+            //a mapped sample belongs to the file
+            if (!mapped) delete[] sample;
+        }
+
+        CompressedQuadtree<CachedPoint, Dim> *tree;
+
+        //locates queries in the tree, if enabled
+        LinearQuadtree<CachedPoint, Dim> *index;
+
+        //the entries of the terminal cells which are not sample points
+        Arena entries;
+
+        CachedPoint *sample;
+        size_t sample_size;
+        bool mapped;
+
+        //the test its cells passed
+        OddsonTreeTerminalTest test;
+    };
+
+    static const char file_magic[8];
+
+    //followed by the image of the backup tree, the sample, the terminal
+    //cache entries and the records of the quadtree's nodes
+    struct FileHeader {
+        char magic[8];
+        unsigned long long dim;
+        unsigned long long sample_size;
+        unsigned long long entry_count;
+        unsigned long long record_count;
+        unsigned long long backup_offset;
+        unsigned long long sample_offset;
+        unsigned long long entry_offset;
+        unsigned long long record_offset;
+    };
+
+    //tree read from a file by load
+    OddsonTree(size_t dim, MappedFile *file)
+        : dim(dim)
+        , backup(0)
+        , current(0)
+        , file(file)
+        , refinement(0)
+        , bounds(0)
+        , rebuild(0)
+        , changes(0)
+        , retested(0)
+        , indexed(false)
+    {
+    }
+
+    /** Appends the records of the subtree below node in preorder.  Each is
+        the node's entry, the number of children, the radius and the
+        midpoint, followed by each child's slot and records.  An entry is
+        stored as its index shifted left two bits, tagged 1 for a sample
+        point and 2 for a terminal entry, or zero if there is none.
+    */
+    void save_node(const Cache *c, const CacheNode *node, std::vector<unsigned long long> &records,
+        std::vector<CachedPoint> &entries) const
+    {
+        unsigned long long entry = 0;
+        if (node->pt && node->pt >= c->sample && node->pt < c->sample + c->sample_size) {
+            entry = (unsigned long long)(node->pt - c->sample) << 2 | 1;
+        } else if (node->pt) {
+            entry = (unsigned long long)entries.size() << 2 | 2;
+            entries.push_back(*node->pt);
+        }
+
+        size_t children = node->child_count(dim);
+
+        records.push_back(entry);
+        records.push_back(children);
+        records.push_back(double_bits(node->radius));
+        for (size_t d = 0; d < dim; ++d) records.push_back(double_bits(node->mid[d]));
+
+        for (size_t i = 0; i < children; ++i) {
+            records.push_back(node->quadrant(node->nodes[i]->mid, dim));
+            save_node(c, node->nodes[i], records, entries);
+        }
+    }
+
+    //rebuilds the subtree whose records start at cursor, clearing ok if they are malformed
+    CacheNode *load_node(const Cache *c, const unsigned long long *&cursor, const unsigned long long *end,
+        CachedPoint *entries, size_t entry_count, bool &ok) const
+    {
+        if ((size_t)(end - cursor) < 3 + dim) {
+            ok = false;
+            return 0;
+        }
+
+        CacheNode *node = c->tree->node();
+
+        unsigned long long entry = *cursor++;
+        size_t index = entry >> 2;
+        if ((entry & 3) == 1 && index < c->sample_size) node->pt = c->sample + index;
+        else if ((entry & 3) == 2 && index < entry_count) node->pt = entries + index;
+        else if (entry) ok = false;
+
+        //a terminal entry is not a stored point, as in cells whose build was ended
+        node->ended = (entry & 3) == 2;
+
+        size_t children = *cursor++;
+        node->radius = bits_double(*cursor++);
+        for (size_t d = 0; d < dim; ++d) node->mid[d] = bits_double(*cursor++);
+
+        size_t nnodes = 1 << dim;
+        std::vector<CacheNode *> slots(children ? nnodes : 0);
+        for (size_t i = 0; i < children && ok; ++i) {
+            size_t slot = cursor < end ? *cursor++ : nnodes;
+            if (slot >= nnodes || slots[slot]) {
+                ok = false;
+                break;
+            }
+
+            slots[slot] = load_node(c, cursor, end, entries, entry_count, ok);
+        }
+
+        //whatever was read is kept, so it is freed with the tree
+        if (children) c->tree->set_children(node, &slots[0]);
+
+        return node;
+    }
+
+    static unsigned long long double_bits(double x)
+    {
+        unsigned long long bits;
+        memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
+
+    static double bits_double(unsigned long long bits)
+    {
+        double x;
+        memcpy(&x, &bits, sizeof(x));
+        return x;
+    }
+
+    //queries per batch task, small since misses cost far more than hits
+    static const size_t batch_grain = 32;
+
+    struct BatchFn : public ThreadPool::RangeFn {
+
+        BatchFn(const OddsonTree *tree, size_t k, const Point *qs, double eps,
+            std::pair<Point *, double> *qr, QueryContext &stats)
+            : tree(tree)
+            , k(k)
+            , qs(qs)
+            , eps(eps)
+            , qr(qr)
+            , stats(stats)
+        {
+        }
+
+        virtual void operator()(size_t begin, size_t end)
+        {
+            QueryContext ctx;
+
+            for (size_t i = begin; i < end; ++i) {
+                std::pair<Point *, double> *result = qr + i*k;
+
+                size_t found;
+                if (k == 1) found = tree->nn(qs[i], eps, result, ctx);
+                else found = tree->knn(k, qs[i], eps, result, ctx);
+
+                for (size_t j = found; j < k; ++j) {
+                    result[j] = std::pair<Point *, double>(0, std::numeric_limits<double>::max());
+                }
+            }
+
+            if (tree->rebuild) tree->report(ctx);
+
+            __sync_fetch_and_add(&stats.hits, ctx.hits);
+            __sync_fetch_and_add(&stats.queries, ctx.queries);
+        }
+
+        const OddsonTree *tree;
+        size_t k;
+        const Point *qs;
+        double eps;
+        std::pair<Point *, double> *qr;
+        QueryContext &stats;
+    };
+
+
+    size_t dim;
+    PointSet<Point, Dim> *backup; 
+
+    //the cache in use, swapped for a new one by each rebuild
+    Cache * volatile current;
+
+    //file mapped by load, if any
+    MappedFile *file;
+
+    //cells refined on demand, and the bounds of the points, if enabled
+    RefinementCache<Point, Dim> *refinement;
+    double *bounds;
+
+    //state for background rebuilds of the cache, if enabled
+    CacheRebuild<Point> *rebuild;
+
+    //points inserted or removed, and cells tested again after them
+    size_t changes;
+    size_t retested;
+
+    //whether caches locate queries through a linear quadtree
+    bool indexed;
+
+    //queries record one in this many of their points for rebuilds
+    static const size_t record_stride = 4;
+
+    //queries between reports of a thread's hits to the rebuild monitor
+    static const size_t report_interval = 256;
+
+    //the reader side of the swap of the current cache
+    size_t enter() const
+    {
+        return rebuild ? rebuild->epochs.enter() : 0;
+    }
+
+    void leave(size_t epoch) const
+    {
+        if (rebuild) rebuild->epochs.leave(epoch);
+    }
+
+    //waits for a rebuild in progress, which may still swap in a new cache
+    void wait_for_rebuild() const
+    {
+        while (rebuild && __sync_fetch_and_add(&rebuild->running, 0)) usleep(1000);
+    }
+
+    /** Whether the cache shows that the nearest neighbour of pt is farther
+        than r, which answers a radius query without the backup tree and so
+        counts as a hit.
+    */
+    bool beyond(const Point &pt, double r, QueryContext &ctx) const
+    {
+        size_t epoch = enter();
+        const Cache *c = current;
+
+        CachedPoint *cache_result = locate(c, pt);
+        Point *nn = cache_result ? neighbour(cache_result) : 0;
+        if (!nn && refinement) nn = refine(c, pt);
+
+        leave(epoch);
+
+        if (!nn || SquaredDistance<Point, double, Dim>::compute(*nn, pt, dim) <= r*r) return false;
+
+        ++ctx.hits;
+        return true;
+    }
+
+    //records a query for future rebuilds, reporting the hits of ctx every so often
+    void track(const Point &pt, QueryContext &ctx) const
+    {
+        if (ctx.queries % record_stride == 0) rebuild->reservoir.record(pt);
+        if (ctx.queries - ctx.reported_queries >= report_interval) report(ctx);
+    }
+
+    //reports the hits of ctx, starting a rebuild if the cache has drifted
+    void report(QueryContext &ctx) const
+    {
+        bool drifted = rebuild->monitor.add(ctx.hits - ctx.reported_hits,
+            ctx.queries - ctx.reported_queries);
+        ctx.reported_hits = ctx.hits;
+        ctx.reported_queries = ctx.queries;
+
+        if (drifted && __sync_bool_compare_and_swap(&rebuild->running, 0, 1)) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+            pthread_t thread;
+            if (pthread_create(&thread, &attr, rebuild_main, const_cast<OddsonTree *>(this))) {
+                __sync_lock_release(&rebuild->running);
+            }
+
+            pthread_attr_destroy(&attr);
+        }
+    }
+
+    static void *rebuild_main(void *tree)
+    {
+        ((OddsonTree *)tree)->rebuild_cache();
+        return 0;
+    }
+
+    //builds a cache over the recent queries and swaps it in for the current one
+    void rebuild_cache()
+    {
+        std::vector<Point> qs;
+        if (rebuild->reservoir.snapshot(qs)) {
+            Cache *fresh = build_cache(&qs[0], qs.size(), rebuild->max_depth, rebuild->test, 0);
+
+            Cache *old = __sync_lock_test_and_set(&current, fresh);
+            rebuild->epochs.synchronize();
+            delete old;
+
+            rebuild->monitor.reset();
+            __sync_fetch_and_add(&rebuild->count, 1);
+        }
+
+        //the tree may be destroyed as soon as this is cleared
+        __sync_lock_release(&rebuild->running);
+    }
+
+    QueryContext context;
+
+    //cells with at least this many corners query them in parallel
+    static const size_t parallel_corner_cutoff = 16;
+    static const size_t corner_grain = 4;
+
+    void build(Point *ps, int n, Point *qs, int m, size_t max_depth,
+        OddsonTreeTerminalTest test, ThreadPool *pool)
+    {
+        //cache misses are served by the backup tree, so use buckets to speed them up
+        typename KdTree<Point, double, Dim>::Buckets buckets;
+        KdTree<Point, double, Dim> *points;
+        if (pool) points = new KdTree<Point, double, Dim>(dim, ps, n, buckets, *pool);
+        else points = new KdTree<Point, double, Dim>(dim, ps, n, buckets);
+
+        backup = new PointSet<Point, Dim>(dim, points);
+
+        current = build_cache(qs, m, max_depth, test, pool);
+    }
+
+    //builds a cache over the sample query points qs
+    Cache *build_cache(const Point *qs, size_t m, size_t max_depth,
+        OddsonTreeTerminalTest test, ThreadPool *pool) const
+    {
+        Cache *c = new Cache;
+        c->test = test;
+
+        //track range covered by sample
+        double *range = new double[2*dim];
+        for (size_t d = 0; d < dim; ++d) {
+            range[d*2] = std::numeric_limits<double>::max();
+            range[d*2+1] = -std::numeric_limits<double>::max();
+        }
+
+        //generate sample points
+        CachedPoint *sample = c->sample = new CachedPoint[m];
+        c->sample_size = m;
+        for (size_t i = 0; i < m; ++i) {
+            const Point &pt = qs[i];
+
+            //copy into cached point
+            for (size_t d = 0; d < dim; ++d) {
+                sample[i][d] = pt[d]; 
+                if (pt[d] < range[d*2]) range[d*2] = pt[d];
+                if (pt[d] > range[d*2+1]) range[d*2+1] = pt[d]; 
+            }
+        }
+
+        OddsonTreeTerminal fn;
+        fn.backup = backup;
+        fn.dim = dim;
+        fn.max_depth = max_depth;
+        fn.test = test;
+        fn.pool = pool;
+        fn.entries = &c->entries;
+        if (test == CornerTest) fn.memo = new CornerCache<Point, Point *>(dim, m);
+        if (m == 0) c->tree = new CompressedQuadtree<CachedPoint, Dim>(dim);
+        else if (pool) c->tree = new CompressedQuadtree<CachedPoint, Dim>(dim, sample, m, range, fn,
+            typename CompressedQuadtree<CachedPoint, Dim>::MortonOrder(), *pool);
+        else c->tree = new CompressedQuadtree<CachedPoint, Dim>(dim, sample, m, range, fn,
+            typename CompressedQuadtree<CachedPoint, Dim>::MortonOrder());
+
+        if (indexed) c->index = new LinearQuadtree<CachedPoint, Dim>(dim, c->tree->root);
+
+        if (fn.memo) {
+            fprintf(stderr, "info: corner queries: %zu unique: %zu dedup: %0.2f\n",
+                fn.memo->lookup_count(), fn.memo->size(),
+                (double)fn.memo->lookup_count() / (double)std::max<size_t>(fn.memo->size(), 1));
+            delete fn.memo;
+        }
+ 
+        delete[] range;
+
+        return c;
+    }
+
+    /** Finds the cell of the cache which pt falls in: the deepest node
+        containing it if that has no children, otherwise the quadrant of
+        that node it lies in.
+
+        \return False if pt is outside the cache.
+    */
+    bool miss_cell(const Cache *c, const Point &pt, double *box) const
+    {
+        CacheNode *node = deepest(c, pt);
+        if (!node) return false;
+
+        double radius = node->radius;
+        Point mid = node->mid;
+
+        //the whole quadrant, whether it is empty or its child was compressed
+        if (node->nodes) {
+            size_t n = 0;
+            for (size_t d = 0; d < dim; ++d) {
+                if (pt[d] > node->mid[d]) n += 1 << d;
+            }
+
+            radius = node->radius / 2;
+            for (size_t d = 0; d < dim; ++d) {
+                mid[d] = n & (1 << d) ? node->mid[d] + radius : node->mid[d] - radius;
+            }
+        }
+
+        for (size_t d = 0; d < dim; ++d) {
+            box[d*2] = mid[d] - radius;
+            box[d*2+1] = mid[d] + radius;
+        }
+
+        return true;
+    }
+
+    //looks up a cache miss in the refined cells
+    Point *refine(const Cache *c, const Point &pt) const
+    {
+        std::vector<double> box(2*dim);
+        if (!miss_cell(c, pt, &box[0])) {
+            memcpy(&box[0], bounds, 2*dim*sizeof(double));
+        }
+
+        return refinement->find(pt, &box[0]);
+    }
+
+    //tests again the cells a change to the points at pt may affect, once it is made
+    void invalidate(const Point &pt)
+    {
+        Cache *c = current;
+        if (c->tree->root) {
+            typename PointSet<Point, Dim>::SearchContext ctx;
+            invalidate(c, c->tree->root, pt, ctx);
+        }
+
+        if (refinement) refinement->invalidate(pt);
+        ++changes;
+    }
+
+    /** Tests again the terminal cells below node which pt may now be, or
+        may have been, the nearest neighbour of somewhere in.  Interior
+        nodes of the quadtree cache no neighbour, so the one found for the
+        middle of each is used instead: when it is strictly closer than pt
+        to all of the node's box, pt is the nearest neighbour of nothing in
+        it, before or after the change, so the subtree is skipped.
+    */
+    void invalidate(Cache *c, CacheNode *node, const Point &pt,
+        typename PointSet<Point, Dim>::SearchContext &ctx)
+    {
+        std::vector<double> box(2*dim);
+        for (size_t d = 0; d < dim; ++d) {
+            box[d*2] = node->mid[d] - node->radius;
+            box[d*2+1] = node->mid[d] + node->radius;
+        }
+
+        if (node->pt && node->pt->terminal) {
+            Point *nn = neighbour(node->pt);
+            if (!nn || backup->equal(*nn, pt) || !backup->closer(*nn, pt, &box[0])) retest(c, node);
+            return;
+        }
+
+        if (!node->nodes) return;
+
+        std::pair<Point *, double> qr;
+        if (backup->knn(1, node->mid, 0.0, &qr, ctx) && !backup->equal(*qr.first, pt)
+            && backup->closer(*qr.first, pt, &box[0])) {
+            return;
+        }
+
+        size_t count = node->child_count(dim);
+        for (size_t n = 0; n < count; ++n) {
+            invalidate(c, node->nodes[n], pt, ctx);
+        }
+    }
+
+    //runs the terminal test again on a cell, which becomes a miss if it fails
+    void retest(Cache *c, CacheNode *node)
+    {
+        OddsonTreeTerminal fn;
+        fn.backup = backup;
+        fn.entries = &c->entries;
+        fn.dim = dim;
+        fn.max_depth = 0;
+        fn.test = c->test;
+
+        //the cell was within the depth limit when the cache was built
+        CachedPoint *cached = node->pt;
+        if (!fn(node, 0)) {
+            cached->terminal = false;
+            cached->nn = 0;
+        }
+
+        ++retested;
+    }
+
+    /** Finds the deepest node of the cache containing pt, walking down to
+        any child which holds it to within the tolerance of Node::in_node,
+        from the root or from the node the linear quadtree finds.
+
+        \return The node, or null if pt is outside the cache.
+    */
+    CacheNode *deepest(const Cache *c, const Point &pt) const
+    {
+        CacheNode *node = c->tree->root;
+        if (c->index) node = c->index->locate(pt);
+        else if (node && !node->in_node(pt, dim)) node = 0;
+
+        while (node && node->nodes) {
+            CacheNode *child = node->child(node->quadrant(pt, dim), dim);
+            if (!child || !child->in_node(pt, dim)) break;
+
+            node = child;
+        }
+
+        return node;
+    }
+
+    CachedPoint *locate(const Cache *c, const Point &pt) const
+    { 
+        //only leaves hold entries, and the root is never a terminal cell
+        CacheNode *node = deepest(c, pt);
+        if (!node || node == c->tree->root || !node->pt) return 0;
+
+        return node->pt->terminal ? node->pt : 0; 
+    } 
+
+    CachedPoint *locate(const Cache *c, PriorityQueue<Point *> &pq, const Point &pt) const
+    {
+        CacheNode *node = deepest(c, pt);
+        if (!node || node == c->tree->root || !node->pt) return 0;
+
+        if (node->pt->nn) {
+            Point *nn = neighbour(node->pt);
+            double d = SquaredDistance<Point, double, Dim>::compute(*nn, pt, dim);
+
+            pq.push(d, nn);
+        }
+
+        return node->pt->terminal ? node->pt : 0; 
     }
 
 };
 
+template<class Point, int Dim>
+const char OddsonTree<Point, Dim>::file_magic[8] = { 'O', 'D', 'D', 'S', 'Q', 'T', '1', 0 };
+
 #else
 
 #error oddson tree implementation not defined
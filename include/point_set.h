@@ -0,0 +1,324 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef POINT_SET_H_
+#define POINT_SET_H_
+
+/*
+    The points an odds-on tree answers queries over.  They start out in a
+    static bucketed kd-tree, points removed later are flagged in place in
+    it, and points inserted later go to a DynamicKdTree, so the set can
+    change without the tree being rebuilt.  Searches cover both.
+
+    Each point has an index which stays the same for as long as the point
+    is in the set, so caches can store it in place of a pointer: its
+    position in the static tree, or for inserted points, the number of
+    points inserted before it past the end of the tree.  Inserted points
+    are stored in fixed chunks, so the points returned by searches stay
+    valid after later changes.
+*/
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include "distance.h"
+#include "dynamic_kdtree.h"
+#include "fixed_size_priority_queue.h"
+#include "kdtree.h"
+#include "priority_queue.h"
+
+template<class Point, int Dim = 0> class PointSet {
+
+    //the copies of the inserted points searched, which know their index
+    struct Entry : Point {
+        Entry()
+        {
+        }
+
+        Entry(const Point &pt, size_t index)
+            : Point(pt)
+            , index(index)
+        {
+        }
+
+        size_t index;
+    };
+
+public:
+
+    typedef KdTree<Point, double, Dim> Tree;
+    typedef typename Tree::RangeVisitor RangeVisitor;
+
+    /** Scratch state for a single search, as for the kd-tree, along with
+        that for the search of the inserted points.
+    */
+    struct SearchContext : Tree::SearchContext {
+        typename DynamicKdTree<Entry, double, Dim>::SearchContext inserted;
+    };
+
+    /** Takes ownership of a static tree, which holds the initial points.
+    */
+    PointSet(size_t dim, Tree *tree)
+        : dim(dim)
+        , base(tree)
+        , inserted(new DynamicKdTree<Entry, double, Dim>(dim, 0, 0))
+        , inserted_count(0)
+    {
+    }
+
+    virtual ~PointSet()
+    {
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            delete[] chunks[i];
+        }
+
+        delete inserted;
+        delete base;
+    }
+
+    //the static tree holding the initial points
+    Tree *tree() const
+    {
+        return base;
+    }
+
+    //number of points in the set
+    size_t size() const
+    {
+        return base->size() - base->removed_count() + inserted->size();
+    }
+
+    //whether points have been inserted or removed since the static tree was built
+    bool changed() const
+    {
+        return inserted_count || base->removed_count();
+    }
+
+    //adds a copy of pt to the set
+    void insert(const Point &pt)
+    {
+        size_t index = inserted_count++;
+        if (index % chunk_size == 0) {
+            Point *chunk = new Point[chunk_size];
+            chunk_numbers[chunk] = chunks.size();
+            chunks.push_back(chunk);
+        }
+
+        chunks[index / chunk_size][index % chunk_size] = pt;
+        inserted->insert(Entry(pt, base->size() + index));
+    }
+
+    /** Removes a point equal to pt.  Removing one of several equal points
+        may remove any of them.  Neither insert nor remove may run
+        concurrently with searches.
+
+        \return True if a point was removed, false if there is none.
+    */
+    bool remove(const Point &pt)
+    {
+        return base->remove(pt) || inserted->remove(Entry(pt, 0));
+    }
+
+    //the point with the given index
+    Point *point(size_t index) const
+    {
+        if (index < base->size()) return base->points() + index;
+
+        index -= base->size();
+        return chunks[index / chunk_size] + index % chunk_size;
+    }
+
+    //the index of a point of the set
+    size_t index(const Point *pt) const
+    {
+        const Point *pts = base->points();
+        if (pt >= pts && pt < pts + base->size()) return pt - pts;
+
+        typename std::map<const Point *, size_t>::const_iterator chunk = chunk_numbers.upper_bound(pt);
+        --chunk;
+
+        return base->size() + chunk->second*chunk_size + (pt - chunk->first);
+    }
+
+    /** Searches for the k nearest neighbours of pt, as KdTree::knn.
+
+        \return The number of results written to qr, at most k.
+    */
+    size_t knn(size_t k, const Point &pt, double eps, std::pair<Point *, double> *qr,
+        SearchContext &ctx) const
+    {
+        if (!inserted->size()) return base->knn(k, pt, eps, qr, ctx);
+
+        FixedSizePriorityQueue<Point *> pq(k);
+        search(k, pq, pt, eps, ctx);
+
+        return results(pq, qr);
+    }
+
+    /** As above, but starting from a set of candidate neighbours, which
+        must be points of the set, as KdTree::knn.
+    */
+    size_t knn(size_t k, PriorityQueue<Point *> &candidates, const Point &pt, double eps,
+        std::pair<Point *, double> *qr, SearchContext &ctx) const
+    {
+        if (!inserted->size()) return base->knn(k, candidates, pt, eps, qr, ctx);
+
+        FixedSizePriorityQueue<Point *> pq(k);
+        while (candidates.length) {
+            typename PriorityQueue<Point *>::Entry e = candidates.pop();
+            if (!pq.full() || e.priority < pq.peek().priority) {
+                pq.push(e.priority, e.data);
+            }
+        }
+
+        search(k, pq, pt, eps, ctx);
+
+        return results(pq, qr);
+    }
+
+    std::list<std::pair<Point *, double> > knn(size_t k, PriorityQueue<Point *> &candidates,
+        const Point &pt, double eps, SearchContext &ctx) const
+    {
+        std::vector<std::pair<Point *, double> > qr(k);
+        size_t count = knn(k, candidates, pt, eps, &qr[0], ctx);
+
+        return std::list<std::pair<Point *, double> >(qr.begin(), qr.begin() + count);
+    }
+
+    /** Passes the points within distance r of pt to visit, as
+        KdTree::radius_search.
+
+        \return False if visit ended the search early.
+    */
+    bool radius_search(const Point &pt, double r, RangeVisitor &visit) const
+    {
+        if (!base->radius_search(pt, r, visit)) return false;
+        if (!inserted->size()) return true;
+
+        InsertedVisitor inserted_visit(this, visit);
+        return inserted->radius_search(Entry(pt, 0), r, inserted_visit);
+    }
+
+    //the number of points within distance r of pt
+    size_t radius_count(const Point &pt, double r) const
+    {
+        size_t count = base->radius_count(pt, r);
+        if (inserted->size()) count += inserted->radius_count(Entry(pt, 0), r);
+
+        return count;
+    }
+
+    //writes the static tree, which fails once the set has changed
+    bool save(FILE *f) const
+    {
+        return !inserted_count && base->save(f);
+    }
+
+    bool equal(const Point &a, const Point &b) const
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            if (a[d] != b[d]) return false;
+        }
+
+        return true;
+    }
+
+    /** Whether a is strictly closer than b to every point of box, given as
+        the low and high bound of each dimension in turn.  The points closer
+        to a form a half space, so it is enough to check the corner of the
+        box farthest into b's side, which is found one dimension at a time.
+    */
+    bool closer(const Point &a, const Point &b, const double *box) const
+    {
+        //the difference of the squared distances to a and to b, at that corner
+        double diff = 0;
+        for (size_t d = 0; d < dim; ++d) {
+            double x = b[d] > a[d] ? box[d*2+1] : box[d*2];
+            diff += (b[d] - a[d]) * (2*x - a[d] - b[d]);
+        }
+
+        return diff < 0;
+    }
+
+private:
+
+    static const size_t chunk_size = 256;
+
+    size_t dim;
+    Tree *base;
+
+    DynamicKdTree<Entry, double, Dim> *inserted;
+    size_t inserted_count;
+
+    //inserted points, and the number of each chunk by its address
+    std::vector<Point *> chunks;
+    std::map<const Point *, size_t> chunk_numbers;
+
+    //passes the inserted points found on to a visitor of the set's points
+    struct InsertedVisitor : public DynamicKdTree<Entry, double, Dim>::RangeVisitor {
+
+        InsertedVisitor(const PointSet *set, RangeVisitor &visit) : set(set), visit(visit)
+        {
+        }
+
+        virtual bool operator()(Entry *entry)
+        {
+            return visit(set->point(entry->index));
+        }
+
+        const PointSet *set;
+        RangeVisitor &visit;
+    };
+
+    //adds the neighbours of pt in the static tree and the inserted points to pq
+    void search(size_t k, FixedSizePriorityQueue<Point *> &pq, const Point &pt, double eps,
+        SearchContext &ctx) const
+    {
+        base->knn(pq, pt, eps, ctx);
+
+        std::vector<std::pair<Entry *, double> > found(k);
+        size_t count = inserted->knn(k, Entry(pt, 0), eps, &found[0], ctx.inserted);
+
+        for (size_t i = 0; i < count; ++i) {
+            if (!pq.full() || found[i].second < pq.peek().priority) {
+                pq.push(found[i].second, point(found[i].first->index));
+            }
+        }
+    }
+
+    size_t results(FixedSizePriorityQueue<Point *> &pq, std::pair<Point *, double> *qr) const
+    {
+        size_t count = pq.length;
+        while (pq.length) {
+            typename FixedSizePriorityQueue<Point *>::Entry e = pq.pop();
+            qr[pq.length] = std::pair<Point *, double>(e.data, e.priority);
+        }
+
+        return count;
+    }
+
+    PointSet(const PointSet &);
+    void operator=(const PointSet &);
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef RADIX_SORT_H_
+#define RADIX_SORT_H_
+
+/*
+    Least significant digit first radix sort of values by unsigned integer
+    keys, eight bits at a time.  The items are split into blocks, each
+    block counts its digits and then scatters its items to offsets found
+    from the counts of every block, so with a pool the blocks of each pass
+    are counted and scattered in parallel.  Passes over digits which are
+    the same for every key are skipped.  The sort is stable.
+*/
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+#include "thread_pool.h"
+
+template<class Value> class RadixSort {
+
+public:
+
+    typedef std::pair<uint64_t, Value> Item;
+
+    /** Sorts the items on the low bits of their keys.
+
+        \param bits The number of low bits of the keys which are used,
+                    higher bits must be zero.
+        \param pool If set, the threads used to sort.
+    */
+    static void sort(Item *items, size_t n, size_t bits, ThreadPool *pool = 0)
+    {
+        if (n < 2) return;
+
+        size_t nblocks = 1;
+        if (pool) nblocks = std::max<size_t>(1, std::min(pool->size()*4, n / min_block));
+
+        std::vector<Item> buffer(n);
+        std::vector<size_t> counts(nblocks*radix);
+
+        Item *src = items;
+        Item *dst = &buffer[0];
+        for (size_t shift = 0; shift < bits; shift += digit_bits) {
+
+            Pass pass(src, dst, n, nblocks, shift, &counts[0]);
+            if (pool) pool->parallel_for(0, nblocks, 1, pass.count);
+            else pass.count(0, nblocks);
+
+            //turn the counts into the offset of each digit in each block
+            size_t offset = 0;
+            bool skip = false;
+            for (size_t digit = 0; digit < radix && !skip; ++digit) {
+                size_t total = 0;
+                for (size_t b = 0; b < nblocks; ++b) {
+                    size_t count = counts[b*radix + digit];
+                    counts[b*radix + digit] = offset;
+                    offset += count;
+                    total += count;
+                }
+
+                skip = total == n;
+            }
+
+            if (skip) continue;
+
+            if (pool) pool->parallel_for(0, nblocks, 1, pass.scatter);
+            else pass.scatter(0, nblocks);
+
+            std::swap(src, dst);
+        }
+
+        if (src != items) std::copy(src, src + n, items);
+    }
+
+private:
+
+    static const size_t digit_bits = 8;
+    static const size_t radix = 1 << digit_bits;
+
+    //blocks are at least this large, so the counts stay small
+    static const size_t min_block = 1 << 14;
+
+    struct Pass {
+
+        struct CountFn : public ThreadPool::RangeFn {
+            CountFn(Pass &pass) : pass(pass)
+            {
+            }
+
+            virtual void operator()(size_t begin, size_t end)
+            {
+                for (size_t b = begin; b < end; ++b) {
+                    size_t *counts = pass.counts + b*radix;
+                    std::fill(counts, counts + radix, 0);
+
+                    for (size_t i = pass.block_begin(b); i < pass.block_end(b); ++i) {
+                        ++counts[pass.digit(pass.src[i])];
+                    }
+                }
+            }
+
+            Pass &pass;
+        };
+
+        struct ScatterFn : public ThreadPool::RangeFn {
+            ScatterFn(Pass &pass) : pass(pass)
+            {
+            }
+
+            virtual void operator()(size_t begin, size_t end)
+            {
+                for (size_t b = begin; b < end; ++b) {
+                    size_t *offsets = pass.counts + b*radix;
+
+                    for (size_t i = pass.block_begin(b); i < pass.block_end(b); ++i) {
+                        pass.dst[offsets[pass.digit(pass.src[i])]++] = pass.src[i];
+                    }
+                }
+            }
+
+            Pass &pass;
+        };
+
+        Pass(const Item *src, Item *dst, size_t n, size_t nblocks, size_t shift, size_t *counts)
+            : src(src)
+            , dst(dst)
+            , n(n)
+            , nblocks(nblocks)
+            , shift(shift)
+            , counts(counts)
+            , count(*this)
+            , scatter(*this)
+        {
+        }
+
+        size_t digit(const Item &item) const
+        {
+            return (item.first >> shift) & (radix - 1);
+        }
+
+        size_t block_begin(size_t b) const
+        {
+            return n / nblocks * b;
+        }
+
+        size_t block_end(size_t b) const
+        {
+            return b + 1 == nblocks ? n : n / nblocks * (b + 1);
+        }
+
+        const Item *src;
+        Item *dst;
+        size_t n;
+        size_t nblocks;
+        size_t shift;
+        size_t *counts;
+
+        CountFn count;
+        ScatterFn scatter;
+    };
+};
+
+#endif
@@ -0,0 +1,326 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef REFINEMENT_CACHE_H_
+#define REFINEMENT_CACHE_H_
+
+/*
+    Cells added to an odds-on cache on demand, where queries miss.  Each
+    cell of the cache that takes misses, and the bounding box of the
+    points for queries outside the cache altogether, is the root of a
+    binary tree of cells split at the middle of their longest side.  A cell
+    is tested the first time a query reaches it and split once it has taken
+    threshold misses, so the refinement follows the live queries rather
+    than a sample fixed when the cache was built.
+
+    Lookups never block: a cell is tested by whichever query reaches it
+    first, and queries reaching it meanwhile simply miss, and children are
+    published with a single pointer store once built.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <pthread.h>
+
+#include "corner_cache.h"
+#include "point_set.h"
+#include "terminal_test.h"
+
+template<class Point, int Dim = 0> class RefinementCache {
+
+public:
+
+    /** \param backup The points used to test cells.
+        \param test The test used to decide whether cells are terminal.
+        \param threshold The number of misses a cell takes before it is split.
+        \param max_depth The number of times a root cell may be split.
+    */
+    RefinementCache(const PointSet<Point, Dim> *backup, size_t dim,
+            OddsonTreeTerminalTest test, size_t threshold, size_t max_depth)
+        : backup(backup)
+        , dim(dim)
+        , test(test)
+        , threshold(threshold ? threshold : 1)
+        , max_depth(max_depth)
+        , roots(dim, 1024)
+        , cells(0)
+    {
+        pthread_mutex_init(&roots_lock, 0);
+    }
+
+    virtual ~RefinementCache()
+    {
+        for (size_t i = 0; i < root_cells.size(); ++i) {
+            delete root_cells[i];
+        }
+
+        pthread_mutex_destroy(&roots_lock);
+    }
+
+    /** Finds the refined cell containing pt below the root cell given by
+        box, creating, testing and splitting cells along the way as needed.
+
+        \param box The bounds of the root cell, which must contain pt.
+        \return The nearest neighbour of pt if it lies in a terminal cell,
+                otherwise zero.
+    */
+    Point *find(const Point &pt, const double *box)
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            if (pt[d] < box[d*2] || pt[d] > box[d*2+1]) return 0;
+        }
+
+        Cell *cell = root(box);
+
+        while (cell) {
+
+            //the first query to reach a cell tests it
+            long state = __sync_fetch_and_add(&cell->state, 0);
+            if (state == Untested && __sync_bool_compare_and_swap(&cell->state, Untested, Testing)) {
+                state = this->test_cell(cell);
+            }
+
+            if (state == Terminal) return cell->nn;
+
+            Cell *children = cell->children;
+            if (children) {
+                cell = &children[pt[cell->axis] < cell->split ? 0 : 1];
+                continue;
+            }
+
+            //split cells which keep taking misses
+            if (state == Open && cell->depth < max_depth
+                && (size_t)__sync_add_and_fetch(&cell->misses, 1) >= threshold
+                && __sync_bool_compare_and_swap(&cell->state, Open, Split)) {
+                split_cell(cell);
+                continue;
+            }
+
+            break;
+        }
+
+        return 0;
+    }
+
+    //number of cells created so far
+    size_t size() const
+    {
+        return cells;
+    }
+
+    /** Resets the terminal cells whose neighbour may have changed with the
+        insertion or removal of a point at pt, once it has been made, so the
+        next query to reach each of them tests it again.  A subtree is
+        skipped when the neighbour found for its root is strictly closer
+        than pt to all of it, since pt is then the neighbour of nothing in
+        it, before or after the change.  This must not run concurrently
+        with find.
+    */
+    void invalidate(const Point &pt)
+    {
+        for (size_t i = 0; i < root_cells.size(); ++i) {
+            invalidate(root_cells[i], pt);
+        }
+    }
+
+private:
+
+    enum State {
+        Untested,
+        Testing,
+        Terminal,
+        Open,
+        Split
+    };
+
+    struct Cell {
+        Cell() : box(0), nn(0), state(Untested), misses(0), children(0)
+        {
+        }
+
+        virtual ~Cell()
+        {
+            delete[] children;
+            delete[] box;
+        }
+
+        double *box;
+        size_t depth;
+
+        Point *nn;
+        volatile long state;
+        volatile long misses;
+
+        //split axis and value, set before children is published
+        size_t axis;
+        double split;
+        Cell * volatile children;
+    };
+
+    const PointSet<Point, Dim> *backup;
+    size_t dim;
+    OddsonTreeTerminalTest test;
+    size_t threshold;
+    size_t max_depth;
+
+    //root cells by the centre of their box
+    CornerCache<Point, Cell *> roots;
+    std::vector<Cell *> root_cells;
+    pthread_mutex_t roots_lock;
+
+    volatile size_t cells;
+
+    void init_cell(Cell *cell, const double *box, size_t depth)
+    {
+        cell->box = new double[2*dim];
+        memcpy(cell->box, box, 2*dim*sizeof(double));
+        cell->depth = depth;
+        __sync_fetch_and_add(&cells, 1);
+    }
+
+    Cell *root(const double *box)
+    {
+        Point centre;
+        for (size_t d = 0; d < dim; ++d) centre[d] = (box[d*2] + box[d*2+1]) / 2;
+
+        Cell *cell;
+        if (!roots.find(centre, cell)) {
+            Cell *created = new Cell;
+            init_cell(created, box, 0);
+            roots.insert(centre, created);
+
+            //another thread may have inserted a root first
+            roots.find(centre, cell);
+            if (cell == created) {
+                pthread_mutex_lock(&roots_lock);
+                root_cells.push_back(created);
+                pthread_mutex_unlock(&roots_lock);
+            } else {
+                delete created;
+                __sync_fetch_and_sub(&cells, 1);
+            }
+        }
+
+        //degenerate cells of the cache may share a centre, so check the whole box
+        return memcmp(cell->box, box, 2*dim*sizeof(double)) ? 0 : cell;
+    }
+
+    long test_cell(Cell *cell)
+    {
+        typename PointSet<Point, Dim>::SearchContext ctx;
+        const double *box = cell->box;
+        bool terminal = true;
+
+        if (test == CentreTest) {
+            Point centre;
+            double radius = 0;
+            for (size_t d = 0; d < dim; ++d) {
+                centre[d] = (box[d*2] + box[d*2+1]) / 2;
+                radius += (box[d*2+1] - box[d*2]) * (box[d*2+1] - box[d*2]);
+            }
+            radius = sqrt(radius) / 2;
+
+            std::pair<Point *, double> qr[2];
+            size_t found = backup->knn(2, centre, 0.0, qr, ctx);
+
+            cell->nn = found ? qr[0].first : 0;
+            terminal = found == 1
+                || (found == 2 && sqrt(qr[1].second) - sqrt(qr[0].second) > 2*radius);
+        } else {
+            for (size_t i = 0; i < ((size_t)1 << dim) && terminal; ++i) {
+                Point qp;
+                for (size_t d = 0; d < dim; ++d) {
+                    qp[d] = i & (1 << d) ? box[d*2] : box[d*2+1];
+                }
+
+                std::pair<Point *, double> result;
+                Point *qr = backup->knn(1, qp, 0.0, &result, ctx) ? result.first : 0;
+
+                if (i == 0) cell->nn = qr;
+                else if (qr != cell->nn) terminal = false;
+            }
+        }
+
+        long state = terminal ? Terminal : Open;
+        __sync_synchronize();
+        cell->state = state;
+
+        return state;
+    }
+
+    void invalidate(Cell *cell, const Point &pt)
+    {
+        if (cell->state == Untested) return;
+
+        //a removed neighbour no longer bounds anything
+        if (cell->nn && backup->equal(*cell->nn, pt)) cell->nn = 0;
+
+        if (cell->state == Terminal) {
+            if (!cell->nn || !backup->closer(*cell->nn, pt, cell->box)) {
+                cell->state = Untested;
+            }
+
+            return;
+        }
+
+        if (cell->nn && backup->closer(*cell->nn, pt, cell->box)) return;
+
+        if (cell->children) {
+            invalidate(&cell->children[0], pt);
+            invalidate(&cell->children[1], pt);
+        }
+    }
+
+    void split_cell(Cell *cell)
+    {
+        const double *box = cell->box;
+
+        size_t axis = 0;
+        for (size_t d = 1; d < dim; ++d) {
+            if (box[d*2+1] - box[d*2] > box[axis*2+1] - box[axis*2]) axis = d;
+        }
+
+        cell->axis = axis;
+        cell->split = (box[axis*2] + box[axis*2+1]) / 2;
+
+        Cell *children = new Cell[2];
+        std::vector<double> child_box(box, box + 2*dim);
+
+        child_box[axis*2+1] = cell->split;
+        init_cell(&children[0], &child_box[0], cell->depth + 1);
+
+        child_box[axis*2+1] = box[axis*2+1];
+        child_box[axis*2] = cell->split;
+        init_cell(&children[1], &child_box[0], cell->depth + 1);
+
+        __sync_synchronize();
+        cell->children = children;
+    }
+
+    RefinementCache(const RefinementCache &);
+    void operator=(const RefinementCache &);
+};
+
+#endif
+
@@ -0,0 +1,516 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef SKIP_QUADTREE_H_
+#define SKIP_QUADTREE_H_
+
+/*
+    Skip quadtree supporting insertion, removal, point location and nearest
+    neighbour queries, as described in:
+
+    Eppstein, D., Goodrich, M. T., Sun, J. Z. (2008) The Skip Quadtree:
+    A Simple Dynamic Data Structure for Multidimensional Data,
+    Int. Journal on Computational Geometry and Applications, 18(1/2), pp. 131 - 160
+
+    Level 0 is a compressed quadtree over all of the points, and each level
+    above it is a compressed quadtree over a random half of the points of
+    the level below.  Every square of a level is also a square of the level
+    below, and each node links down to its copy there.  A point is located
+    by descending the top level as far as it goes, then stepping down a
+    level and carrying on from the same square, which takes O(log n)
+    expected steps however skewed the points are, since the squares of a
+    level are expected to hold O(1) squares of the level below between
+    them and their children.  Insertions and removals locate the point
+    this way, then change O(1) nodes at each level the point is on.
+
+    Squares are halved from the root square in the same way on every path,
+    so a square is computed identically wherever it appears.
+*/
+
+#include <cmath>
+#include <limits>
+#include <list>
+#include <vector>
+
+#include "distance.h"
+#include "fixed_size_priority_queue.h"
+#include "priority_queue.h"
+
+template<class Point, int Dim = 0> class SkipQuadtree {
+
+public:
+
+    //Nodes of the quadtree at one level
+    struct Node {
+        Node **nodes;       //children, zero for leaves
+        Point mid;          //midpoint
+        double radius;      //half side length
+        Point *pt;          //point, for leaves
+        Node *parent;
+        Node *down;         //the node for the same square or point one level down
+        size_t count;       //number of children
+
+        Node()
+            : nodes(0), pt(0), parent(0), down(0), count(0)
+        {
+        }
+    };
+
+    /** Scratch state for a single search, so that a tree can be searched
+        from several threads at once, as long as it is not being changed.
+    */
+    struct SearchContext {
+        SearchContext(int size = 32)
+            : searchpq(size)
+        {
+        }
+
+        PriorityQueue<Node *> searchpq;
+
+    private:
+
+        SearchContext(const SearchContext &);
+        void operator=(const SearchContext &);
+    };
+
+    /** Creates an empty tree covering range, the low and high bound of each
+        dimension in turn.  Points outside the range cannot be inserted.
+
+        \param seed Seeds the coin flips which choose the levels of points.
+    */
+    SkipQuadtree(size_t dim, const double *range, unsigned long seed = default_seed)
+        : dim(dim)
+        , nnodes(1 << dim)
+        , points(0)
+        , random_state(seed)
+    {
+        Node *root = new_interior();
+        root->radius = 0;
+        for (size_t d = 0; d < dim; ++d) {
+            root->mid[d] = (range[d*2] + range[d*2 + 1]) / 2;
+            double side = (range[d*2 + 1] - range[d*2]) / 2;
+            if (side > root->radius) root->radius = side;
+        }
+
+        roots.push_back(root);
+    }
+
+    virtual ~SkipQuadtree()
+    {
+        for (size_t i = 0; i < roots.size(); ++i) {
+            delete_worker(roots[i], i == 0);
+        }
+    }
+
+    /** Inserts a copy of pt, at level 0 and at each level above for as
+        long as a coin flip comes up heads.
+
+        \return False if pt is outside the range of the tree, or equal, or
+                too close to tell apart, to a point already in it.
+    */
+    bool insert(const Point &pt)
+    {
+        if (!contains(roots[0], pt)) return false;
+
+        std::vector<Node *> path;
+        descend(pt, path);
+
+        //a new level is added at most one at a time, as in a skip list
+        size_t height = 0;
+        while (height < roots.size() && (next_random() & 1)) ++height;
+
+        Node *below = 0;
+        for (size_t level = 0; level <= height; ++level) {
+            if (level == roots.size()) {
+                Node *root = new_interior();
+                root->mid = roots.back()->mid;
+                root->radius = roots.back()->radius;
+                root->down = roots.back();
+                roots.push_back(root);
+                path.push_back(root);
+            }
+
+            Node *leaf = insert_at(path[level], pt, below);
+            if (!leaf) return false;
+
+            below = leaf;
+        }
+
+        ++points;
+        return true;
+    }
+
+    /** Removes the point equal to pt from every level it is on.
+
+        \return True if a point was removed, false if there is none.
+    */
+    bool remove(const Point &pt)
+    {
+        if (!contains(roots[0], pt)) return false;
+
+        std::vector<Node *> path;
+        descend(pt, path);
+
+        bool removed = false;
+        for (size_t level = roots.size(); level-- > 0;) {
+            Node *node = path[level];
+            Node *leaf = node->nodes[slot(node, pt)];
+            if (!leaf || leaf->nodes || !equal(*leaf->pt, pt)) continue;
+
+            node->nodes[slot(node, pt)] = 0;
+            --node->count;
+            if (level == 0) delete leaf->pt;
+            delete leaf;
+
+            //keep the tree compressed, the root always stays
+            if (node->parent && node->count == 1) {
+                Node *only = 0;
+                for (size_t n = 0; n < nnodes && !only; ++n) only = node->nodes[n];
+
+                Node *parent = node->parent;
+                for (size_t n = 0; n < nnodes; ++n) {
+                    if (parent->nodes[n] == node) parent->nodes[n] = only;
+                }
+                only->parent = parent;
+
+                delete[] node->nodes;
+                delete node;
+            }
+
+            //drop empty levels from the top
+            if (level && level + 1 == roots.size() && roots[level]->count == 0) {
+                delete_worker(roots[level], false);
+                roots.pop_back();
+            }
+
+            removed = true;
+        }
+
+        if (removed) --points;
+        return removed;
+    }
+
+    /** Finds the deepest interior node of level 0 whose square contains pt.
+
+        \return The node, or zero if pt is outside the range of the tree.
+    */
+    Node *locate(const Point &pt) const
+    {
+        if (!contains(roots[0], pt)) return 0;
+
+        std::vector<Node *> path;
+        descend(pt, path);
+
+        return path[0];
+    }
+
+    //number of points in the tree
+    size_t size() const
+    {
+        return points;
+    }
+
+    //number of levels, including level 0
+    size_t level_count() const
+    {
+        return roots.size();
+    }
+
+    //the root of a level
+    Node *root(size_t level = 0) const
+    {
+        return roots[level];
+    }
+
+    /** Searches for the k nearest neighbours of pt, visiting the squares
+        of level 0 nearest first.
+    */
+    std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps)
+    {
+        return knn(k, pt, eps, context);
+    }
+
+    std::list<std::pair<Point *, double> > knn(size_t k, const Point &pt, double eps,
+        SearchContext &ctx) const
+    {
+        std::vector<std::pair<Point *, double> > qr(k);
+        size_t count = knn(k, pt, eps, &qr[0], ctx);
+
+        return std::list<std::pair<Point *, double> >(qr.begin(), qr.begin() + count);
+    }
+
+    /** As knn, but writes the results into a caller supplied buffer.
+
+        \return The number of results written, at most k.
+    */
+    size_t knn(size_t k, const Point &pt, double eps, std::pair<Point *, double> *qr,
+        SearchContext &ctx) const
+    {
+        PriorityQueue<Node *> &searchpq = ctx.searchpq;
+        FixedSizePriorityQueue<Point *> resultpq(k);
+
+        //searchpq pops the largest priority first, so squares are pushed
+        //with their negated distances
+        searchpq.clear();
+        searchpq.push(0.0, roots[0]);
+
+        while (searchpq.length) {
+            typename PriorityQueue<Node *>::Entry entry = searchpq.pop();
+            Node *node = entry.data;
+            double node_dist = -entry.priority;
+
+            //all further squares are farther away than the k-th point
+            if (resultpq.full() && (1.0 + eps)*node_dist >= resultpq.peek().priority) break;
+
+            for (size_t n = 0; n < nnodes; ++n) {
+                Node *child = node->nodes[n];
+                if (!child) continue;
+
+                if (child->nodes) {
+                    double d = min_dist(pt, child);
+                    if (!resultpq.full() || (1.0 + eps)*d < resultpq.peek().priority) {
+                        searchpq.push(-d, child);
+                    }
+                } else {
+                    double d = SquaredDistance<Point, double, Dim>::compute(*child->pt, pt, dim);
+                    if (!resultpq.full() || d < resultpq.peek().priority) {
+                        resultpq.push(d, child->pt);
+                    }
+                }
+            }
+        }
+
+        size_t count = resultpq.length;
+        while (resultpq.length) {
+            typename FixedSizePriorityQueue<Point *>::Entry e = resultpq.pop();
+            qr[resultpq.length] = std::pair<Point *, double>(e.data, e.priority);
+        }
+
+        return count;
+    }
+
+    size_t dim;
+
+private:
+
+    static const unsigned long default_seed = 0x5eed;
+
+    size_t nnodes;
+    size_t points;
+
+    //the root of each level, level 0 first
+    std::vector<Node *> roots;
+
+    unsigned long long random_state;
+
+    SearchContext context;
+
+    unsigned long long next_random()
+    {
+        unsigned long long z = (random_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    Node *new_interior() const
+    {
+        Node *node = new Node;
+        node->nodes = new Node *[nnodes];
+        for (size_t n = 0; n < nnodes; ++n) node->nodes[n] = 0;
+
+        return node;
+    }
+
+    //index of the quadrant of node's square which pt lies in
+    size_t slot(const Node *node, const Point &pt) const
+    {
+        size_t n = 0;
+        for (size_t d = 0; d < dim; ++d) {
+            if (pt[d] > node->mid[d]) n += 1 << d;
+        }
+
+        return n;
+    }
+
+    bool contains(const Node *node, const Point &pt) const
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            if (pt[d] < node->mid[d] - node->radius || pt[d] > node->mid[d] + node->radius) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool equal(const Point &a, const Point &b) const
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            if (a[d] != b[d]) return false;
+        }
+
+        return true;
+    }
+
+    //squared distance from pt to the square of node, zero inside it
+    double min_dist(const Point &pt, const Node *node) const
+    {
+        double dist = 0;
+        for (size_t d = 0; d < dim; ++d) {
+            double low = node->mid[d] - node->radius;
+            double high = node->mid[d] + node->radius;
+
+            if (pt[d] < low) dist += (low - pt[d])*(low - pt[d]);
+            else if (pt[d] > high) dist += (pt[d] - high)*(pt[d] - high);
+        }
+
+        return dist;
+    }
+
+    //the deepest interior node below node in the same level whose square contains pt
+    Node *deepest(Node *node, const Point &pt) const
+    {
+        while (true) {
+            Node *child = node->nodes[slot(node, pt)];
+            if (!child || !child->nodes || !contains(child, pt)) return node;
+            node = child;
+        }
+    }
+
+    /** Finds the deepest interior node whose square contains pt at each
+        level, starting at the top and stepping down from each to its copy
+        on the level below.
+    */
+    void descend(const Point &pt, std::vector<Node *> &path) const
+    {
+        path.resize(roots.size());
+
+        Node *node = roots.back();
+        for (size_t level = roots.size(); level-- > 0;) {
+            node = deepest(node, pt);
+            path[level] = node;
+            node = node->down;
+        }
+    }
+
+    /** Inserts pt below node, the deepest interior node of its level
+        containing it, linking the new nodes down to below, the leaf for pt
+        on the level beneath, if any.
+
+        \return The new leaf, or zero if pt cannot be told apart from a
+                point already in the tree.
+    */
+    Node *insert_at(Node *node, const Point &pt, Node *below)
+    {
+        size_t n = slot(node, pt);
+        Node *other = node->nodes[n];
+
+        Node *leaf = new Node;
+        leaf->pt = below ? below->pt : new Point(pt);
+        leaf->down = below;
+
+        if (!other) {
+            node->nodes[n] = leaf;
+            leaf->parent = node;
+            ++node->count;
+            return leaf;
+        }
+
+        //the point or square in the way, and the quadrant both are in
+        const Point &in_way = other->nodes ? other->mid : *other->pt;
+        Point mid = node->mid;
+        double radius = node->radius;
+        size_t a = n;
+        size_t b = n;
+
+        //halve the quadrant until pt and the node in the way are apart
+        bool apart = other->nodes || !equal(in_way, pt);
+        while (apart && a == b) {
+            radius /= 2;
+            if (radius == 0) {
+                apart = false;
+                break;
+            }
+
+            for (size_t d = 0; d < dim; ++d) {
+                mid[d] = a & (1 << d) ? mid[d] + radius : mid[d] - radius;
+            }
+
+            a = b = 0;
+            for (size_t d = 0; d < dim; ++d) {
+                if (in_way[d] > mid[d]) a += 1 << d;
+                if (pt[d] > mid[d]) b += 1 << d;
+            }
+        }
+
+        if (!apart) {
+            if (!below) delete leaf->pt;
+            delete leaf;
+            return 0;
+        }
+
+        Node *split = new_interior();
+        split->mid = mid;
+        split->radius = radius;
+        split->parent = node;
+        split->nodes[a] = other;
+        split->nodes[b] = leaf;
+        split->count = 2;
+
+        other->parent = split;
+        leaf->parent = split;
+        node->nodes[n] = split;
+
+        //the same square is on the level below, along the path to pt
+        if (below) {
+            Node *copy = node->down;
+            while (copy->radius != radius) {
+                copy = copy->nodes[slot(copy, pt)];
+            }
+
+            split->down = copy;
+        }
+
+        return leaf;
+    }
+
+    void delete_worker(Node *node, bool owns_points)
+    {
+        if (node->nodes) {
+            for (size_t n = 0; n < nnodes; ++n) {
+                if (node->nodes[n]) delete_worker(node->nodes[n], owns_points);
+            }
+
+            delete[] node->nodes;
+        } else if (owns_points) {
+            delete node->pt;
+        }
+
+        delete node;
+    }
+
+    SkipQuadtree(const SkipQuadtree &);
+    void operator=(const SkipQuadtree &);
+};
+
+#endif
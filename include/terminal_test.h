@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef TERMINAL_TEST_H_
+#define TERMINAL_TEST_H_
+
+/*
+    Tests used to decide whether a cell of the cache is terminal, that is,
+    whether every point in it has the same nearest neighbour.
+
+    CornerTest runs an exact nearest neighbour query at each of the 2^dim
+    corners of the cell.  Voronoi cells are convex, so the cell is terminal
+    exactly when all corners share a neighbour.
+
+    CentreTest runs one 2-nearest neighbour query at the centre of the cell.
+    Any point in the cell is within the circumradius r of the centre, so if
+    the second neighbour is more than 2r further from the centre than the
+    first, the first is the nearest neighbour of the whole cell.  This is
+    conservative, so it accepts fewer cells, but costs one query per cell
+    regardless of dimension.
+*/
+enum OddsonTreeTerminalTest {
+    CornerTest,
+    CentreTest
+};
+
+#endif
+
@@ -0,0 +1,328 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+/*
+    Work-stealing thread pool.  Each worker owns a deque of tasks: it pushes
+    and pops its own work at the back (so it works depth first on recently
+    split, cache warm work) and, when it runs out, steals from the front of
+    another worker's deque (so thieves take the oldest and therefore largest
+    pieces of work).  Threads waiting on a task group help run tasks rather
+    than blocking, so tasks may spawn and wait on further tasks.
+*/
+
+#include <cstdlib>
+#include <deque>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+class ThreadPool {
+
+public:
+
+    struct Task {
+        virtual ~Task()
+        {
+        }
+
+        virtual void operator()(ThreadPool &pool) = 0;
+    };
+
+    //Counts the tasks spawned in the group which have not yet finished
+    struct TaskGroup {
+        TaskGroup() : pending(0)
+        {
+        }
+
+        volatile long pending;
+    };
+
+    struct RangeFn {
+        virtual void operator()(size_t begin, size_t end) = 0;
+    };
+
+    /** Starts the worker threads.
+
+        \param nthreads The number of worker threads, or zero for one per
+                        online processor.
+    */
+    ThreadPool(size_t nthreads = 0)
+        : nthreads(nthreads)
+        , queued(0)
+        , sleepers(0)
+        , stop(0)
+    {
+        if (this->nthreads == 0) {
+            long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+            this->nthreads = nprocs > 0 ? nprocs : 1;
+        }
+
+        pthread_key_create(&self, 0);
+        pthread_mutex_init(&sleep_lock, 0);
+        pthread_cond_init(&wakeup, 0);
+
+        //last worker slot takes tasks spawned from threads outside the pool
+        workers = new Worker[this->nthreads + 1];
+        for (size_t i = 0; i <= this->nthreads; ++i) {
+            workers[i].pool = this;
+            workers[i].index = i;
+            workers[i].victim = i;
+            pthread_mutex_init(&workers[i].lock, 0);
+        }
+
+        for (size_t i = 0; i < this->nthreads; ++i) {
+            pthread_create(&workers[i].thread, 0, worker_main, &workers[i]);
+        }
+    }
+
+    virtual ~ThreadPool()
+    {
+        pthread_mutex_lock(&sleep_lock);
+        __sync_fetch_and_add(&stop, 1);
+        pthread_cond_broadcast(&wakeup);
+        pthread_mutex_unlock(&sleep_lock);
+
+        for (size_t i = 0; i < nthreads; ++i) {
+            pthread_join(workers[i].thread, 0);
+        }
+
+        for (size_t i = 0; i <= nthreads; ++i) {
+            pthread_mutex_destroy(&workers[i].lock);
+        }
+
+        delete[] workers;
+
+        pthread_cond_destroy(&wakeup);
+        pthread_mutex_destroy(&sleep_lock);
+        pthread_key_delete(self);
+    }
+
+    size_t size() const
+    {
+        return nthreads;
+    }
+
+    /** Queues a task for execution.  The pool takes ownership of the task
+        and deletes it once it has run.
+    */
+    void spawn(TaskGroup &group, Task *task)
+    {
+        __sync_fetch_and_add(&group.pending, 1);
+
+        Worker *worker = current();
+        Entry e;
+        e.task = task;
+        e.group = &group;
+
+        pthread_mutex_lock(&worker->lock);
+        worker->tasks.push_back(e);
+        pthread_mutex_unlock(&worker->lock);
+
+        __sync_fetch_and_add(&queued, 1);
+        if (__sync_fetch_and_add(&sleepers, 0)) {
+            pthread_mutex_lock(&sleep_lock);
+            pthread_cond_signal(&wakeup);
+            pthread_mutex_unlock(&sleep_lock);
+        }
+    }
+
+    /** Waits for all tasks in a group to finish, running queued tasks in
+        the meantime.
+    */
+    void wait(TaskGroup &group)
+    {
+        Worker *worker = current();
+
+        while (__sync_fetch_and_add(&group.pending, 0)) {
+            Entry e;
+            if (pop(worker, e) || steal(worker, e)) {
+                run(e);
+            } else {
+                sched_yield();
+            }
+        }
+    }
+
+    /** Calls fn over subranges of [begin, end) of at most grain elements.
+        The range is split lazily in halves, so idle threads steal large
+        pieces and the load balances even when the cost per element varies
+        widely.
+    */
+    void parallel_for(size_t begin, size_t end, size_t grain, RangeFn &fn)
+    {
+        if (begin >= end) return;
+
+        TaskGroup group;
+        spawn(group, new RangeTask(group, begin, end, grain ? grain : 1, fn));
+        wait(group);
+    }
+
+private:
+
+    struct Entry {
+        Task *task;
+        TaskGroup *group;
+    };
+
+    struct Worker {
+        ThreadPool *pool;
+        size_t index;
+        size_t victim;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        std::deque<Entry> tasks;
+    };
+
+    struct RangeTask : public Task {
+
+        RangeTask(TaskGroup &group, size_t begin, size_t end, size_t grain, RangeFn &fn)
+            : group(group)
+            , begin(begin)
+            , end(end)
+            , grain(grain)
+            , fn(fn)
+        {
+        }
+
+        virtual void operator()(ThreadPool &pool)
+        {
+            //leave the upper half for thieves and carry on with the lower half
+            while (end - begin > grain) {
+                size_t mid = begin + (end - begin) / 2;
+                pool.spawn(group, new RangeTask(group, mid, end, grain, fn));
+                end = mid;
+            }
+
+            fn(begin, end);
+        }
+
+        TaskGroup &group;
+        size_t begin;
+        size_t end;
+        size_t grain;
+        RangeFn &fn;
+    };
+
+    size_t nthreads;
+    Worker *workers;
+
+    pthread_key_t self;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wakeup;
+
+    volatile long queued;
+    volatile long sleepers;
+    volatile long stop;
+
+    Worker *current()
+    {
+        Worker *worker = (Worker *)pthread_getspecific(self);
+        return worker ? worker : &workers[nthreads];
+    }
+
+    bool pop(Worker *worker, Entry &e)
+    {
+        bool found = false;
+
+        pthread_mutex_lock(&worker->lock);
+        if (!worker->tasks.empty()) {
+            e = worker->tasks.back();
+            worker->tasks.pop_back();
+            found = true;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        if (found) __sync_fetch_and_sub(&queued, 1);
+
+        return found;
+    }
+
+    bool steal(Worker *worker, Entry &e)
+    {
+        for (size_t i = 0; i <= nthreads; ++i) {
+            worker->victim = (worker->victim + 1) % (nthreads + 1);
+            Worker *victim = &workers[worker->victim];
+            if (victim == worker) continue;
+
+            bool found = false;
+
+            pthread_mutex_lock(&victim->lock);
+            if (!victim->tasks.empty()) {
+                e = victim->tasks.front();
+                victim->tasks.pop_front();
+                found = true;
+            }
+            pthread_mutex_unlock(&victim->lock);
+
+            if (found) {
+                __sync_fetch_and_sub(&queued, 1);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void run(Entry &e)
+    {
+        (*e.task)(*this);
+        delete e.task;
+        __sync_fetch_and_sub(&e.group->pending, 1);
+    }
+
+    static void *worker_main(void *arg)
+    {
+        Worker *worker = (Worker *)arg;
+        ThreadPool *pool = worker->pool;
+
+        pthread_setspecific(pool->self, worker);
+
+        while (!__sync_fetch_and_add(&pool->stop, 0)) {
+            Entry e;
+            if (pool->pop(worker, e) || pool->steal(worker, e)) {
+                pool->run(e);
+                continue;
+            }
+
+            //nothing to do, sleep until more work is spawned
+            pthread_mutex_lock(&pool->sleep_lock);
+            __sync_fetch_and_add(&pool->sleepers, 1);
+            while (!__sync_fetch_and_add(&pool->queued, 0) && !__sync_fetch_and_add(&pool->stop, 0)) {
+                pthread_cond_wait(&pool->wakeup, &pool->sleep_lock);
+            }
+            __sync_fetch_and_sub(&pool->sleepers, 1);
+            pthread_mutex_unlock(&pool->sleep_lock);
+        }
+
+        return 0;
+    }
+
+    ThreadPool(const ThreadPool &);
+    void operator=(const ThreadPool &);
+};
+
+#endif
+
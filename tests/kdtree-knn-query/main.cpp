@@ -22,6 +22,7 @@ THE SOFTWARE.
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
 #include <fstream>
@@ -123,16 +124,26 @@ Point *read_points(const char *filename, int &count, int &dim)
 int main(int argc, char **argv)
 { 
     if (argc < 2) {
-        std::cout << "usage: knn <pts> [queries] [nn] [epsilon]" << std::endl;
+        std::cout << "usage: knn <pts> [queries] [nn] [epsilon] [bucket size] [layout: preorder | veb]" << std::endl;
         exit(1);
     }
 
     int pt_count, dim;
     Point *pts = read_points(argv[1], pt_count, dim); 
    
+    //bucket size of zero builds a tree with one point per node
+    size_t bucket_size = 0;
+    if (argc >= 6) bucket_size = atoi(argv[5]);
+
     struct timespec start, end;
     clock_gettime(CLOCK_REALTIME, &start); 
-    KdTree<Point, double> kt(dim, pts, pt_count);
+    KdTree<Point, double> *kt;
+    if (bucket_size) {
+        kt = new KdTree<Point, double>(dim, pts, pt_count, KdTree<Point, double>::Buckets(bucket_size));
+    } else {
+        kt = new KdTree<Point, double>(dim, pts, pt_count);
+    }
+    if (argc >= 7 && !strcmp(argv[6], "veb")) kt->relayout();
     clock_gettime(CLOCK_REALTIME, &end); 
     double elapsed_msec = (end.tv_sec - start.tv_sec)*1E3 + (end.tv_nsec - start.tv_nsec)*1E-6;
     fprintf(stderr, "info: tree construction took: %f (msec)\n", elapsed_msec);
@@ -155,13 +166,13 @@ int main(int argc, char **argv)
 
     //read query epsilon
     double epsilon = 0.0;
-    if (argc == 5) epsilon = atof(argv[4]);
+    if (argc >= 5) epsilon = atof(argv[4]);
 
     //run queries
     clock_gettime(CLOCK_REALTIME, &start); 
     for (int i = 0; i < q_count; ++i) { 
 
-        std::list<std::pair<Point *, double> > qr = kt.knn(nn, queries[i], epsilon);  
+        std::list<std::pair<Point *, double> > qr = kt->knn(nn, queries[i], epsilon);  
 
         std::cout << "query " << i << ": (";
         for (int d = 0; d < dim; ++d) { 
@@ -185,6 +196,7 @@ int main(int argc, char **argv)
 
     std::cout << "done." << std::endl;
 
+    delete kt;
     delete[] pts;
     delete[] queries; 
 
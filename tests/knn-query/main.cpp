@@ -126,7 +126,7 @@ int main(int argc, char **argv)
 { 
     if (argc < 4) {
         fprintf(stderr,
-            "usage: knn <pts> <samples> <maxdepth> [queries] [nn] [epsilon]\n)");
+            "usage: knn <pts> <samples> <maxdepth> [queries] [nn] [epsilon] [threads]\n)");
         return 1;
     }
 
@@ -184,11 +184,44 @@ int main(int argc, char **argv)
 
     //read query epsilon
     double epsilon = 0.0;
-    if (argc == 7) epsilon = atof(argv[6]);
+    if (argc >= 7) epsilon = atof(argv[6]);
+
+    //number of threads for batch queries, zero to run queries one at a time
+    int threads = 0;
+    if (argc >= 8) threads = atoi(argv[7]);
 
     //run queries
     clock_gettime(CLOCK_REALTIME, &start); 
-    if (nn == 1) {
+    if (threads > 0) {
+
+        ThreadPool pool(threads);
+        std::pair<Point *, double> *qr = new std::pair<Point *, double>[p*nn];
+
+        if (nn == 1) oot.nn_batch(queries, p, epsilon, qr, pool);
+        else oot.knn_batch(nn, queries, p, epsilon, qr, pool);
+
+        for (int i = 0; i < p; ++i) { 
+
+            std::cout << "query " << i << ": (";
+            for (int d = 0; d < Point::dim; ++d) { 
+                std::cout << queries[i][d];
+                if (d + 1 < Point::dim) std::cout << ", ";
+            }
+            std::cout << ")\n";
+
+            for (int j = 0; j < nn && qr[i*nn + j].first; ++j) {
+                std::cout << "("; 
+                for (int d = 0; d < Point::dim; ++d) {
+                    std::cout << (*qr[i*nn + j].first)[d];
+                    if (d + 1 < Point::dim) std::cout << ", ";
+                }
+                std::cout << ") " << qr[i*nn + j].second << "\n"; 
+            } 
+        }
+
+        delete[] qr;
+
+    } else if (nn == 1) {
 
         for (int i = 0; i < p; ++i) { 
 
@@ -44,32 +44,36 @@ struct Point {
 
 #ifdef ODDSON_TREE_KDTREE_IMPLEMENTATION
 
-void render_tree(FILE *f, struct KdTree<OddsonTree<Point>::CachedPoint, double>::Node *tree,
+typedef KdTree<OddsonTree<Point>::CachedPoint, double> CacheTree;
+
+void render_tree(FILE *f, OddsonTree<Point> &oot, CacheTree::Node *tree,
     size_t depth, double x1, double x2, double y1, double y2)
 {
     //check for empty branch
     if (!tree) return;
 
-    if (!tree->children) {
+    OddsonTree<Point>::CachedPoint *pt = oot.cache()->point(tree);
+
+    if (tree->is_leaf()) {
         //leaf
-        if (tree->pt->nn) {
-            //fprintf(f, "colour-site-%d\n", tree->pt->nn->id);
-            //fprintf(f, "%.0f %.0f draw-point\n", (*tree->pt)[0], (*tree->pt)[1]);
+        if (pt->nn) {
+            //fprintf(f, "colour-site-%d\n", oot.neighbour(pt)->id);
+            //fprintf(f, "%.0f %.0f draw-point\n", (*pt)[0], (*pt)[1]);
         }
 
     } else { 
         if (depth % 2 == 1) {
             //fprintf(f, "%.0f %.0f %.0f h-line\n", x1, x2, tree->median);
-            render_tree(f, tree->left(), depth + 1, x1, x2, y1, tree->median);
-            render_tree(f, tree->right(), depth + 1, x1, x2, tree->median, y2);
+            render_tree(f, oot, tree->left(), depth + 1, x1, x2, y1, tree->median);
+            render_tree(f, oot, tree->right(), depth + 1, x1, x2, tree->median, y2);
         } else {
             //fprintf(f, "%.0f %.0f %.0f v-line\n", tree->median, y1, y2);
-            render_tree(f, tree->left(), depth + 1, x1, tree->median, y1, y2);
-            render_tree(f, tree->right(), depth + 1, tree->median, x2, y1, y2);
+            render_tree(f, oot, tree->left(), depth + 1, x1, tree->median, y1, y2);
+            render_tree(f, oot, tree->right(), depth + 1, tree->median, x2, y1, y2);
         }
 
-        if (tree->pt->terminal) { 
-            fprintf(f, "colour-site-%d\n", tree->pt->nn->pt->id);
+        if (pt->terminal) { 
+            fprintf(f, "colour-site-%ld\n", oot.neighbour(pt)->id);
             fprintf(f, "%.0f %.0f %.0f %.0f node-bounds\n", x1, x2, y1, y2);
         } 
     }
@@ -97,8 +101,8 @@ void render_tree(FILE *f, CompressedQuadtree<OddsonTree<Point>::CachedPoint>::No
     if (!tree->nodes) {
         fprintf(f, "%.0f %.0f draw-point\n", (*tree->pt)[0], (*tree->pt)[1]);
     } else { 
-        for (int i = 0; i < 4; ++i) {
-            if (tree->nodes[i]) render_tree(f, tree->nodes[i], depth+1, 0.0, 0.0, 0.0, 0.0);
+        for (size_t i = 0; i < tree->child_count(2); ++i) {
+            render_tree(f, tree->nodes[i], depth+1, 0.0, 0.0, 0.0, 0.0);
         } 
     } 
 }
@@ -115,7 +119,7 @@ Point *read_points(FILE *f, int *pt_count)
     fscanf(f, "%d", pt_count);
     fgets(buf, 80, f);
 
-    if (pt_count < 0) {
+    if (*pt_count < 0) {
         fprintf(stderr, "error: invalid point count %d\n", *pt_count);
         return 0;
     }
@@ -261,7 +265,11 @@ int main(int argc, char **argv)
     }
 
     OddsonTree<Point> oot(2, pts, n, sample, m, maxdepth);
-    render_tree(stdout, oot.cache->root, 1, x1, x2, y1, y2); 
+#ifdef ODDSON_TREE_KDTREE_IMPLEMENTATION
+    render_tree(stdout, oot, oot.cache()->root, 1, x1, x2, y1, y2); 
+#else
+    render_tree(stdout, oot.cache()->root, 1, x1, x2, y1, y2); 
+#endif
 
     delete[] pts;
     delete[] sample;
@@ -24,7 +24,11 @@ THE SOFTWARE.
 #include <iostream>
 
 #include "oddson_tree.h" 
+#include "compressed_quadtree.h" 
+#include "linear_quadtree.h" 
 #include "kdtree.h" 
+#include "dynamic_kdtree.h" 
+#include "skip_quadtree.h" 
 
 struct Point {
 
@@ -73,6 +77,95 @@ bool pred(std::pair<Point *, double> &fst, std::pair<Point *, double> &snd)
     return !(*fst.first != *snd.first);
 } 
 
+//ends the build of a quadtree below a fixed depth
+struct QuadtreeDepthLimit : public CompressedQuadtree<Point>::EndBuildFn {
+    virtual bool operator()(CompressedQuadtree<Point>::Node *, size_t depth)
+    {
+        return depth > 8;
+    }
+};
+
+bool same_quadtree(CompressedQuadtree<Point>::Node *a, CompressedQuadtree<Point>::Node *b)
+{
+    if (!a || !b) return a == b;
+
+    if (a->mid[0] != b->mid[0] || a->mid[1] != b->mid[1] || a->radius != b->radius
+        || a->pt != b->pt || a->count != b->count || a->ended != b->ended
+        || !a->nodes != !b->nodes) {
+        return false;
+    }
+
+    for (size_t n = 0; a->nodes && n < 4; ++n) {
+        if (!same_quadtree(a->child(n, 2), b->child(n, 2))) return false;
+    }
+
+    return true;
+}
+
+//keeps the first few points found by a range search
+struct FirstPoints : public KdTree<Point, double>::RangeVisitor {
+    FirstPoints(size_t limit) : limit(limit)
+    {
+    }
+
+    virtual bool operator()(Point *pt)
+    {
+        found.push_back(pt);
+        return found.size() < limit;
+    }
+
+    size_t limit;
+    std::vector<Point *> found;
+};
+
+//counts the range search and count errors of tree, whose points are pts[0, N)
+int range_errors(KdTree<Point, double> &tree, Point *pts, size_t queries)
+{
+    int errors = 0;
+    for (size_t i = 0; i < queries; ++i) {
+        double range[4];
+        for (size_t d = 0; d < 2; ++d) {
+            range[d*2] = 500*(double)rand()/(double)RAND_MAX;
+            range[d*2 + 1] = range[d*2] + 50*(double)rand()/(double)RAND_MAX;
+        }
+
+        std::vector<Point *> expected;
+        for (size_t j = 0; j < N; ++j) {
+            if (pts[j][0] >= range[0] && pts[j][0] <= range[1]
+                && pts[j][1] >= range[2] && pts[j][1] <= range[3] && !tree.is_removed(&pts[j])) {
+                expected.push_back(&pts[j]);
+            }
+        }
+
+        std::vector<Point *> qr = tree.range_search(range);
+        std::sort(qr.begin(), qr.end());
+
+        //a search ended early should stop at exactly the points asked for
+        FirstPoints first(10);
+        bool completed = tree.range_search(range, first);
+
+        if (qr != expected || tree.range_count(range) != expected.size()
+            || completed != (expected.size() < 10)
+            || first.found.size() != std::min<size_t>(expected.size(), 10)) {
+            ++errors;
+        }
+    }
+
+    return errors;
+}
+
+//walks down from node to the deepest node holding pt
+CompressedQuadtree<Point>::Node *walk_quadtree(CompressedQuadtree<Point>::Node *node, const Point &pt)
+{
+    while (node && node->nodes) {
+        CompressedQuadtree<Point>::Node *child = node->child(node->quadrant(pt, 2), 2);
+        if (!child || !child->in_node(pt, 2)) break;
+        node = child;
+    }
+
+    return node;
+}
+
 int main(int argc, char **argv) 
 {
     int k = 1; 
@@ -91,14 +184,83 @@ int main(int argc, char **argv)
     Point *ps2 = new Point[N]; 
     memcpy(ps2, ps, N*sizeof(Point));
 
+    Point *ps3 = new Point[N]; 
+    memcpy(ps3, ps, N*sizeof(Point));
+
+    Point *ps4 = new Point[N]; 
+    memcpy(ps4, ps, N*sizeof(Point));
+
+    Point *ps5 = new Point[N]; 
+    memcpy(ps5, ps, N*sizeof(Point));
+
     //generate query points 
     Point *qs = new Point[M]; 
     for (size_t i = 0; i < M; ++i) { 
         qs[i] = distfn();
     }
 
+    ThreadPool pool;
+
     OddsonTree<Point> oot(2, ps, N, qs, M, MAX_DEPTH); 
-    KdTree<Point, double> kdt(2, ps2, N); 
+    KdTree<Point, double> kdt(2, ps2, N, pool); 
+
+    //built in parallel with the centre test and a fixed dimension, used for the batch queries below
+    OddsonTree<Point, 2> poot(2, ps3, N, qs, M, MAX_DEPTH, pool, CentreTest); 
+
+#ifdef ODDSON_TREE_QUADTREE_IMPLEMENTATION
+    //the batch queries of poot locate points through a linear quadtree
+    poot.enable_linear_index();
+#endif
+
+    //parallel builds should reorder the points exactly as serial builds do,
+    //both for kdt and for the bucketed backup trees of oot and poot
+    {
+        KdTree<Point, double> serial_kdt(2, ps4, N);
+    }
+
+    if (memcmp(ps2, ps4, N*sizeof(Point)) || memcmp(ps, ps3, N*sizeof(Point))) {
+        std::cerr << "error: parallel kd-tree build differs from serial build\n";
+    }
+
+    //quadtrees built from points sorted by Morton key should be the same as
+    //those built by splitting the points, with and without an early end
+    {
+        double range[4] = {0.0, 500.0, 0.0, 500.0};
+        CompressedQuadtree<Point>::EndBuildFn full;
+        QuadtreeDepthLimit limited;
+
+        CompressedQuadtree<Point> split(2, qs, M, range, full);
+        CompressedQuadtree<Point> morton(2, qs, M, range, full,
+            CompressedQuadtree<Point>::MortonOrder(), pool);
+        CompressedQuadtree<Point> split_limited(2, qs, M, range, limited, pool);
+        CompressedQuadtree<Point> morton_limited(2, qs, M, range, limited,
+            CompressedQuadtree<Point>::MortonOrder());
+
+        if (!same_quadtree(split.root, morton.root)
+            || !same_quadtree(split_limited.root, morton_limited.root)) {
+            std::cerr << "error: Morton order quadtree build differs from split build\n";
+        }
+
+        //locating points in a linear quadtree, and then walking down any
+        //tolerance left, should find the node a walk from the root does
+        LinearQuadtree<Point> linear(2, morton.root);
+
+        int linear_errors = 0;
+        for (size_t i = 0; i < Q/10; ++i) { 
+            Point pt = i % 2 ? distfn() : qs[i % M];
+
+            CompressedQuadtree<Point>::Node *node = morton.root->in_node(pt, 2) ? morton.root : 0;
+            CompressedQuadtree<Point>::Node *found = linear.locate(pt);
+
+            if (walk_quadtree(node, pt) != walk_quadtree(found, pt)) ++linear_errors;
+        }
+
+        std::cerr << "# of linear quadtree errors: " << linear_errors << " of " << Q/10 << " : "
+             << (float)linear_errors/(float)(Q/10)*100.0f << " percent.\n";
+    }
+
+    //searches should be unaffected by the layout of the nodes
+    kdt.relayout();
 
     int errors = 0;
 
@@ -128,5 +290,385 @@ int main(int argc, char **argv)
 
     std::cerr << "# of errors: " << errors << " of " << Q << " : "
          << (float)errors/(float)Q*100.0f << " percent.\n";
+
+    //a tree built without a sample should refine its cache from the queries alone
+    {
+        OddsonTree<Point> aoot(2, ps5, N, qs, 0, MAX_DEPTH); 
+        aoot.enable_refinement();
+
+        int adaptive_errors = 0;
+        for (size_t i = 0; i < Q; ++i) { 
+            Point pt = distfn();
+
+            std::list<std::pair<Point *, double> > qr = aoot.nn(pt, 0.0); 
+            std::list<std::pair<Point *, double> > qr2 = kdt.knn(1, pt, 0.0); 
+
+            if (!std::equal(qr.begin(), qr.end(), qr2.begin(), pred)) {   
+                ++adaptive_errors; 
+            } 
+        }
+
+        std::cerr << "# of adaptive errors: " << adaptive_errors << " of " << Q << " : "
+             << (float)adaptive_errors/(float)Q*100.0f << " percent.\n";
+    }
+
+    //when the queries move away from the sample the cache should be rebuilt
+    //around them in the background, without disturbing the results
+    {
+        OddsonTree<Point> roo(2, ps5, N, qs, M, MAX_DEPTH); 
+        roo.enable_rebuild(0.1, M, MAX_DEPTH, 1 << 14);
+
+        int rebuild_errors = 0;
+        for (size_t i = 0; i < Q; ++i) { 
+            Point pt = distfn();
+            if (i >= Q/4) {
+                pt[0] -= 150.0;
+                pt[1] += 150.0;
+            }
+
+            std::list<std::pair<Point *, double> > qr = roo.nn(pt, 0.0); 
+            std::list<std::pair<Point *, double> > qr2 = kdt.knn(1, pt, 0.0); 
+
+            if (!std::equal(qr.begin(), qr.end(), qr2.begin(), pred)) {   
+                ++rebuild_errors; 
+            } 
+        }
+
+        std::cerr << "# of rebuild errors: " << rebuild_errors << " of " << Q << " : "
+             << (float)rebuild_errors/(float)Q*100.0f << " percent.\n";
+
+        if (roo.rebuild_count() == 0) {
+            std::cerr << "error: cache was not rebuilt after the queries moved\n";
+        }
+    }
+
+    //range searches and counts should find exactly the points in range,
+    //with and without buckets, and with counts of the points below each
+    //node kept as points are removed
+    {
+        KdTree<Point, double> bucketed(2, ps4, N, KdTree<Point, double>::Buckets());
+
+        int range_search_errors = range_errors(kdt, ps2, Q/4000) + range_errors(bucketed, ps4, Q/4000);
+
+        kdt.count_subtrees();
+        bucketed.count_subtrees();
+        for (size_t i = 0; i < N; i += 7) {
+            bucketed.remove(ps[i]);
+        }
+
+        range_search_errors += range_errors(kdt, ps2, Q/4000) + range_errors(bucketed, ps4, Q/4000);
+
+        std::cerr << "# of range search errors: " << range_search_errors << " of " << Q/1000 << " : "
+             << (float)range_search_errors/(float)(Q/1000)*100.0f << " percent.\n";
+    }
+
+    //radius searches should find exactly the points within the radius,
+    //whether or not the cache of oot rules them all out, and the same
+    //for a quadtree over the query points, whose range counts should be
+    //exact without an eps and within the shrunken and grown ranges with one.
+    //A tree whose build was ended early counts those cells only whole, the
+    //same before and after count_subtrees
+    {
+        double range[4] = {qs[0][0], qs[0][0], qs[0][1], qs[0][1]};
+        for (size_t i = 0; i < M; ++i) {
+            for (size_t d = 0; d < 2; ++d) {
+                range[d*2] = std::min(range[d*2], qs[i][d]);
+                range[d*2 + 1] = std::max(range[d*2 + 1], qs[i][d]);
+            }
+        }
+
+        CompressedQuadtree<Point>::EndBuildFn full;
+        CompressedQuadtree<Point> quadtree(2, qs, M, range, full);
+
+        QuadtreeDepthLimit limited;
+        CompressedQuadtree<Point> limited_quadtree(2, qs, M, range, limited);
+
+        int radius_errors = 0;
+        for (size_t i = 0; i < Q/1000; ++i) {
+            Point pt = distfn();
+            double r = 3*(double)rand()/(double)RAND_MAX;
+
+            size_t expected = 0;
+            for (size_t j = 0; j < N; ++j) {
+                double dx = ps[j][0] - pt[0], dy = ps[j][1] - pt[1];
+                if (dx*dx + dy*dy <= r*r) ++expected;
+            }
+
+            size_t expected_queries = 0;
+            for (size_t j = 0; j < M; ++j) {
+                double dx = qs[j][0] - pt[0], dy = qs[j][1] - pt[1];
+                if (dx*dx + dy*dy <= r*r) ++expected_queries;
+            }
+
+            std::vector<Point *> qr = kdt.radius_search(pt, r);
+
+            if (kdt.radius_count(pt, r) != expected || qr.size() != expected
+                || oot.radius_count(pt, r) != expected
+                || quadtree.radius_count(pt, r) != expected_queries) {
+                ++radius_errors;
+            }
+        }
+
+        //a ball holding every point is never answered by the cache alone
+        OddsonTree<Point>::QueryContext radius_ctx;
+        for (size_t i = 0; i < Q/1000; ++i) {
+            if (oot.radius_count(distfn(), 1000.0, radius_ctx) != N) ++radius_errors;
+        }
+
+        if (radius_ctx.hits) {
+            std::cerr << "error: radius queries searching the backup tree counted as cache hits\n";
+        }
+
+        std::cerr << "# of radius search errors: " << radius_errors << " of " << Q/1000 << " : "
+             << (float)radius_errors/(float)(Q/1000)*100.0f << " percent.\n";
+
+        int range_count_errors = 0;
+        double everything[4] = {-1e9, 1e9, -1e9, 1e9};
+        if (limited_quadtree.range_count(everything) != M) ++range_count_errors;
+
+        std::vector<double> limited_ranges;
+        std::vector<size_t> limited_counts;
+        for (size_t i = 0; i < Q/1000; ++i) {
+            Point pt = distfn();
+            double half[2] = {20*(double)rand()/(double)RAND_MAX, 20*(double)rand()/(double)RAND_MAX};
+
+            double scales[3] = {0.9, 1.0, 1.1};
+            size_t expected[3] = {0, 0, 0};
+            for (size_t j = 0; j < M; ++j) {
+                for (size_t scale = 0; scale < 3; ++scale) {
+                    double f = scales[scale];
+                    if (std::abs(qs[j][0] - pt[0]) <= f*half[0] && std::abs(qs[j][1] - pt[1]) <= f*half[1]) {
+                        ++expected[scale];
+                    }
+                }
+            }
+
+            double range[4] = {pt[0] - half[0], pt[0] + half[0], pt[1] - half[1], pt[1] + half[1]};
+
+            if (i == Q/2000) quadtree.count_subtrees();
+
+            size_t exact = quadtree.range_count(range);
+            size_t approximate = quadtree.range_count(range, 0.1);
+
+            if (exact != expected[1] || approximate < expected[0] || approximate > expected[2]) {
+                ++range_count_errors;
+            }
+
+            size_t limited_count = limited_quadtree.range_count(range);
+            if (limited_count > expected[1]) ++range_count_errors;
+            limited_ranges.insert(limited_ranges.end(), range, range + 4);
+            limited_counts.push_back(limited_count);
+        }
+
+        //the counts of the limited tree should not change once recounted
+        limited_quadtree.count_subtrees();
+        if (limited_quadtree.range_count(everything) != M) ++range_count_errors;
+        for (size_t i = 0; i < limited_counts.size(); ++i) {
+            if (limited_quadtree.range_count(&limited_ranges[i*4]) != limited_counts[i]) {
+                ++range_count_errors;
+            }
+        }
+
+        std::cerr << "# of quadtree range count errors: " << range_count_errors << " of " << Q/1000 << " : "
+             << (float)range_count_errors/(float)(Q/1000)*100.0f << " percent.\n";
+    }
+
+    //a dynamic tree, and a tree without buckets the same points were removed
+    //from, should give the same results as a static tree built over the
+    //points left after a series of insertions and removals
+    {
+        DynamicKdTree<Point, double> dyn(2, ps, N/2);
+
+        for (size_t i = N/2; i < N; ++i) {
+            dyn.insert(ps[i]);
+            if ((i - N/2) % 3 == 0) dyn.remove(ps[i - N/2]);
+        }
+
+        for (size_t i = N/2; i < N; ++i) {
+            if (i % 3 == 0) dyn.remove(ps[i]);
+        }
+
+        std::vector<Point> left;
+        for (size_t i = 0; i < N; ++i) {
+            if (i % 3) left.push_back(ps[i]);
+        }
+
+        KdTree<Point, double> static_kdt(2, &left[0], left.size(), KdTree<Point, double>::Buckets());
+
+        //the same points removed from a tree without buckets
+        std::vector<Point> all(ps, ps + N);
+        KdTree<Point, double> removed_kdt(2, &all[0], N);
+        for (size_t i = 0; i < N; i += 3) {
+            removed_kdt.remove(ps[i]);
+        }
+
+        int dynamic_errors = 0;
+        if (dyn.size() != left.size() || dyn.remove(ps[0])) {
+            std::cerr << "error: dynamic kd-tree holds the wrong points\n";
+            dynamic_errors = Q;
+        }
+
+        for (size_t i = 0; i < Q/10; ++i) { 
+            Point pt = distfn();
+
+            std::list<std::pair<Point *, double> > qr = dyn.knn(k, pt, 0.0); 
+            std::list<std::pair<Point *, double> > qr2 = static_kdt.knn(k, pt, 0.0); 
+            std::list<std::pair<Point *, double> > qr3 = removed_kdt.knn(k, pt, 0.0); 
+
+            if (qr.size() != qr2.size() || !std::equal(qr.begin(), qr.end(), qr2.begin(), pred)
+                || qr3.size() != qr2.size() || !std::equal(qr3.begin(), qr3.end(), qr2.begin(), pred)) {   
+                ++dynamic_errors; 
+            } 
+        }
+
+        std::cerr << "# of dynamic errors: " << dynamic_errors << " of " << Q/10 << " : "
+             << (float)dynamic_errors/(float)(Q/10)*100.0f << " percent.\n";
+    }
+
+    //a skip quadtree should give the same results as a static tree built
+    //over the points left after a series of insertions and removals
+    {
+        double range[4] = {0.0, 500.0, 0.0, 500.0};
+        SkipQuadtree<Point> sqt(2, range);
+
+        size_t removed = 0;
+        for (size_t i = 0; i < N; ++i) {
+            sqt.insert(ps[i]);
+            if (i % 3 == 0) sqt.remove(ps[removed++]);
+        }
+
+        std::vector<Point> left(ps + removed, ps + N);
+
+        KdTree<Point, double> static_kdt(2, &left[0], left.size(), KdTree<Point, double>::Buckets());
+
+        int skip_errors = 0;
+        if (sqt.size() != left.size() || sqt.remove(ps[0]) || sqt.insert(ps[N - 1])) {
+            std::cerr << "error: skip quadtree holds the wrong points\n";
+            skip_errors = Q;
+        }
+
+        for (size_t i = 0; i < Q/10; ++i) { 
+            Point pt = distfn();
+
+            std::list<std::pair<Point *, double> > qr = sqt.knn(k, pt, 0.0); 
+            std::list<std::pair<Point *, double> > qr2 = static_kdt.knn(k, pt, 0.0); 
+
+            if (qr.size() != qr2.size() || !std::equal(qr.begin(), qr.end(), qr2.begin(), pred)) {   
+                ++skip_errors; 
+            } 
+        }
+
+        std::cerr << "# of skip quadtree errors: " << skip_errors << " of " << Q/10 << " : "
+             << (float)skip_errors/(float)(Q/10)*100.0f << " percent.\n";
+    }
+
+    //inserting and removing points near the queries should only retest the
+    //cells they affect, and queries in between should agree with a dynamic
+    //tree over the same points
+    {
+        OddsonTree<Point> moot(2, ps5, N, qs, M, MAX_DEPTH);
+        moot.enable_refinement();
+        DynamicKdTree<Point, double> mirror(2, ps5, N);
+
+        int mutation_errors = 0;
+        for (size_t i = 0; i < Q/10; ++i) {
+            if (i % 20 == 0) {
+                Point pt = distfn();
+                moot.insert(pt);
+                mirror.insert(pt);
+            } else if (i % 20 == 10) {
+                Point victim = *mirror.knn(1, distfn(), 0.0).front().first;
+                if (!moot.remove(victim) || !mirror.remove(victim)) ++mutation_errors;
+            }
+
+            Point pt = distfn();
+
+            std::list<std::pair<Point *, double> > qr = k == 1 ? moot.nn(pt, 0.0) : moot.knn(k, pt, 0.0);
+            std::list<std::pair<Point *, double> > qr2 = mirror.knn(k, pt, 0.0);
+
+            if (qr.size() != qr2.size() || !std::equal(qr.begin(), qr.end(), qr2.begin(), pred)) {
+                ++mutation_errors;
+            }
+
+            //radius searches cover the inserted points too
+            if (i % 100 == 0) {
+                double r = 3*(double)rand()/(double)RAND_MAX;
+                if (moot.radius_count(pt, r) != mirror.radius_count(pt, r)) ++mutation_errors;
+            }
+        }
+
+        std::cerr << "# of mutation errors: " << mutation_errors << " of " << Q/10 << " : "
+             << (float)mutation_errors/(float)(Q/10)*100.0f << " percent.\n";
+    }
+
+    //run the same queries as a batch spread across a thread pool
+    Point *batch = new Point[Q];
+    for (size_t i = 0; i < Q; ++i) {
+        batch[i] = distfn();
+    }
+
+    std::pair<Point *, double> *bqr = new std::pair<Point *, double>[Q*k];
+    std::pair<Point *, double> *bqr2 = new std::pair<Point *, double>[Q*k];
+
+    if (k == 1) {
+        poot.nn_batch(batch, Q, 0.0, bqr, pool);
+    } else {
+        poot.knn_batch(k, batch, Q, 0.0, bqr, pool);
+    }
+    kdt.knn_batch(k, batch, Q, 0.0, bqr2, pool);
+
+    int batch_errors = 0;
+    for (size_t i = 0; i < Q; ++i) {
+        if (!std::equal(bqr + i*k, bqr + (i + 1)*k, bqr2 + i*k, pred)) {
+            ++batch_errors;
+        }
+    }
+
+    std::cerr << "# of batch errors: " << batch_errors << " of " << Q << " : "
+         << (float)batch_errors/(float)Q*100.0f << " percent.\n";
+
+    //trees saved to files and mapped back in should give the same results
+    const char *kdt_path = "test-oddson-tree-kdt.bin";
+    const char *poot_path = "test-oddson-tree-poot.bin";
+
+    KdTree<Point, double> *mapped_kdt = 0;
+    OddsonTree<Point, 2> *mapped_poot = 0;
+    if (kdt.save(kdt_path) && poot.save(poot_path)) {
+        mapped_kdt = KdTree<Point, double>::load(kdt_path);
+        mapped_poot = OddsonTree<Point, 2>::load(poot_path);
+    }
+
+    int mapped_errors = 0;
+    if (mapped_kdt && mapped_poot) {
+        KdTree<Point, double>::SearchContext ctx;
+
+        if (k == 1) {
+            mapped_poot->nn_batch(batch, Q, 0.0, bqr, pool);
+        } else {
+            mapped_poot->knn_batch(k, batch, Q, 0.0, bqr, pool);
+        }
+
+        for (size_t i = 0; i < Q; ++i) {
+            mapped_kdt->knn(k, batch[i], 0.0, bqr2 + i*k, ctx);
+            if (!std::equal(bqr + i*k, bqr + (i + 1)*k, bqr2 + i*k, pred)) {
+                ++mapped_errors;
+            }
+        }
+    } else {
+        std::cerr << "error: could not save and load trees\n";
+        mapped_errors = Q;
+    }
+
+    std::cerr << "# of mapped errors: " << mapped_errors << " of " << Q << " : "
+         << (float)mapped_errors/(float)Q*100.0f << " percent.\n";
+
+    delete mapped_poot;
+    delete mapped_kdt;
+    remove(kdt_path);
+    remove(poot_path);
+
+    delete[] bqr;
+    delete[] bqr2;
+    delete[] batch;
 }
 